@@ -0,0 +1,39 @@
+
+
+#ifndef _CRC8_H
+#  define _CRC8_H
+
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+
+/**
+ * @file
+ *
+ * @brief Dallas/Maxim CRC-8 shared by the motherboard and the modules.
+ *
+ * Same CRC as _crc_ibutton_update from avr-libc, but looked up a byte at a
+ *  time from a table in flash instead of going through the 8 bits, so it's
+ *  cheap enough to run on every byte in the SPI interrupt.
+ */
+
+
+extern const uint8_t crc8_table[256] PROGMEM; /**< CRC of every byte value. */
+
+
+/**
+ * @brief Updates a CRC with a byte.
+ *
+ *    @param crc CRC so far, 0 to start.
+ *    @param data Byte to add.
+ *    @return The updated CRC.
+ */
+static inline uint8_t crc8_update( uint8_t crc, uint8_t data )
+{
+   return pgm_read_byte( &crc8_table[ crc ^ data ] );
+}
+
+
+#endif /* _CRC8_H */
+
@@ -5,7 +5,6 @@
 #include <avr/wdt.h>
 #include <avr/sleep.h>
 #include <avr/interrupt.h>
-#include <util/crc16.h>
 #include <util/delay.h>
 
 #include <stdio.h>
@@ -19,6 +18,7 @@
 #include "spis.h"
 #include "sched.h"
 #include "current.h"
+#include "param.h"
 
 
 /*
@@ -38,8 +38,8 @@
  *  10 kHz = 20 kHz / 2
  */
 static uint8_t sched_mot_counter = 0; /**< Counter for the motor controller. */
-#define SCHED_MOTOR_TOP       60  /**< Motor control divider. */
 static uint8_t sched_heartbeat_counter = 0; /**< Counter for the heart beat. */
+uint8_t sched_motor_top = SCHED_MOTOR_TOP; /**< Divider for motor control, a parameter. */
 #define SCHED_HEARTBEAT_TOP  200 /**< Divider for heartbeat. */
 /* Scheduler state flags. */
 uint8_t sched_flags  = 0; /**< Scheduler flags. */
@@ -143,7 +143,7 @@ ISR( TIMER1_OVF_vect )
 
    /* Do some scheduler stuff here. */
    sched_mot_counter++;
-   if (sched_mot_counter >= SCHED_MOTOR_TOP) {
+   if (sched_mot_counter >= sched_motor_top) {
       sched_flags |= SCHED_MOTOR;
       sched_mot_counter = 0;
    }
@@ -191,7 +191,6 @@ static inline void sched_init (void)
  */
 static inline void sched_run( uint8_t flags )
 {
-   uint8_t i;
    /*
     * Run tasks.
     *
@@ -201,38 +200,14 @@ static inline void sched_run( uint8_t flags )
    if (flags & SCHED_HEARTBEAT) {
       heartbeat_update();
       current_startSample();
-   }
-   if (flags & SCHED_SPIS_PREP_MOTORGET) {
-      spis_buf[0] = (uint8_t)(mot0.feedback>>8);
-      spis_buf[1] = (uint8_t)mot0.feedback;
-      spis_buf[2] = (uint8_t)(mot1.feedback>>8);
-      spis_buf[3] = (uint8_t)mot1.feedback;
-      /*
-      spis_buf[0] = 0x31;
-      spis_buf[1] = 0x32;
-      spis_buf[2] = 0x33;
-      spis_buf[3] = 0x34;
-       */
-      for (i=0; i<4; i++)
-         spis_crc    = _crc_ibutton_update( spis_crc, spis_buf[i] );
-   }
-   if (flags & SCHED_SPIS_PREP_CURRENT) {
-      spis_buf[0] = current_buffer[0];
-      spis_buf[1] = current_buffer[1];
-      spis_buf[2] = current_buffer[2];
-      spis_buf[3] = current_buffer[3];
-      /*
-      spis_buf[0] = 0x41;
-      spis_buf[1] = 0x42;
-      spis_buf[2] = 0x43;
-      spis_buf[3] = 0x44;
-       */
-      for (i=0; i<4; i++)
-         spis_crc    = _crc_ibutton_update( spis_crc, spis_buf[i] );
+      param_update(); /* Paces saving to the EEPROM. */
    }
    if (flags & SCHED_MOTOR) {
       motor_control();
+      spis_publish();
    }
+   if (flags & SCHED_PARAM)
+      param_update();
 }
 
 
@@ -250,13 +225,16 @@ static inline void init (void)
    /* Heartbeat init. */
    heartbeat_init();
 
-   /* Communication subsystem. */
-   spis_init();
-
    /* Motor subsystem. */
    motor_init();
    encoder_init();
 
+   /* Saved controller parameters over the defaults. */
+   param_init();
+
+   /* Communication subsystem, reports the parameters. */
+   spis_init();
+
    /* ADC subsystem. */
 #if (HWVER > 2)
    current_init();
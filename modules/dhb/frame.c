@@ -0,0 +1,124 @@
+
+
+#include "frame.h"
+
+#include <stddef.h>
+#include <avr/pgmspace.h>
+
+#include "crc8.h"
+#include "hbridge.h"
+
+
+/**
+ * @brief Lengths of the frames of a command.
+ */
+typedef struct frame_cmd_s {
+   uint8_t req; /**< Data bytes of the request. */
+   uint8_t reply; /**< Data bytes of the reply. */
+} frame_cmd_t;
+
+
+/**
+ * @brief Frames of every command, indexed by command.
+ */
+static const frame_cmd_t frame_cmds[] PROGMEM = {
+   [DHB_CMD_NONE]     = { .req = 0,             .reply = 0 },
+   [DHB_CMD_VERSION]  = { .req = 0,             .reply = 1 },
+   [DHB_CMD_MODESET]  = { .req = 1,             .reply = 0 },
+   [DHB_CMD_MODEGET]  = { .req = 0,             .reply = 1 },
+   [DHB_CMD_MOTORSET] = { .req = 4,             .reply = 0 },
+   [DHB_CMD_MOTORGET] = { .req = 0,             .reply = 4 },
+   [DHB_CMD_CURRENT]  = { .req = 0,             .reply = 4 },
+   [DHB_CMD_CYCLE]    = { .req = 4,             .reply = 8 },
+   [DHB_CMD_IDENT]    = { .req = 0,             .reply = DHB_IDENT_LEN },
+   [DHB_CMD_PARAMSET] = { .req = 3,             .reply = 0 },
+   [DHB_CMD_PARAMGET] = { .req = 1,             .reply = 3 },
+   [DHB_CMD_PARAMSAVE] = { .req = 0,            .reply = 0 }
+};
+#define FRAME_CMDS   (sizeof(frame_cmds)/sizeof(frame_cmd_t))
+
+
+uint8_t frame_reqLen( uint8_t cmd )
+{
+   if (cmd >= FRAME_CMDS)
+      return FRAME_INVALID;
+   return pgm_read_byte( &frame_cmds[cmd].req );
+}
+
+
+uint8_t frame_replyLen( uint8_t cmd )
+{
+   if (cmd >= FRAME_CMDS)
+      return 0;
+   return pgm_read_byte( &frame_cmds[cmd].reply );
+}
+
+
+uint8_t frame_crc( uint8_t cmd, const uint8_t *data, uint8_t len )
+{
+   uint8_t i, crc;
+
+   crc = crc8_update( 0, cmd );
+   for (i=0; i<len; i++)
+      crc = crc8_update( crc, data[i] );
+   return crc;
+}
+
+
+uint8_t frame_encode( uint8_t *buf, uint8_t pipe, uint8_t cmd, uint8_t prev )
+{
+   uint8_t len, total, n;
+
+   /* Header, command, data already in place and CRC. */
+   n        = frame_reqLen( cmd );
+   buf[0]   = pipe ? DHB_HEADER_PIPE : DHB_HEADER;
+   buf[1]   = cmd;
+   buf[n+2] = frame_crc( cmd, &buf[2], n );
+   len      = n+3;
+
+   /* Room for the reply. */
+   if (pipe) {
+      /* Previous command, its data and CRC. */
+      total = frame_replyLen( prev ) + 2;
+      while (len < total)
+         buf[ len++ ] = 0;
+   }
+   else {
+      /* Reply and its CRC, classic version reply predates CRCs. */
+      n = frame_replyLen( cmd );
+      if ((n > 0) && (cmd != DHB_CMD_VERSION))
+         n++;
+      /* Counting up so the last byte never looks like a header. */
+      for (total=0; total<n; total++)
+         buf[ len++ ] = total+1;
+   }
+
+   return len;
+}
+
+
+const uint8_t* frame_decode( const uint8_t *buf, uint8_t pipe, uint8_t cmd )
+{
+   uint8_t n;
+   const uint8_t *data;
+
+   /* Reply is led by the command, classic ones come after the echo. */
+   if (pipe) {
+      if (buf[0] != cmd)
+         return NULL;
+      data = &buf[1];
+   }
+   else {
+      if (buf[2] != cmd)
+         return NULL;
+      data = &buf[ 3 + frame_reqLen( cmd ) ];
+      if (cmd == DHB_CMD_VERSION)
+         return data;
+   }
+
+   n = frame_replyLen( cmd );
+   if (frame_crc( cmd, data, n ) != data[n])
+      return NULL;
+   return data;
+}
+
@@ -0,0 +1,88 @@
+
+
+#ifndef _FRAME_H
+#  define _FRAME_H
+
+
+#include <stdint.h>
+
+
+/**
+ * @file
+ *
+ * @brief Frame codec of the Dual H-Bridge protocol, shared by the motherboard
+ *  driver and the module.
+ *
+ * Knows the request and reply length of every DHB_CMD_* and builds and checks
+ *  classic and pipelined frames (see hbridge.h). Requests are:
+ *
+ * @code
+ * HD CM D1... CRC P1...
+ * @endcode
+ *
+ * Where the padding lets the reply out: the classic reply plus its CRC, or
+ *  the previous reply when pipelined. Reply CRCs start at the command replied
+ *  to, see frame_crc.
+ */
+
+
+#define FRAME_INVALID   0xFF /**< Length of commands that don't exist. */
+#define FRAME_MAX       16 /**< Longest frame, a classic cycle. */
+
+
+/**
+ * @brief Gets the data bytes of a request.
+ *
+ *    @param cmd Command to check.
+ *    @return Data bytes or FRAME_INVALID if the command doesn't exist.
+ */
+uint8_t frame_reqLen( uint8_t cmd );
+
+
+/**
+ * @brief Gets the data bytes of a reply, not counting the CRC.
+ *
+ *    @param cmd Command to check.
+ *    @return Data bytes, 0 for unknown commands.
+ */
+uint8_t frame_replyLen( uint8_t cmd );
+
+
+/**
+ * @brief Calculates the CRC of a reply.
+ *
+ *    @param cmd Command replied to, the CRC starts at it.
+ *    @param data Data of the reply.
+ *    @param len Length of the data.
+ *    @return The CRC.
+ */
+uint8_t frame_crc( uint8_t cmd, const uint8_t *data, uint8_t len );
+
+
+/**
+ * @brief Encodes a request in place.
+ *
+ *    @param buf Frame, request data must already be at buf[2], at least
+ *               FRAME_MAX bytes.
+ *    @param pipe Whether to send it pipelined.
+ *    @param cmd Command to send.
+ *    @param prev Command the pipelined frame carries the reply of.
+ *    @return Length of the frame to clock.
+ */
+uint8_t frame_encode( uint8_t *buf, uint8_t pipe, uint8_t cmd, uint8_t prev );
+
+
+/**
+ * @brief Decodes the reply clocked in with a request.
+ *
+ *    @param buf Bytes received while clocking the frame.
+ *    @param pipe Whether the frame was pipelined.
+ *    @param cmd Command replied to, the one sent if classic or the previous
+ *               one if pipelined.
+ *    @return The reply data or NULL if it's bad.
+ */
+const uint8_t* frame_decode( const uint8_t *buf, uint8_t pipe, uint8_t cmd );
+
+
+#endif /* _FRAME_H */
+
@@ -8,7 +8,36 @@
 /*
  * The version.
  */
-#define DHB_VERSION      0x02 /**< Version. */
+#define DHB_VERSION      0x05 /**< Version. */
+#define DHB_VERSION_CYCLE 0x03 /**< First version with DHB_CMD_CYCLE. */
+#define DHB_VERSION_IDENT 0x04 /**< First version with DHB_CMD_IDENT. */
+
+
+/*
+ * The frame headers.
+ *
+ * Pipelined frames carry the reply to the previous pipelined command instead
+ *  of their own, so the slave builds it between frames and the master only
+ *  pads when the reply is longer than the request:
+ *
+ *    0  1  2     n           m
+ * M 81 CM D1... CRC 00... 00
+ * S PC R1 R2... ... ... RCRC
+ *
+ * PC is the previous command, DHB_CMD_NONE if it failed, and RCRC is the
+ *  CRC of PC and the reply data. A classic frame or SS going up in the
+ *  middle of a frame drops the pending reply, so PC is DHB_CMD_NONE after.
+ */
+#define DHB_HEADER       0x80 /**< Reply comes in the same frame. */
+#define DHB_HEADER_PIPE  0x81 /**< Reply comes in the next frame. */
+
+
+/*
+ * The slave loads each reply byte from its SPI interrupt, so the master must
+ *  leave it this many cycles of its clock (DHB_IDENT_SPI*400 kHz) between
+ *  bytes.
+ */
+#define DHB_TURNAROUND   80 /**< Slave cycles between bytes. */
 
 
 /*
@@ -17,10 +46,56 @@
 #define DHB_CMD_NONE     0x00 /**< Invalid command. */
 #define DHB_CMD_VERSION  0x01 /**< Gets version. */
 #define DHB_CMD_MODESET  0x02 /**< Sets operating mode. */
-#define DHF_CMD_MODEGET  0x03 /**< Gets operating mode. */
+#define DHB_CMD_MODEGET  0x03 /**< Gets operating mode. */
 #define DHB_CMD_MOTORSET 0x04 /**< Sets motor velocity. */
 #define DHB_CMD_MOTORGET 0x05 /**< Gets motor velocity. */
 #define DHB_CMD_CURRENT  0x06 /**< Gets motor current. */
+#define DHB_CMD_CYCLE    0x07 /**< Sets motor velocity, gets velocity and current. */
+#define DHB_CMD_IDENT    0x08 /**< Gets identity and capabilities. */
+#define DHB_CMD_PARAMSET 0x09 /**< Sets a controller parameter. */
+#define DHB_CMD_PARAMGET 0x0A /**< Gets a controller parameter. */
+#define DHB_CMD_PARAMSAVE 0x0B /**< Stores the controller parameters in EEPROM. */
+
+
+/*
+ * The identity reply, DHB_IDENT_LEN bytes and then the CRC.
+ */
+#define DHB_IDENT_ID       0 /**< Module identifier, MODULE_ID_DHB. */
+#define DHB_IDENT_VERSION  1 /**< DHB_VERSION. */
+#define DHB_IDENT_CAPS     2 /**< DHB_CAP_* flags. */
+#define DHB_IDENT_MODES    3 /**< Bit per supported DHB_MODE_*. */
+#define DHB_IDENT_SPI      4 /**< Fastest SPI clock in 100 kHz, the slave runs at four times it. */
+#define DHB_IDENT_TELEM    5 /**< Telemetry rate in Hz, 16 bit. */
+#define DHB_IDENT_LEN      7 /**< Length of the identity. */
+
+
+/*
+ * The capabilities.
+ */
+#define DHB_CAP_CYCLE    (1<<0) /**< Supports DHB_CMD_CYCLE. */
+#define DHB_CAP_PIPE     (1<<1) /**< Supports DHB_HEADER_PIPE frames. */
+#define DHB_CAP_PARAM    (1<<2) /**< Supports the DHB_CMD_PARAM* commands. */
+
+
+/*
+ * The controller parameters.
+ *
+ * Set with the identifier and a 16 bit value, gets reply with both:
+ *
+ * M 81 09 ID VH VL CRC
+ * M 81 0A ID CRC
+ * S 0A ID VH VL RCRC
+ *
+ * Values out of range are ignored, the module boots with the ones last saved.
+ */
+#define DHB_PARAM_KP0      0x00 /**< Proportional gain of motor 0 in 1/16, 0 to 255. */
+#define DHB_PARAM_KI0      0x01 /**< Integral gain of motor 0 in 1/16, 0 to 255. */
+#define DHB_PARAM_WINDUP0  0x02 /**< Integral windup limit of motor 0, positive. */
+#define DHB_PARAM_KP1      0x03 /**< Proportional gain of motor 1 in 1/16, 0 to 255. */
+#define DHB_PARAM_KI1      0x04 /**< Integral gain of motor 1 in 1/16, 0 to 255. */
+#define DHB_PARAM_WINDUP1  0x05 /**< Integral windup limit of motor 1, positive. */
+#define DHB_PARAM_RATE     0x06 /**< Control and telemetry rate in Hz, 79 to 1000. */
+#define DHB_PARAM_N        0x07 /**< Number of parameters. */
 
 
 /*
@@ -307,4 +307,12 @@ inline void motor_mode( uint8_t mode )
 }
 
 
+/**
+ * @brief Gets the motor mode.
+ */
+inline uint8_t motor_getMode (void)
+{
+   return motor_curmode;
+}
+
 
@@ -0,0 +1,247 @@
+
+
+#include "param.h"
+
+#include "global.h"
+
+#include <stddef.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+
+#include "crc8.h"
+#include "hbridge.h"
+#include "motors.h"
+#include "sched.h"
+#include "spis.h"
+
+
+#define PARAM_LAYOUT    0x01 /**< Layout of the saved parameters, bump when it changes. */
+#define PARAM_RATE_MIN  ((SCHED_FREQ+254) / 255) /**< Slowest control rate the divider can do. */
+#define PARAM_RATE_MAX  (SCHED_FREQ / SCHED_MOTOR_MIN) /**< Fastest control rate. */
+
+
+/**
+ * @brief Controller parameters as saved in EEPROM.
+ */
+typedef struct param_store_s {
+   uint8_t layout; /**< PARAM_LAYOUT they were saved with. */
+   uint8_t kp[2]; /**< Proportional gains. */
+   uint8_t ki[2]; /**< Integral gains. */
+   int16_t windup[2]; /**< Windup limits. */
+   uint8_t motor_top; /**< Motor control divider. */
+   uint8_t crc; /**< CRC of all the above. */
+} param_store_t;
+
+
+static param_store_t param_ee EEMEM; /**< Saved parameters. */
+static param_store_t param_copy; /**< Parameters being saved. */
+static uint8_t param_savePos = sizeof(param_store_t); /**< Next byte to save, at the end when done. */
+static volatile uint8_t param_saveReq = 0; /**< Master asked to save. */
+static volatile uint8_t param_pend = 0; /**< Bit per parameter waiting to be applied. */
+static volatile int16_t param_pendValue[ DHB_PARAM_N ]; /**< Values waiting to be applied. */
+
+
+/*
+ * Prototypes.
+ */
+static uint8_t param_crc( const param_store_t *store );
+static uint8_t param_valid( uint8_t id, int16_t value );
+static void param_apply( uint8_t id, int16_t value );
+
+
+/**
+ * @brief Calculates the CRC of saved parameters.
+ *
+ *    @param store Parameters to check.
+ *    @return The CRC.
+ */
+static uint8_t param_crc( const param_store_t *store )
+{
+   uint8_t i, crc;
+   const uint8_t *p;
+
+   p   = (const uint8_t*) store;
+   crc = 0;
+   for (i=0; i<offsetof(param_store_t,crc); i++)
+      crc = crc8_update( crc, p[i] );
+   return crc;
+}
+
+
+void param_init (void)
+{
+   param_store_t store;
+
+   eeprom_read_block( &store, &param_ee, sizeof(param_store_t) );
+
+   /* Erased, half written or from an older firmware. */
+   if ((store.layout != PARAM_LAYOUT) || (store.crc != param_crc( &store )))
+      return;
+
+   mot0.kp         = store.kp[0];
+   mot0.ki         = store.ki[0];
+   mot0.windup     = store.windup[0];
+   mot1.kp         = store.kp[1];
+   mot1.ki         = store.ki[1];
+   mot1.windup     = store.windup[1];
+   sched_motor_top = store.motor_top;
+}
+
+
+/**
+ * @brief Checks if a parameter value is in range.
+ *
+ *    @param id DHB_PARAM_* to check.
+ *    @param value Value to check.
+ *    @return 1 if it can be set.
+ */
+static uint8_t param_valid( uint8_t id, int16_t value )
+{
+   switch (id) {
+      case DHB_PARAM_KP0:
+      case DHB_PARAM_KP1:
+      case DHB_PARAM_KI0:
+      case DHB_PARAM_KI1:
+         return ((value >= 0) && (value <= 0xFF));
+
+      case DHB_PARAM_WINDUP0:
+      case DHB_PARAM_WINDUP1:
+         return (value >= 0);
+
+      case DHB_PARAM_RATE:
+         return ((value >= PARAM_RATE_MIN) && (value <= PARAM_RATE_MAX));
+
+      default:
+         return 0;
+   }
+}
+
+
+/**
+ * @brief Applies a parameter, interrupts must be off.
+ *
+ *    @param id DHB_PARAM_* to set.
+ *    @param value Value to set, already checked.
+ */
+static void param_apply( uint8_t id, int16_t value )
+{
+   motor_t *mot;
+
+   mot = (id < DHB_PARAM_KP1) ? &mot0 : &mot1;
+   switch (id) {
+      case DHB_PARAM_KP0:
+      case DHB_PARAM_KP1:
+         mot->kp = value;
+         break;
+
+      case DHB_PARAM_KI0:
+      case DHB_PARAM_KI1:
+         mot->ki = value;
+         break;
+
+      case DHB_PARAM_WINDUP0:
+      case DHB_PARAM_WINDUP1:
+         mot->windup = value;
+         break;
+
+      case DHB_PARAM_RATE:
+         sched_motor_top = SCHED_FREQ / value;
+         /* Identity reports the telemetry rate. */
+         spis_identify();
+         break;
+
+      default:
+         break;
+   }
+}
+
+
+void param_set( uint8_t id, int16_t value )
+{
+   if (!param_valid( id, value ))
+      return;
+   param_pendValue[ id ] = value;
+   param_pend  |= _BV(id);
+   sched_flags |= SCHED_PARAM;
+}
+
+
+int16_t param_get( uint8_t id )
+{
+   const motor_t *mot;
+
+   /* Not applied yet. */
+   if ((id < DHB_PARAM_N) && (param_pend & _BV(id)))
+      return param_pendValue[ id ];
+
+   mot = (id < DHB_PARAM_KP1) ? &mot0 : &mot1;
+   switch (id) {
+      case DHB_PARAM_KP0:
+      case DHB_PARAM_KP1:
+         return mot->kp;
+
+      case DHB_PARAM_KI0:
+      case DHB_PARAM_KI1:
+         return mot->ki;
+
+      case DHB_PARAM_WINDUP0:
+      case DHB_PARAM_WINDUP1:
+         return mot->windup;
+
+      case DHB_PARAM_RATE:
+         return SCHED_FREQ / sched_motor_top;
+
+      default:
+         return 0;
+   }
+}
+
+
+void param_save (void)
+{
+   param_saveReq = 1;
+   sched_flags  |= SCHED_PARAM;
+}
+
+
+void param_update (void)
+{
+   uint8_t id, save;
+
+   /* Apply every parameter set since the last pass, before a save takes
+    *  them. Controller and replies never see half a parameter. */
+   cli();
+   for (id=0; id<DHB_PARAM_N; id++)
+      if (param_pend & _BV(id))
+         param_apply( id, param_pendValue[ id ] );
+   param_pend    = 0;
+   save          = param_saveReq;
+   param_saveReq = 0;
+   sei();
+
+   /* Only the main loop writes them, no need to lock. A save asked during
+    *  another one starts over. */
+   if (save) {
+      param_copy.layout    = PARAM_LAYOUT;
+      param_copy.kp[0]     = mot0.kp;
+      param_copy.ki[0]     = mot0.ki;
+      param_copy.windup[0] = mot0.windup;
+      param_copy.kp[1]     = mot1.kp;
+      param_copy.ki[1]     = mot1.ki;
+      param_copy.windup[1] = mot1.windup;
+      param_copy.motor_top = sched_motor_top;
+      param_copy.crc       = param_crc( &param_copy );
+      param_savePos        = 0;
+   }
+
+   /* Each write takes 3.3 ms, so never wait on the EEPROM and let the next
+    *  heartbeat carry on. Bytes that didn't change don't get written. */
+   while ((param_savePos < sizeof(param_store_t)) && eeprom_is_ready()) {
+      eeprom_update_byte( (uint8_t*)&param_ee + param_savePos,
+            ((uint8_t*)&param_copy)[ param_savePos ] );
+      param_savePos++;
+   }
+}
+
+
@@ -0,0 +1,56 @@
+
+
+#ifndef _PARAM_H
+#  define _PARAM_H
+
+
+#include <stdint.h>
+
+
+/**
+ * @brief Loads the controller parameters saved in EEPROM.
+ *
+ * Keeps the compiled in defaults if nothing valid was saved, must run after
+ *  motor_init.
+ */
+void param_init (void);
+
+
+/**
+ * @brief Sets a controller parameter, runs in the SPI interrupt.
+ *
+ * Gets applied by param_update from the main loop so the controller never
+ *  sees it half written, every parameter set before then is kept.
+ *
+ *    @param id DHB_PARAM_* to set.
+ *    @param value Value to set, ignored if out of range.
+ */
+void param_set( uint8_t id, int16_t value );
+
+
+/**
+ * @brief Gets a controller parameter.
+ *
+ *    @param id DHB_PARAM_* to get.
+ *    @return Value of the parameter, the one set if not applied yet, 0 if it
+ *            doesn't exist.
+ */
+int16_t param_get( uint8_t id );
+
+
+/**
+ * @brief Saves the controller parameters to EEPROM, runs in the SPI interrupt.
+ *
+ * The writing is paced by param_update, a byte per heartbeat.
+ */
+void param_save (void);
+
+
+/**
+ * @brief Applies set parameters and carries on saving them.
+ */
+void param_update (void);
+
+
+#endif /* _PARAM_H */
+
@@ -7,8 +7,13 @@
 extern uint8_t sched_flags; /**< Scheduler flags. */
 #define SCHED_HEARTBEAT             (1<<0) /**< HEARTBEAT Task. */
 #define SCHED_MOTOR                 (1<<1) /**< Motor control task. */
-#define SCHED_SPIS_PREP_MOTORGET    (1<<2)
-#define SCHED_SPIS_PREP_CURRENT     (1<<3)
+#define SCHED_PARAM                 (1<<2) /**< Parameter update task. */
+
+/* Scheduler timing. */
+#define SCHED_FREQ                  20000 /**< Scheduler frequency in Hz. */
+#define SCHED_MOTOR_TOP             60 /**< Default motor control divider, telemetry goes with it. */
+#define SCHED_MOTOR_MIN             20 /**< Fastest motor control divider, leaves time to finish. */
+extern uint8_t sched_motor_top; /**< Motor control divider in use. */
 
 inline void heartbeat_set( /*uint8_t rate0,*/ uint8_t rate1 );
 
@@ -1,16 +1,22 @@
 
 
+#include "global.h"
+
 #include "spis.h"
 
+#include <stddef.h>
 #include <avr/interrupt.h>
-#include <util/crc16.h>
 
 #include "ioconf.h"
 #include "motors.h"
 #include "hbridge.h"
 #include "comm.h"
 #include "current.h"
+#include "crc8.h"
+#include "frame.h"
 #include "sched.h"
+#include "param.h"
+#include "mod_def.h"
 
 
 /*
@@ -25,12 +31,38 @@
 
 #define SPIS_CMD_RESET() \
 spis_cmd_func = spis_cmd_start; \
-spis_pos = 0
+spis_pos = 0; \
+spis_snap = NULL
+
+
+/**
+ * @brief Telemetry the replies are made from, published every control tick.
+ */
+typedef struct spis_telem_s {
+   uint8_t data[8]; /**< Feedback of both motors and then their current. */
+   uint8_t crc_fbk; /**< CRC of the motor get reply. */
+   uint8_t crc_cur; /**< CRC of the current reply. */
+   uint8_t crc_cycle; /**< CRC of the cycle reply. */
+} spis_telem_t;
 
 
 static uint8_t spis_pos = 0;
-uint8_t spis_crc = 0;
-uint8_t spis_buf[5];
+static uint8_t spis_crc = 0;
+static uint8_t spis_buf[4];
+static spis_telem_t spis_telem[2]; /**< Double buffered telemetry. */
+static volatile uint8_t spis_telemFront = 0; /**< Telemetry replies come from. */
+static spis_telem_t * volatile spis_snap = NULL; /**< Telemetry of the frame being clocked. */
+static const uint8_t spis_version = DHB_VERSION; /**< Version reply. */
+static uint8_t spis_ident[ DHB_IDENT_LEN+1 ]; /**< Identity reply and its CRC. */
+static uint8_t spis_pipeCmd = DHB_CMD_NONE; /**< Pipelined command being received. */
+static uint8_t spis_pipeReq = 0; /**< Data bytes of the pipelined command. */
+static uint8_t spis_pipeOk  = 0; /**< Pipelined command received fine so far. */
+static uint8_t spis_pipeEnd = 0; /**< Length of the pipelined frame. */
+static uint8_t spis_pipePrev = DHB_CMD_NONE; /**< Command the pipelined reply is for. */
+static const uint8_t *spis_pipeData = NULL; /**< Data of the pipelined reply. */
+static uint8_t spis_pipeLen = 0; /**< Data bytes in the pipelined reply. */
+static uint8_t spis_pipeCrc = 0; /**< CRC of the pipelined reply. */
+static uint8_t spis_pipeBuf[3]; /**< Pipelined reply built by its command. */
 
 
 /*
@@ -42,6 +74,18 @@ static void spis_cmd_modeset (void);
 static void spis_cmd_motorset (void);
 static void spis_cmd_motorget (void);
 static void spis_cmd_current (void);
+static void spis_cmd_cycle (void);
+static void spis_cmd_ident (void);
+static void spis_cmd_modeget (void);
+static void spis_cmd_paramset (void);
+static void spis_cmd_paramget (void);
+static void spis_cmd_paramsave (void);
+static uint8_t spis_paramReply( uint8_t *buf );
+static void spis_cmd_pipe (void);
+static void spis_pipe_start (void);
+static void spis_pipe_out (void);
+static void spis_pipe_end (uint8_t ok);
+static void spis_pipe_reset (void);
 static void (*spis_cmd_func)(void) = spis_cmd_start;
 
 
@@ -62,12 +106,36 @@ inline void spis_init (void)
    /* Enable SPI */
    SPCR     = _BV(SPE) | _BV(SPIE);
 
+   /* Watch SS rising to drop frames the master cut short. */
+   PCMSK0  |= _BV(PCINT2);
+   PCICR   |= _BV(PCIE0);
+
    /* Clear the SPDF bit. */
    io_reg   = SPSR;
    io_reg   = SPDR;
 
    /* Reset the entire communication thingy. */
    SPIS_CMD_RESET();
+
+   /* Build the replies, they are valid before the first control tick. */
+   spis_identify();
+   spis_publish();
+}
+
+
+void spis_identify (void)
+{
+   uint16_t telem;
+
+   telem = SCHED_FREQ / sched_motor_top;
+   spis_ident[ DHB_IDENT_ID ]       = MODULE_ID_DHB;
+   spis_ident[ DHB_IDENT_VERSION ]  = DHB_VERSION;
+   spis_ident[ DHB_IDENT_CAPS ]     = DHB_CAP_CYCLE | DHB_CAP_PIPE | DHB_CAP_PARAM;
+   spis_ident[ DHB_IDENT_MODES ]    = _BV(DHB_MODE_PWM) | _BV(DHB_MODE_FBKS);
+   spis_ident[ DHB_IDENT_SPI ]      = F_CPU / 400000UL; /* Slave needs fck/4. */
+   spis_ident[ DHB_IDENT_TELEM+0 ]  = telem >> 8;
+   spis_ident[ DHB_IDENT_TELEM+1 ]  = telem & 0xFF;
+   spis_ident[ DHB_IDENT_LEN ]      = frame_crc( DHB_CMD_IDENT, spis_ident, DHB_IDENT_LEN );
 }
 
 
@@ -76,8 +144,18 @@ static void spis_cmd_start (void)
    uint8_t c = SPDR;
    /* Handle package start. */
    if (spis_pos==0) {
-      if (c == 0x80)
+      if (c == DHB_HEADER) {
          spis_pos = 1;
+         spis_pipe_reset(); /* Master is back to classic frames. */
+      }
+      else if (c == DHB_HEADER_PIPE) {
+         spis_cmd_func = spis_cmd_pipe;
+         spis_pos = 1;
+         spis_pipeEnd = 0xFF; /* Not known until the command. */
+         spis_pipe_start();
+         spis_pipe_out();
+         return;
+      }
       else {
          SPDR = 0;
          return;
@@ -100,22 +178,45 @@ static void spis_cmd_start (void)
             break;
 
          case DHB_CMD_MOTORGET:
-            sched_flags |= SCHED_SPIS_PREP_MOTORGET;
             spis_cmd_func = spis_cmd_motorget;
             break;
 
          case DHB_CMD_CURRENT:
-            sched_flags |= SCHED_SPIS_PREP_CURRENT;
             spis_cmd_func = spis_cmd_current;
             break;
 
+         case DHB_CMD_CYCLE:
+            spis_cmd_func = spis_cmd_cycle;
+            break;
+
+         case DHB_CMD_IDENT:
+            spis_cmd_func = spis_cmd_ident;
+            break;
+
+         case DHB_CMD_MODEGET:
+            spis_cmd_func = spis_cmd_modeget;
+            break;
+
+         case DHB_CMD_PARAMSET:
+            spis_cmd_func = spis_cmd_paramset;
+            break;
+
+         case DHB_CMD_PARAMGET:
+            spis_cmd_func = spis_cmd_paramget;
+            break;
+
+         case DHB_CMD_PARAMSAVE:
+            spis_cmd_func = spis_cmd_paramsave;
+            break;
+
          default:
             SPIS_CMD_RESET();
             LED0_ON();
             return;
       }
-      spis_pos = 0;
-      spis_crc = _crc_ibutton_update( 0, c );
+      spis_pos  = 0;
+      spis_crc  = crc8_update( 0, c );
+      spis_snap = &spis_telem[ spis_telemFront ];
    }
 
    /* Echo. */
@@ -146,7 +247,7 @@ static void spis_cmd_modeset (void)
       /* Echo recieved. */
       SPDR     = c;
       /* Update CRC. */
-      spis_crc = _crc_ibutton_update( spis_crc, c );
+      spis_crc = crc8_update( spis_crc, c );
    }
    else {
       /* Check CRC. */
@@ -178,7 +279,7 @@ static void spis_cmd_motorset (void)
       /* Echo recieved. */
       SPDR     = c;
       /* Update CRC. */
-      spis_crc = _crc_ibutton_update( spis_crc, c );
+      spis_crc = crc8_update( spis_crc, c );
    }
    /* Handle command. */
    else {
@@ -206,11 +307,11 @@ static void spis_cmd_motorset (void)
 static void spis_cmd_motorget (void)
 {
    if (spis_pos < 4) {
-      SPDR  = spis_buf[ spis_pos ];
+      SPDR  = spis_snap->data[ spis_pos ];
       spis_pos++;
    }
    else {
-      SPDR  = spis_crc;
+      SPDR  = spis_snap->crc_fbk;
       /* Clear command. */
       SPIS_CMD_RESET();
       LED0_OFF();
@@ -224,11 +325,179 @@ static void spis_cmd_motorget (void)
 static void spis_cmd_current (void)
 {
    if (spis_pos < 4) {
-      SPDR  = spis_buf[ spis_pos ];
+      SPDR  = spis_snap->data[ 4+spis_pos ];
+      spis_pos++;
+   }
+   else {
+      SPDR  = spis_snap->crc_cur;
+      /* Clear command. */
+      SPIS_CMD_RESET();
+      LED0_OFF();
+   }
+}
+
+
+/**
+ * @brief Handles SPI for the cycle command.
+ *
+ * Takes the targets like the motor set command and then replies with the
+ *  feedback and current of the same telemetry snapshot.
+ *
+ *          1  2  3  4  5  6  7  8  9 10 11 12 13 14 15
+ *    0  1  2  3  4  5  6  7  8  9 10 11 12 13 14 15
+ * M 80 CM T1 T2 T3 T4 CR X1 X2 X3 X4 X5 X6 X7 X8 X9
+ * S 00 80 CM T1 T2 T3 T4 F1 F2 F3 F4 C1 C2 C3 C4 CR
+ */
+static void spis_cmd_cycle (void)
+{
+   int16_t mota, motb;
+   uint8_t c = SPDR;
+   /* Still processing input. */
+   if (spis_pos < 4) {
+      /* Fill buffer. */
+      spis_buf[ spis_pos++ ] = c;
+      /* Echo recieved. */
+      SPDR     = c;
+      /* Update CRC. */
+      spis_crc = crc8_update( spis_crc, c );
+   }
+   /* Set targets and start the reply. */
+   else if (spis_pos == 4) {
+      /* Check CRC. */
+      if (c != spis_crc) {
+         SPIS_CMD_RESET();
+         LED0_ON();
+         return;
+      }
+      SPDR  = spis_snap->data[0];
+      spis_pos++;
+      /* Prepare arguments. */
+      mota  = (spis_buf[0]<<8) + spis_buf[1];
+      motb  = (spis_buf[2]<<8) + spis_buf[3];
+      /* Set motor. */
+      motor_set( mota, motb );
+   }
+   /* Reply. */
+   else if (spis_pos < 12) {
+      SPDR  = spis_snap->data[ spis_pos-4 ];
+      spis_pos++;
+   }
+   else {
+      SPDR  = spis_snap->crc_cycle;
+      /* Clear command. */
+      SPIS_CMD_RESET();
+      LED0_OFF();
+   }
+}
+
+
+/**
+ * @brief Handles SPI for the identity command.
+ */
+static void spis_cmd_ident (void)
+{
+   if (spis_pos < DHB_IDENT_LEN) {
+      SPDR  = spis_ident[ spis_pos ];
+      spis_pos++;
+   }
+   else {
+      SPDR  = spis_ident[ DHB_IDENT_LEN ];
+      /* Clear command. */
+      SPIS_CMD_RESET();
+      LED0_OFF();
+   }
+}
+
+
+/**
+ * @brief Handles SPI for the mode get command.
+ */
+static void spis_cmd_modeget (void)
+{
+   uint8_t mode;
+   if (spis_pos < 1) {
+      mode     = motor_getMode();
+      SPDR     = mode;
+      spis_pos++;
+      /* Update CRC. */
+      spis_crc = crc8_update( spis_crc, mode );
+   }
+   else {
+      SPDR     = spis_crc;
+      /* Clear command. */
+      SPIS_CMD_RESET();
+      LED0_OFF();
+   }
+}
+
+
+/**
+ * @brief Handles SPI for the parameter set command.
+ */
+static void spis_cmd_paramset (void)
+{
+   uint8_t c = SPDR;
+   if (spis_pos < 3) {
+      /* Fill buffer. */
+      spis_buf[ spis_pos++ ] = c;
+      /* Echo recieved. */
+      SPDR     = c;
+      /* Update CRC. */
+      spis_crc = crc8_update( spis_crc, c );
+   }
+   else {
+      /* Check CRC. */
+      if (c != spis_crc) {
+         SPIS_CMD_RESET();
+         LED0_ON();
+         return;
+      }
+      /* Set parameter. */
+      param_set( spis_buf[0], (spis_buf[1]<<8) + spis_buf[2] );
+      /* Clear command. */
+      SPIS_CMD_RESET();
+      LED0_OFF();
+   }
+}
+
+
+/**
+ * @brief Handles SPI for the parameter get command.
+ *
+ * Takes the identifier and replies with it and the value.
+ *
+ *          1  2  3  4  5  6  7
+ *    0  1  2  3  4  5  6  7
+ * M 80 CM ID CR X1 X2 X3 X4
+ * S 00 80 CM ID ID VH VL CR
+ */
+static void spis_cmd_paramget (void)
+{
+   uint8_t c = SPDR;
+   /* Identifier. */
+   if (spis_pos < 1) {
+      spis_buf[ spis_pos++ ] = c;
+      SPDR     = c;
+      spis_crc = crc8_update( spis_crc, c );
+   }
+   /* Check CRC and start the reply. */
+   else if (spis_pos == 1) {
+      if (c != spis_crc) {
+         SPIS_CMD_RESET();
+         LED0_ON();
+         return;
+      }
+      spis_crc = spis_paramReply( spis_buf );
+      SPDR     = spis_buf[0];
+      spis_pos++;
+   }
+   /* Reply. */
+   else if (spis_pos < 4) {
+      SPDR     = spis_buf[ spis_pos-1 ];
       spis_pos++;
    }
    else {
-      SPDR  = spis_crc;
+      SPDR     = spis_crc;
       /* Clear command. */
       SPIS_CMD_RESET();
       LED0_OFF();
@@ -236,6 +505,252 @@ static void spis_cmd_current (void)
 }
 
 
+/**
+ * @brief Handles SPI for the parameter save command.
+ */
+static void spis_cmd_paramsave (void)
+{
+   /* Only on a good CRC, it wears the EEPROM. */
+   if (SPDR != spis_crc) {
+      SPIS_CMD_RESET();
+      LED0_ON();
+      return;
+   }
+   param_save();
+   /* Clear command. */
+   SPIS_CMD_RESET();
+   LED0_OFF();
+}
+
+
+/**
+ * @brief Builds the reply to a parameter get.
+ *
+ *    @param buf Identifier of the parameter, the value gets put after it.
+ *    @return CRC of the reply.
+ */
+static uint8_t spis_paramReply( uint8_t *buf )
+{
+   int16_t value;
+
+   value  = param_get( buf[0] );
+   buf[1] = value >> 8;
+   buf[2] = value & 0xFF;
+   return frame_crc( DHB_CMD_PARAMGET, buf, 3 );
+}
+
+
+/**
+ * @brief Handles SPI for pipelined frames.
+ *
+ * The request is parsed like the other commands while the reply to the
+ *  previous one goes out, the frame ends when both are done.
+ */
+static void spis_cmd_pipe (void)
+{
+   uint8_t c = SPDR;
+   uint8_t p = spis_pos++;
+
+   /* Command. */
+   if (p == 1) {
+      spis_pipeOk  = 1;
+      spis_pipeReq = frame_reqLen( c );
+      /* Take unknown ones as a bare request so the frame still ends. */
+      if (spis_pipeReq == FRAME_INVALID) {
+         spis_pipeOk  = 0;
+         spis_pipeReq = 0;
+      }
+      spis_pipeCmd = c;
+      spis_crc     = crc8_update( 0, c );
+      spis_pipeEnd = 3 + spis_pipeReq;
+      if (spis_pipeEnd < spis_pipeLen + 2)
+         spis_pipeEnd = spis_pipeLen + 2;
+   }
+   /* Data. */
+   else if (p < spis_pipeReq + 2) {
+      spis_buf[ p-2 ] = c;
+      spis_crc = crc8_update( spis_crc, c );
+   }
+   /* Check CRC. */
+   else if (p == spis_pipeReq + 2) {
+      if (c != spis_crc)
+         spis_pipeOk = 0;
+   }
+
+   /* Keep the reply going until the frame is over. */
+   if (spis_pos < spis_pipeEnd)
+      spis_pipe_out();
+   else
+      spis_pipe_end( spis_pipeOk );
+}
+
+
+/**
+ * @brief Points the pipelined reply at the latest telemetry as the frame starts.
+ */
+static void spis_pipe_start (void)
+{
+   spis_snap = &spis_telem[ spis_telemFront ];
+   switch (spis_pipePrev) {
+      case DHB_CMD_MOTORGET:
+         spis_pipeData = &spis_snap->data[0];
+         spis_pipeCrc  = spis_snap->crc_fbk;
+         break;
+      case DHB_CMD_CURRENT:
+         spis_pipeData = &spis_snap->data[4];
+         spis_pipeCrc  = spis_snap->crc_cur;
+         break;
+      case DHB_CMD_CYCLE:
+         spis_pipeData = &spis_snap->data[0];
+         spis_pipeCrc  = spis_snap->crc_cycle;
+         break;
+      default:
+         break; /* Set up by spis_pipe_end. */
+   }
+}
+
+
+/**
+ * @brief Loads the pipelined reply byte that goes out next, spis_pos.
+ */
+static void spis_pipe_out (void)
+{
+   if (spis_pos <= spis_pipeLen)
+      SPDR = spis_pipeData[ spis_pos-1 ];
+   else if (spis_pos == spis_pipeLen+1)
+      SPDR = spis_pipeCrc;
+   else
+      SPDR = 0;
+}
+
+
+/**
+ * @brief Ends a pipelined frame.
+ *
+ * Runs the command and sets up its reply, the data comes from the telemetry
+ *  published when the next frame starts.
+ *
+ *    @param ok Whether the request was received fine.
+ */
+static void spis_pipe_end( uint8_t ok )
+{
+   uint8_t cmd;
+
+   cmd          = ok ? spis_pipeCmd : DHB_CMD_NONE;
+   spis_pipeLen = frame_replyLen( cmd );
+   spis_pipeCrc = crc8_update( 0, cmd );
+   switch (cmd) {
+      case DHB_CMD_VERSION:
+         spis_pipeData = &spis_version;
+         spis_pipeCrc  = crc8_update( spis_pipeCrc, spis_version );
+         break;
+
+      case DHB_CMD_IDENT:
+         spis_pipeData = spis_ident;
+         spis_pipeCrc  = spis_ident[ DHB_IDENT_LEN ];
+         break;
+
+      case DHB_CMD_MODESET:
+         motor_mode( spis_buf[0] );
+         break;
+
+      case DHB_CMD_MOTORSET:
+         motor_set( (spis_buf[0]<<8) + spis_buf[1],
+                    (spis_buf[2]<<8) + spis_buf[3] );
+         break;
+
+      case DHB_CMD_CYCLE:
+         motor_set( (spis_buf[0]<<8) + spis_buf[1],
+                    (spis_buf[2]<<8) + spis_buf[3] );
+         break;
+
+      case DHB_CMD_MODEGET:
+         spis_pipeBuf[0] = motor_getMode();
+         spis_pipeData = spis_pipeBuf;
+         spis_pipeCrc  = crc8_update( spis_pipeCrc, spis_pipeBuf[0] );
+         break;
+
+      case DHB_CMD_PARAMSET:
+         param_set( spis_buf[0], (spis_buf[1]<<8) + spis_buf[2] );
+         break;
+
+      case DHB_CMD_PARAMGET:
+         spis_pipeBuf[0] = spis_buf[0];
+         spis_pipeData = spis_pipeBuf;
+         spis_pipeCrc  = spis_paramReply( spis_pipeBuf );
+         break;
+
+      case DHB_CMD_PARAMSAVE:
+         param_save();
+         break;
+
+      default:
+         break;
+   }
+   spis_pipePrev = cmd;
+
+   /* First byte of the next frame is the command replied to. */
+   SPDR         = cmd;
+
+   /* Clear command. */
+   SPIS_CMD_RESET();
+   if (ok)
+      LED0_OFF();
+   else
+      LED0_ON();
+}
+
+
+/**
+ * @brief Forgets the pipelined reply, the next pipelined frame carries none.
+ */
+static void spis_pipe_reset (void)
+{
+   spis_pipePrev = DHB_CMD_NONE;
+   spis_pipeLen  = 0;
+   spis_pipeCrc  = crc8_update( 0, DHB_CMD_NONE );
+}
+
+
+/**
+ * @brief Publishes the telemetry the replies are made from.
+ *
+ * Fills the buffer the SPI interrupt is not using and then flips them, so
+ *  replies never see a half updated snapshot and the CRCs are ready.
+ */
+void spis_publish (void)
+{
+   spis_telem_t *telem;
+
+   /* A frame outlasting a control tick still holds the back buffer. */
+   telem = &spis_telem[ spis_telemFront ^ 1 ];
+   if (spis_snap == telem)
+      return;
+
+   /* Feedback. */
+   telem->data[0] = (uint8_t)(mot0.feedback>>8);
+   telem->data[1] = (uint8_t)mot0.feedback;
+   telem->data[2] = (uint8_t)(mot1.feedback>>8);
+   telem->data[3] = (uint8_t)mot1.feedback;
+
+   /* Current, written by the ADC interrupt. */
+   cli();
+   telem->data[4] = current_buffer[0];
+   telem->data[5] = current_buffer[1];
+   telem->data[6] = current_buffer[2];
+   telem->data[7] = current_buffer[3];
+   sei();
+
+   /* CRCs, each starts at its command. */
+   telem->crc_fbk   = frame_crc( DHB_CMD_MOTORGET, &telem->data[0], 4 );
+   telem->crc_cur   = frame_crc( DHB_CMD_CURRENT, &telem->data[4], 4 );
+   telem->crc_cycle = frame_crc( DHB_CMD_CYCLE, &telem->data[0], 8 );
+
+   /* Replies come from here from now on. */
+   spis_telemFront ^= 1;
+}
+
+
 /**
  * @brief SPI Serial Transfer complete.
  *
@@ -250,4 +765,28 @@ ISR( SPI_STC_vect )
 }
 
 
+/**
+ * @brief SS changed, resynchronizes if the master ended a frame early.
+ *
+ * A frame that ended on time has already been reset by its last byte.
+ */
+ISR( PCINT0_vect )
+{
+   /* Rising only. */
+   if (!(PINB & _BV(DD_SS)))
+      return;
+
+   /* Last byte may still be pending, it can be the one ending the frame. */
+   if (SPSR & _BV(SPIF))
+      spis_cmd_func();
+
+   if ((spis_pos != 0) || (spis_cmd_func != spis_cmd_start)) {
+      SPIS_CMD_RESET();
+      spis_pipe_reset();
+      SPDR = DHB_CMD_NONE;
+      LED0_ON();
+   }
+}
+
+
 
@@ -7,14 +7,22 @@
 #include <stdint.h>
 
 
-extern uint8_t spis_crc;
-extern uint8_t spis_buf[5];
-
-
 /**
  * @brief Initializes the SPI as slave.
  */
 inline void spis_init (void);
 
 
+/**
+ * @brief Builds the identity reply, again whenever what it reports changes.
+ */
+void spis_identify (void);
+
+
+/**
+ * @brief Publishes the feedback and current the master reads.
+ */
+void spis_publish (void);
+
+
 #endif /* _SPIS_H */
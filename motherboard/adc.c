@@ -61,9 +61,11 @@ ISR( ADC_vect )
 {
    event_t evt;
 
-   /* Set up the event. */
+   /* Set up the event, low byte must be read first. */
    evt.type          = EVENT_TYPE_ADC;
    evt.adc.channel   = adc_channel;
+   evt.adc.value     = ADCL;
+   evt.adc.value    |= ADCH<<8;
 
    /* Push the event. */
    event_push( &evt );
@@ -9,6 +9,8 @@
 #include <avr/interrupt.h>
 
 #include "uart.h"
+#include "event.h"
+#include "crc8.h"
 
 
 static FILE mystdout = FDEV_SETUP_STREAM( (int(*)(char,FILE*)) uart_putc, NULL, _FDEV_SETUP_WRITE );
@@ -23,3 +25,31 @@ void comm_init (void)
    uart_init( UART_BAUD_SELECT(COMM_BAUD,F_CPU) );
    stdout = &mystdout;
 }
+
+
+#if EVENT_TRACE
+void comm_traceDump (void)
+{
+   int i, j, n;
+   uint8_t crc, *p;
+   event_trace_t recs[8];
+
+   /* Send in frames of up to 8 records. */
+   while ((n = event_traceRead( recs, sizeof(recs)/sizeof(recs[0]) )) > 0) {
+      uart_putc( COMM_TRACE_SYNC0 );
+      uart_putc( COMM_TRACE_SYNC1 );
+      uart_putc( n );
+      crc = crc8_update( 0, n );
+      for (i=0; i<n; i++) {
+         p = (uint8_t*) &recs[i];
+         for (j=0; j<(int)sizeof(event_trace_t); j++) {
+            uart_putc( p[j] );
+            crc = crc8_update( crc, p[j] );
+         }
+      }
+      uart_putc( crc );
+   }
+}
+#endif /* EVENT_TRACE */
+
+
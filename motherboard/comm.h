@@ -7,8 +7,25 @@
 #define COMM_BAUD    57600
 
 
+#define COMM_TRACE_SYNC0   0xA5 /**< First sync byte of a trace frame. */
+#define COMM_TRACE_SYNC1   0x5A /**< Second sync byte of a trace frame. */
+
+
 void comm_init (void);
 
 
+/**
+ * @brief Dumps the event trace over the UART as binary frames.
+ *
+ * Only available when EVENT_TRACE is set in conf.h. Each frame is:
+ *
+ * A5 5A N REC0 ... RECN-1 CRC
+ *
+ * Where each record is an event_trace_t (little endian stamp) and CRC is the
+ *  Dallas CRC-8 over N and the records. Decode with tools/tracedec.
+ */
+void comm_traceDump (void);
+
+
 #endif /* _COMM_H */
 
@@ -9,11 +9,46 @@
 
 
 /* SPI Master. */
-#define SPI_BUFFER_LEN           32 /* Must be power of two. */
+#define SPIM_BACKEND             SPIM_BACKEND_HW /* SPIM_BACKEND_HW, SPIM_BACKEND_SW or SPIM_BACKEND_USART. */
+#define SPIM_BURST_LEN           10 /* Frames up to this length are clocked polled, 0 to disable. */
+#define SPIM_BURST_US            60 /* Longest a burst may poll for, slower frames go through the interrupt. */
+#define SPIM_SW_MODE             0 /* SPI mode of the software backend, 0 to 3. */
+#define SPIM_SW_PACED            1 /* Software backend clocks a byte per TIMER2 interrupt, 0 blocks for the frame. */
+#define SPIM_SW_GAP_US           20 /* Microseconds between bytes when paced, 1 to 100. */
+
+
+/* I2C Master. */
+#define I2C_BUFFER_LEN           32 /* Bytes a single I2C transfer can hold. */
+
+
+/* DHB module. */
+#define DHB_SPI_FASTEST          SPIM_DIV_2 /* Fastest SPI clock the board allows, modules report their own. */
+#define DHB_SPI_STEP_UP          16 /* Good replies before trying a faster SPI clock. */
+#define DHB_SPI_RECOVER          200 /* Good replies before trying a clock that failed again, at most 255. */
+#define DHB_BOOT_DELAY           250 /* Milliseconds the module takes to come up before enumerating. */
+#define DHB_ENUM_TRIES           5 /* Requests per enumeration step before giving up on the module. */
 
 
 /* Event. */
-#define EVENT_STACK_SIZE         8 /* Size of the event stack. */
+#define EVENT_QUEUE_SIZE         8 /* Per priority lane, must be power of two. */
+#define EVENT_SUB_BUCKETS        4 /* Subscription buckets per event type, must be power of two. */
+#define EVENT_DEFERRED           1 /* Run callbacks from event_poll instead of the ISRs. */
+#define EVENT_DISPATCH_BUDGET_US 1000 /* Microseconds of callbacks per event_poll, at least one event always runs. */
+#define EVENT_BATCH_MAX          8 /* Maximum events handed to the FSM per wakeup. */
+#define EVENT_TRACE              0 /* Record event trace, costs EVENT_TRACE_SIZE*4 bytes of RAM. */
+#define EVENT_TRACE_SIZE         64 /* Must be power of two. */
+
+
+/* Timer. */
+#define TIMER_MAX                24 /* Maximum amount of allocated timers, less than 255. */
+#define TIMER_TICKLESS           1 /* Only interrupt when a timer is due, at most every TIMER_EPOCH_SPAN ticks. */
+
+
+/* Watchdog. */
+#define WDOG_MAIN_TIMEOUT        100 /* Milliseconds the main loop may go without a pass. */
+#define WDOG_SPI_TIMEOUT         20 /* Milliseconds a SPI transaction may take. */
+#define WDOG_I2C_TIMEOUT         20 /* Milliseconds an I2C transaction may take. */
+#define WDOG_DHB_TIMEOUT         50 /* Milliseconds the DHB reply may take to be handled. */
 
 
 #include "ioconf.h"
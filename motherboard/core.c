@@ -11,10 +11,10 @@
 #include "timer.h"
 #include "comm.h"
 #include "fsm.h"
+#include "wdog.h"
 
 #include <stdio.h>
 #include <string.h>
-#include <avr/wdt.h>
 #include <avr/sleep.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
@@ -51,6 +51,7 @@ static void init (void)
     * Optional subsystems.
     */
    timer_init(); /* Timer infrastructure on TIMER0. */
+   wdog_init(); /* Watchdog, needs the timer. */
    /*servo_init();*/ /* Servo motors on TIMER1. */
 
    /* Set sleep mode. */
@@ -66,10 +67,11 @@ static void init (void)
  */
 int main (void)
 {
-   event_t evt;
+   int n;
+   event_t evts[ EVENT_BATCH_MAX ];
 
    /* Disable watchdog timer since it doesn't always get reset on restart. */
-   wdt_disable();     
+   wdog_boot();
 
    /* Initialize the MCU. */
    init();
@@ -80,17 +82,28 @@ int main (void)
    /* Start fsm. */
    fsm_start();
 
+   /* Main loop must make a pass every so often. */
+   wdog_start( WDOG_TASK_MAIN, WDOG_MAIN_TIMEOUT );
+
    for (;;) {
+      wdog_kick( WDOG_TASK_MAIN );
+
       /* Atomic test to see if has anything to do. */
       cli();
 
-      /* Handle events. */
-      while (event_poll(&evt)) {
+      /* Handle events in batches. */
+      while ((n = event_pollBatch( evts, EVENT_BATCH_MAX )) > 0) {
          sei(); /* Reenable interrupts. */
-         fsm( &evt );
+         fsm_batch( evts, n );
          cli(); /* Disable for next check. */
       }
 
+      /* Events left over from the batch cap, go again. */
+      if (event_pending()) {
+         sei();
+         continue;
+      }
+
       /* Atomic sleep as specified on the documentation. */
       sleep_enable();
       sei();
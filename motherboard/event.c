@@ -3,24 +3,115 @@
 #include "conf.h"
 
 #include <stdio.h>
+#include <avr/interrupt.h>
 
 #include "event.h"
+#include "timer.h"
 
 
-static volatile event_t event_stack[ EVENT_STACK_SIZE ];
-static volatile int event_top = 0;
+/*
+ * Make sure the queue can be indexed with a mask.
+ */
+#define EVENT_QUEUE_MASK   (EVENT_QUEUE_SIZE-1)
+#if (EVENT_QUEUE_SIZE & EVENT_QUEUE_MASK) || (EVENT_QUEUE_SIZE > 128)
+#  error "EVENT_QUEUE_SIZE must be a power of two no larger than 128."
+#endif
+#define EVENT_SUB_MASK     (EVENT_SUB_BUCKETS-1)
+#if (EVENT_SUB_BUCKETS & EVENT_SUB_MASK)
+#  error "EVENT_SUB_BUCKETS must be a power of two."
+#endif
+#if EVENT_TRACE
+#  define EVENT_TRACE_MASK (EVENT_TRACE_SIZE-1)
+#  if (EVENT_TRACE_SIZE & EVENT_TRACE_MASK) || (EVENT_TRACE_SIZE > 128)
+#    error "EVENT_TRACE_SIZE must be a power of two no larger than 128."
+#  endif
+#  define EVENT_TRACE_REC( w, t, a )   event_traceRec( (w), (t), (a) )
+#else /* EVENT_TRACE */
+#  define EVENT_TRACE_REC( w, t, a )   do {} while (0)
+#endif /* EVENT_TRACE */
+
+
+/**
+ * @brief Event queue for a single priority lane.
+ *
+ * Head and tail are free running counters, only the producer (interrupt
+ *  context) writes head and only the consumer (main loop) writes tail, so
+ *  neither side needs to lock the other out.
+ */
+typedef struct event_lane_s {
+   event_t queue[ EVENT_QUEUE_SIZE ]; /**< Event ring buffer. */
+   uint16_t stamp[ EVENT_QUEUE_SIZE ]; /**< Microseconds when each event was queued. */
+   uint8_t head; /**< Next slot to write to. */
+   uint8_t tail; /**< Next slot to read from. */
+   event_stats_t stats; /**< Lane statistics. */
+} event_lane_t;
+
+
+static volatile event_lane_t event_lanes[ EVENT_LANE_MAX ]; /**< Priority lanes. */
+static volatile uint8_t event_laneOf[ EVENT_TYPE_MAX ]; /**< Lane each event type goes to. */
+static volatile uint8_t event_rule[ EVENT_TYPE_MAX ]; /**< Coalescing rule of each event type. */
 static volatile event_callback_t event_callbacks[ EVENT_TYPE_MAX ];
+static event_sub_t *volatile event_subs[ EVENT_TYPE_MAX ][ EVENT_SUB_BUCKETS ]; /**< Subscription chains hashed by source. */
+#if EVENT_TRACE
+static event_trace_t event_traceBuf[ EVENT_TRACE_SIZE ]; /**< Trace ring, overwrites oldest. */
+static volatile uint8_t event_traceHead = 0; /**< Next trace record to write. */
+static volatile uint8_t event_traceLen  = 0; /**< Amount of trace records stored. */
+#endif /* EVENT_TRACE */
+
+
+/*
+ * Prototypes.
+ */
+static int event_runSubs( event_t *evt );
+static int event_dispatch( event_t *evt );
+static int event_dequeue( event_t *evt, uint16_t now );
+static int event_coalesce( volatile event_lane_t *lane, event_t *evt );
+#if EVENT_TRACE
+static inline void event_traceRec( uint8_t what, uint8_t type, uint8_t arg );
+#endif /* EVENT_TRACE */
 
 
 void event_init (void)
 {
-   int i;
+   int i, j;
+   volatile event_lane_t *lane;
 
-   event_top = 0;
+   /* Clear lanes. */
+   for (i=0; i<EVENT_LANE_MAX; i++) {
+      lane                  = &event_lanes[i];
+      lane->head            = 0;
+      lane->tail            = 0;
+      lane->stats.dropped   = 0;
+      lane->stats.highwater = 0;
+      lane->stats.latency   = 0;
+      lane->stats.coalesced = 0;
+   }
+#if EVENT_TRACE
+   event_traceHead  = 0;
+   event_traceLen   = 0;
+#endif /* EVENT_TRACE */
 
-   /* Clear events. */
+   /* Default priorities. */
+   event_laneOf[ EVENT_TYPE_NONE ]   = EVENT_LANE_LOW;
+   event_laneOf[ EVENT_TYPE_SPI ]    = EVENT_LANE_HIGH;
+   event_laneOf[ EVENT_TYPE_I2C ]    = EVENT_LANE_HIGH;
+   event_laneOf[ EVENT_TYPE_MODULE ] = EVENT_LANE_HIGH;
+   event_laneOf[ EVENT_TYPE_TIMER ]  = EVENT_LANE_MED;
+   event_laneOf[ EVENT_TYPE_ADC ]    = EVENT_LANE_LOW;
+   event_laneOf[ EVENT_TYPE_CUSTOM ] = EVENT_LANE_LOW;
+
+   /* Default coalescing. */
    for (i=0; i<EVENT_TYPE_MAX; i++)
+      event_rule[ i ] = EVENT_COALESCE_NONE;
+   event_rule[ EVENT_TYPE_TIMER ]    = EVENT_COALESCE_COUNT;
+   event_rule[ EVENT_TYPE_ADC ]      = EVENT_COALESCE_REPLACE;
+
+   /* Clear events. */
+   for (i=0; i<EVENT_TYPE_MAX; i++) {
       event_callbacks[ i ] = NULL;
+      for (j=0; j<EVENT_SUB_BUCKETS; j++)
+         event_subs[ i ][ j ] = NULL;
+   }
 }
 
 
@@ -30,44 +121,378 @@ void event_setCallback( event_type_t type, event_callback_t func )
 }
 
 
-void event_push( event_t *evt )
+void event_subscribe( event_sub_t *sub, event_type_t type, int source, event_callback_t func )
 {
-   /* Abort adding event. */
-   if (event_top >= EVENT_STACK_SIZE)
-      return;
+   uint8_t sreg;
+   event_sub_t *volatile *link;
+
+   sub->type   = type;
+   sub->source = source;
+   sub->func   = func;
+   sub->next   = NULL;
+
+   /* Append to the end of the chain so handlers run in subscription order.
+    * Node is fully set up before being linked in, so ISRs never see it half
+    * initialized. */
+   sreg = SREG;
+   cli();
+   link = &event_subs[ type ][ source & EVENT_SUB_MASK ];
+   while (*link != NULL)
+      link = &(*link)->next;
+   *link = sub;
+   SREG = sreg;
+}
+
+
+void event_unsubscribe( event_sub_t *sub )
+{
+   uint8_t sreg;
+   event_sub_t *volatile *link;
+
+   sreg = SREG;
+   cli();
+   link = &event_subs[ sub->type ][ sub->source & EVENT_SUB_MASK ];
+   while (*link != NULL) {
+      if (*link == sub) {
+         *link = sub->next;
+         break;
+      }
+      link = &(*link)->next;
+   }
+   SREG = sreg;
+}
+
+
+int event_source( const event_t *evt )
+{
+   return evt->raw.source;
+}
+
+
+/**
+ * @brief Runs the subscriptions matching an event.
+ *
+ *    @param evt Event to run subscriptions for.
+ *    @return 1 if the event was destroyed.
+ */
+static int event_runSubs( event_t *evt )
+{
+   int source;
+   event_sub_t *sub;
+
+   source = event_source( evt );
+   for (sub = event_subs[ evt->type ][ source & EVENT_SUB_MASK ];
+         sub != NULL; sub = sub->next) {
+      if (sub->source != source)
+         continue;
+      if (sub->func( evt ))
+         return 1;
+   }
+   return 0;
+}
+
+
+/**
+ * @brief Runs all the callbacks for an event.
+ *
+ *    @param evt Event to run callbacks for.
+ *    @return 1 if the event was destroyed.
+ */
+static int event_dispatch( event_t *evt )
+{
+   int destroyed;
+
+   EVENT_TRACE_REC( EVENT_TRACE_DISPATCH, evt->type, evt->raw.source );
+
+   /* Check subscriptions. */
+   destroyed = event_runSubs( evt );
 
    /* Check callback. */
-   if (event_callbacks[ evt->type ] != NULL) {
+   if (!destroyed && (event_callbacks[ evt->type ] != NULL)) {
       /* Run callback and see if need to copy over. */
-      if (event_callbacks[ evt->type ]( evt ))
-         return;
+      destroyed = event_callbacks[ evt->type ]( evt );
+   }
+
+   EVENT_TRACE_REC( EVENT_TRACE_RETURN, evt->type, destroyed );
+
+   return destroyed;
+}
+
+
+void event_setLane( event_type_t type, event_lane_id_t lane )
+{
+   event_laneOf[ type ] = lane;
+}
+
+
+void event_setCoalesce( event_type_t type, event_coalesce_t rule )
+{
+   event_rule[ type ] = rule;
+}
+
+
+/**
+ * @brief Attempts to merge an event into one already queued.
+ *
+ * Must be called with interrupts disabled.
+ *
+ *    @param lane Lane the event would go to.
+ *    @param evt Event being pushed.
+ *    @return 1 if the event was merged and should not be queued.
+ */
+static int event_coalesce( volatile event_lane_t *lane, event_t *evt )
+{
+   uint8_t i, rule;
+   int source;
+   volatile event_t *q;
+
+   rule = event_rule[ evt->type ];
+   if (rule == EVENT_COALESCE_NONE)
+      return 0;
+
+   /* Look for a queued event from the same source. */
+   source = event_source( evt );
+   for (i=lane->tail; i!=lane->head; i++) {
+      q = &lane->queue[ i & EVENT_QUEUE_MASK ];
+      if ((q->type != evt->type) || (event_source( (const event_t*)q ) != source))
+         continue;
+
+      /* Merge. */
+      if (rule == EVENT_COALESCE_REPLACE)
+         *q = *evt;
+      else if (q->timer.count < UINT8_MAX)
+         q->timer.count++;
+
+      if (lane->stats.coalesced < UINT8_MAX)
+         lane->stats.coalesced++;
+      EVENT_TRACE_REC( EVENT_TRACE_MERGE, evt->type, (uint8_t)(lane->head - lane->tail) );
+      return 1;
+   }
+
+   return 0;
+}
+
+
+void event_push( event_t *evt )
+{
+   uint8_t head, used, sreg;
+   volatile event_lane_t *lane;
+
+#if !EVENT_DEFERRED
+   /* Run callbacks right away. */
+   if (event_dispatch( evt ))
+      return;
+#endif /* !EVENT_DEFERRED */
+
+   /* Callbacks may push from the main loop too. */
+   sreg = SREG;
+   cli();
+
+   lane = &event_lanes[ event_laneOf[ evt->type ] ];
+
+   /* Merge with an event still waiting if possible. */
+   if (event_coalesce( lane, evt )) {
+      SREG = sreg;
+      return;
+   }
+
+   /* Abort adding event if full. */
+   head = lane->head;
+   used = (uint8_t)(head - lane->tail);
+   if (used >= EVENT_QUEUE_SIZE) {
+      if (lane->stats.dropped < UINT8_MAX)
+         lane->stats.dropped++;
+      EVENT_TRACE_REC( EVENT_TRACE_DROP, evt->type, used );
+      SREG = sreg;
+      return;
    }
 
    /* Copy over. */
-   event_stack[ event_top++ ] = *evt;
+   lane->queue[ head & EVENT_QUEUE_MASK ] = *evt;
+   lane->stamp[ head & EVENT_QUEUE_MASK ] = timer_now_us();
+   lane->head = head+1;
+
+   /* Keep track of usage. */
+   used++;
+   if (used > lane->stats.highwater)
+      lane->stats.highwater = used;
+   EVENT_TRACE_REC( EVENT_TRACE_PUSH, evt->type, used );
+
+   SREG = sreg;
 }
 
 
-int event_poll( event_t *evt )
+/**
+ * @brief Takes the next event out of the queue.
+ *
+ * Must be called with interrupts disabled.
+ *
+ *    @param evt Event to fill.
+ *    @param now Low bits of timer_now_us to measure the latency against.
+ *    @return 1 if an event was found, 0 if no events on queue.
+ */
+static int event_dequeue( event_t *evt, uint16_t now )
 {
    int i;
+   uint8_t tail;
+   uint16_t latency;
+   volatile event_lane_t *lane;
 
-   /* Make sure there's events left. */
-   if (event_top <= 0)
-      return 0;
+   /* Highest priority lane with events pending wins. */
+   for (i=0; i<EVENT_LANE_MAX; i++) {
+      lane = &event_lanes[i];
+      tail = lane->tail;
+      if (tail == lane->head)
+         continue;
+
+      /* Copy event. */
+      *evt = lane->queue[ tail & EVENT_QUEUE_MASK ];
+
+      /* Latency is the time it spent queued. */
+      latency = now - lane->stamp[ tail & EVENT_QUEUE_MASK ];
+      if (latency > lane->stats.latency)
+         lane->stats.latency = latency;
+
+      lane->tail = tail+1;
+      EVENT_TRACE_REC( EVENT_TRACE_POLL, evt->type, (uint8_t)(lane->head - lane->tail) );
+
+      return 1;
+   }
+
+   return 0;
+}
+
+
+int event_poll( event_t *evt )
+{
+#if EVENT_DEFERRED
+   int destroyed;
+   uint8_t sreg;
+   uint32_t start, now;
 
-   /* Copy event. */
-   *evt = event_stack[0];
+   /* Run callbacks with interrupts enabled, but only for so long so the main
+    * loop gets to do other things under an event flood. */
+   start = timer_now_us();
+   now   = start;
+   do {
+      if (!event_dequeue( evt, now ))
+         return 0;
 
-   /* Move down. */
-   i = 1;
-   while (i<event_top) {
-      event_stack[i-1] = event_stack[i];
-      i++;
+      sreg = SREG;
+      sei();
+      destroyed = event_dispatch( evt );
+      SREG = sreg;
+
+      /* Notify there's an event. */
+      if (!destroyed)
+         return 1;
+
+      now = timer_now_us();
+   } while (now - start < EVENT_DISPATCH_BUDGET_US);
+   return 0;
+#else /* EVENT_DEFERRED */
+   return event_dequeue( evt, timer_now_us() );
+#endif /* EVENT_DEFERRED */
+}
+
+
+int event_pollBatch( event_t *evts, int max )
+{
+   int n;
+   uint16_t now;
+#if EVENT_DEFERRED
+   int i, kept;
+   uint8_t sreg;
+#endif /* EVENT_DEFERRED */
+
+   /* Snapshot everything pending in one go. */
+   now = timer_now_us();
+   n   = 0;
+   while ((n < max) && event_dequeue( &evts[n], now ))
+      n++;
+
+#if EVENT_DEFERRED
+   /* Run callbacks with interrupts enabled and drop destroyed events. */
+   sreg = SREG;
+   sei();
+   kept = 0;
+   for (i=0; i<n; i++) {
+      if (event_dispatch( &evts[i] ))
+         continue;
+      if (kept != i)
+         evts[ kept ] = evts[i];
+      kept++;
    }
-   event_top--;
+   SREG = sreg;
+   n = kept;
+#endif /* EVENT_DEFERRED */
+
+   return n;
+}
+
+
+int event_pending (void)
+{
+   int i;
+
+   for (i=0; i<EVENT_LANE_MAX; i++)
+      if (event_lanes[i].tail != event_lanes[i].head)
+         return 1;
+   return 0;
+}
+
+
+void event_stats( event_lane_id_t lane, event_stats_t *stats )
+{
+   *stats = event_lanes[ lane ].stats;
+}
+
+
+#if EVENT_TRACE
+/**
+ * @brief Records a trace entry.
+ *
+ *    @param what What happened (EVENT_TRACE_*).
+ *    @param type Type of the event.
+ *    @param arg Depending on what happened.
+ */
+static inline void event_traceRec( uint8_t what, uint8_t type, uint8_t arg )
+{
+   uint8_t sreg, head;
+   event_trace_t *rec;
 
-   /* Notify there's an event. */
-   return 1;
+   sreg = SREG;
+   cli();
+   head = event_traceHead;
+   rec  = &event_traceBuf[ head & EVENT_TRACE_MASK ];
+   rec->what  = (what << 4) | type;
+   rec->arg   = arg;
+   rec->stamp = TIMER_STAMP();
+   event_traceHead = head+1;
+   if (event_traceLen < EVENT_TRACE_SIZE)
+      event_traceLen++;
+   SREG = sreg;
 }
 
+
+int event_traceRead( event_trace_t *buf, int max )
+{
+   int i, n;
+   uint8_t sreg, tail;
+
+   sreg = SREG;
+   cli();
+   n    = event_traceLen;
+   if (n > max)
+      n = max;
+   tail = event_traceHead - event_traceLen;
+   for (i=0; i<n; i++)
+      buf[i] = event_traceBuf[ (uint8_t)(tail+i) & EVENT_TRACE_MASK ];
+   event_traceLen -= n;
+   SREG = sreg;
+
+   return n;
+}
+#endif /* EVENT_TRACE */
+
+
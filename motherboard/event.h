@@ -29,12 +29,80 @@ typedef enum event_type_e {
 } event_type_t;
 
 
+/**
+ * @brief Event priority lanes.
+ *
+ * Events are always dispatched from the highest priority lane that has
+ *  pending events, lanes are FIFO internally.
+ */
+typedef enum event_lane_id_e {
+   EVENT_LANE_HIGH, /**< Control and bus completion events. */
+   EVENT_LANE_MED, /**< Timer events. */
+   EVENT_LANE_LOW, /**< ADC and custom events. */
+   /* Sentinal for maximum. */
+   EVENT_LANE_MAX /**< Amount of lanes. */
+} event_lane_id_t;
+
+
+/**
+ * @brief Event coalescing rules.
+ *
+ * Decide what happens when an event is pushed while an event of the same
+ *  type and source is still waiting in the queue.
+ */
+typedef enum event_coalesce_e {
+   EVENT_COALESCE_NONE, /**< Always queue a new event. */
+   EVENT_COALESCE_REPLACE, /**< Overwrite the queued event with the new one. */
+   EVENT_COALESCE_COUNT /**< Increment the count of the queued timer event. */
+} event_coalesce_t;
+
+
+/**
+ * @brief Per lane event queue statistics.
+ */
+typedef struct event_stats_s {
+   uint8_t dropped; /**< Events dropped due to a full lane (saturates). */
+   uint8_t highwater; /**< Maximum amount of events queued at once. */
+   uint16_t latency; /**< Worst microseconds between push and poll, wraps past 65 ms. */
+   uint8_t coalesced; /**< Events merged into an already queued event (saturates). */
+} event_stats_t;
+
+
+/*
+ * Every event starts with the type followed by a single byte identifying the
+ *  source (port, address, channel, timer or id), the rest is payload carried
+ *  in the event itself so consumers don't have to go back to the hardware.
+ */
+
+
+/*
+ * Trace record kinds.
+ */
+#define EVENT_TRACE_PUSH      0x1 /**< Event queued, arg is lane depth after. */
+#define EVENT_TRACE_MERGE     0x2 /**< Event coalesced, arg is lane depth. */
+#define EVENT_TRACE_DROP      0x3 /**< Event dropped, arg is lane depth. */
+#define EVENT_TRACE_POLL      0x4 /**< Event dequeued, arg is lane depth after. */
+#define EVENT_TRACE_DISPATCH  0x5 /**< Callbacks starting, arg is event source. */
+#define EVENT_TRACE_RETURN    0x6 /**< Callbacks done, arg is 1 if destroyed. */
+
+
+/**
+ * @brief Event trace record.
+ */
+typedef struct event_trace_s {
+   uint8_t what; /**< Kind of record in high nibble, event type in low nibble. */
+   uint8_t arg; /**< Kind dependent argument. */
+   uint16_t stamp; /**< Timestamp, see TIMER_STAMP. */
+} event_trace_t;
+
+
 /**
  * @brief SPI subsystem event.
  */
 typedef struct event_spi_s {
    event_type_t type; /**< Type of the event. */
-   int port; /**< SPI port generating event. */
+   uint8_t port; /**< SPI port generating event. */
+   uint8_t len; /**< Amount of bytes transferred. */
 } event_spi_t;
 
 
@@ -43,9 +111,9 @@ typedef struct event_spi_s {
  */
 typedef struct event_i2c_s {
    event_type_t type; /**< Type of the event. */
-   int address; /**< Address communicating with. */
-   int rw; /**< Whether reading or writing. */
-   int ok; /**< WHether or not it was completed fully and successfully. */
+   uint8_t address; /**< Address communicating with. */
+   uint8_t rw; /**< Whether reading or writing. */
+   uint8_t ok; /**< WHether or not it was completed fully and successfully. */
 } event_i2c_t;
 
 
@@ -54,7 +122,7 @@ typedef struct event_i2c_s {
  */
 typedef struct event_module_s {
    event_type_t type; /**< Type of the event. */
-   int port; /**< Module generating the event. */
+   uint8_t port; /**< Module generating the event. */
 } event_module_t;
 
 
@@ -63,7 +131,8 @@ typedef struct event_module_s {
  */
 typedef struct event_adc_s {
    event_type_t type; /**< Type of the event. */
-   int channel; /**< ADC port generating the event. */
+   uint8_t channel; /**< ADC port generating the event. */
+   uint16_t value; /**< Result of the conversion. */
 } event_adc_t;
 
 
@@ -72,7 +141,9 @@ typedef struct event_adc_s {
  */
 typedef struct event_timer_s {
    event_type_t type; /**< Type of the event. */
-   int timer; /**< Timer generating the event. */
+   uint8_t timer; /**< Identifier of the timer generating the event. */
+   uint8_t count; /**< Times the timer went off since the event was queued. */
+   uint8_t handle; /**< Handle of the timer generating the event. */
 } event_timer_t;
 
 
@@ -81,17 +152,28 @@ typedef struct event_timer_s {
  */
 typedef struct event_custom_s {
    event_type_t type; /**< Typo of the event. */
-   int id; /**< Custom identifier for the event. */
-   int data; /**< Byte for data. */
+   uint8_t id; /**< Custom identifier for the event. */
+   int16_t data; /**< Data of the event. */
 } event_custom_t;
 
 
+/**
+ * @brief Generic view of an event.
+ */
+typedef struct event_raw_s {
+   event_type_t type; /**< Type of the event. */
+   uint8_t source; /**< Source of the event. */
+   uint8_t payload[2]; /**< Type dependent payload. */
+} event_raw_t;
+
+
 
 /**
  * @brief All the events.
  */
 typedef union event_u {
    event_type_t type; /**< Type of the event. */
+   event_raw_t raw; /**< Generic event. */
    event_spi_t spi; /**< SPI event. */
    event_i2c_t i2c; /**< I2C event. */
    event_module_t module; /**< Module event. */
@@ -101,12 +183,33 @@ typedef union event_u {
 } event_t;
 
 
+/*
+ * Events get copied around by value in ISRs, make sure they stay small. This
+ *  relies on -fshort-enums and -fpack-struct.
+ */
+typedef char event_size_check[ (sizeof(event_t) == 4) ? 1 : -1 ];
+
+
 /**
  * @brief Callback event.
  */
 typedef int(*event_callback_t)(event_t*);
 
 
+/**
+ * @brief Event subscription.
+ *
+ * Owned by the subscriber (usually a static variable) so no allocation is
+ *  needed, the event subsystem only links it into its tables.
+ */
+typedef struct event_sub_s {
+   event_type_t type; /**< Type of event subscribed to. */
+   int source; /**< Source of the event subscribed to. */
+   event_callback_t func; /**< Callback to run. */
+   struct event_sub_s *next; /**< Next subscription in the chain. */
+} event_sub_t;
+
+
 /**
  * @brief Initializes the event subsystem.
  */
@@ -119,6 +222,12 @@ void event_init (void);
  * The callback function takes the event recieving as a parameter. It must
  *  return 0 to continue generating the event or 1 to destroy the event.
  *
+ * With EVENT_DEFERRED set callbacks are run from event_poll with interrupts
+ *  enabled, otherwise they are run from event_push in interrupt context.
+ *
+ * This callback catches events from any source and is run after all the
+ *  subscriptions matching the event's source.
+ *
  *    @param type Type of event to set callback on.
  *    @param func Callback function.
  */
@@ -126,9 +235,73 @@ void event_setCallback( event_type_t type, event_callback_t func );
 
 
 /**
- * @brief Pushes an event onto the event stack.
+ * @brief Subscribes a callback to events of a type coming from a source.
+ *
+ * The source depends on the type of event: the port for SPI and module
+ *  events, the address for I2C events, the channel for ADC events, the timer
+ *  for timer events and the id for custom events.
+ *
+ * Multiple subscriptions can exist for the same type and source, they get run
+ *  in the order they were subscribed until one of them returns 1 to destroy
+ *  the event.
+ *
+ *    @param sub Subscription to fill and link in, must stay valid until it is
+ *               unsubscribed.
+ *    @param type Type of event to subscribe to.
+ *    @param source Source of the event to subscribe to.
+ *    @param func Callback function.
+ */
+void event_subscribe( event_sub_t *sub, event_type_t type, int source, event_callback_t func );
+
+
+/**
+ * @brief Removes a subscription.
+ *
+ *    @param sub Subscription to remove.
+ */
+void event_unsubscribe( event_sub_t *sub );
+
+
+/**
+ * @brief Gets the source of an event.
+ *
+ *    @param evt Event to get source of.
+ *    @return The source of the event.
+ */
+int event_source( const event_t *evt );
+
+
+/**
+ * @brief Sets the priority lane an event type is queued on.
+ *
+ *    @param type Type of event to set lane of.
+ *    @param lane Lane to queue the events on.
+ */
+void event_setLane( event_type_t type, event_lane_id_t lane );
+
+
+/**
+ * @brief Sets how events of a type get coalesced while queued.
+ *
+ * By default timer events are counted and ADC events are replaced, so a slow
+ *  FSM sees one event per source instead of a backlog.
+ *
+ *    @param type Type of event to set rule of.
+ *    @param rule Coalescing rule to use, EVENT_COALESCE_COUNT only makes sense
+ *                for timer events.
+ */
+void event_setCoalesce( event_type_t type, event_coalesce_t rule );
+
+
+/**
+ * @brief Pushes an event onto the event queue.
+ *
+ * Safe to call from both interrupt context and the main loop. If an event of
+ *  the same type and source is already queued it may get coalesced with it.
+ *  If the queue is full the event is dropped and the drop counter is
+ *  incremented.
  *
- *    @param evt Event to push onto stack.
+ *    @param evt Event to push onto queue.
  */
 void event_push( event_t *evt );
 
@@ -136,10 +309,67 @@ void event_push( event_t *evt );
 /**
  * @brief Polls for events.
  *
+ * Returns the oldest event of the highest priority lane with events pending.
+ *
+ * Must be called with interrupts disabled. With EVENT_DEFERRED set the
+ *  callbacks get run here with interrupts temporarily enabled, and events
+ *  stop being consumed by callbacks once EVENT_DISPATCH_BUDGET_US have gone by
+ *  in the call, so it can return 0 with events still pending.
+ *
  *    @param evt Event to fill.
- *    @return 1 if an event was found, 0 if no events on stack.
+ *    @return 1 if an event was found, 0 if no events left for the caller.
+ *
+ * @sa event_pending
  */
 int event_poll( event_t *evt );
 
 
+/**
+ * @brief Polls for all pending events at once.
+ *
+ * Must be called with interrupts disabled. Events are taken out of the queue
+ *  in priority order in a single pass, so interrupts only need to be toggled
+ *  once per batch instead of once per event. With EVENT_DEFERRED set the
+ *  callbacks get run with interrupts temporarily enabled and events they
+ *  destroy are removed from the batch, so it can return 0 with events still
+ *  pending.
+ *
+ *    @param evts Array of events to fill.
+ *    @param max Maximum amount of events to take.
+ *    @return Amount of events filled.
+ *
+ * @sa event_pending
+ */
+int event_pollBatch( event_t *evts, int max );
+
+
+/**
+ * @brief Checks to see if there are events queued.
+ *
+ *    @return 1 if there are events queued.
+ */
+int event_pending (void);
+
+
+/**
+ * @brief Gets the statistics of an event lane.
+ *
+ *    @param lane Lane to get statistics of.
+ *    @param[out] stats Statistics of the lane.
+ */
+void event_stats( event_lane_id_t lane, event_stats_t *stats );
+
+
+/**
+ * @brief Takes the oldest records out of the trace ring.
+ *
+ * Only available when EVENT_TRACE is set in conf.h.
+ *
+ *    @param buf Buffer to fill with the records.
+ *    @param max Maximum amount of records to take.
+ *    @return Amount of records taken.
+ */
+int event_traceRead( event_trace_t *buf, int max );
+
+
 #endif /* _EVENT_H */
@@ -7,6 +7,9 @@
 /* DHB */
 #define EVENT_CUST_DHB_FEEDBACK  0x20
 #define EVENT_CUST_DHB_CURRENT   0x21
+#define EVENT_CUST_DHB_CYCLE     0x22
+#define EVENT_CUST_DHB_READY     0x23
+#define EVENT_CUST_DHB_PARAM     0x24
 
 
 #endif /* EVENT_CUST_H */
@@ -5,3 +5,17 @@
 
 #include "fsm/testdhb.c"
 //#include "fsm/avoid.c"
+
+
+/*
+ * Behaviours that want to look at a whole batch at once (for example to
+ *  coalesce ADC results) define FSM_BATCH and provide their own fsm_batch.
+ */
+#ifndef FSM_BATCH
+void fsm_batch( event_t *evts, int n )
+{
+   int i;
+   for (i=0; i<n; i++)
+      fsm( &evts[i] );
+}
+#endif /* FSM_BATCH */
@@ -9,6 +9,7 @@
 
 void fsm_start (void);
 void fsm( event_t *evt );
+void fsm_batch( event_t *evts, int n );
 
 
 #endif /* _FSM_H */
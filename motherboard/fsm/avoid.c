@@ -3,108 +3,182 @@
 #include "conf.h"
 
 #include "fsm.h"
+#include "hsm.h"
 #include "timer.h"
 #include "adc.h"
 #include "mod/dhb.h"
+#include "event_cust.h"
 
 #include <stdint.h>
 #include <string.h>
 
 
 #define ABS(x)    ((x)>0)?(x):-(x)
-#define FSM_INIT        1
-#define FSM_SEARCH      2
-#define FSM_RUN         3
-#define FSM_ERR         4
-static int fsm_state    = 0;
+
+
+/*
+ * States.
+ */
+#define FSM_INIT        0 /**< Waiting for the module to be enumerated. */
+#define FSM_ACTIVE      1 /**< Module is up and sensors are running. */
+#define FSM_SEARCH      2 /**< Turning looking for free space. */
+#define FSM_RUN         3 /**< Driving forward. */
+#define FSM_NSTATES     4
+
+
+/*
+ * Timers.
+ */
+#define FSM_TIMER_BLINK 0 /**< LED blink. */
+#define FSM_TIMER_STEP  1 /**< Control step. */
+
+
 static int fsm_adc      = 0;
 static int fsm_turn     = 0;
 static int16_t fsm_speed = 0;
 static uint16_t fsm_adcBuf[2];
+static int fsm_tmrBlink = TIMER_INVALID;
+static int fsm_tmrStep  = TIMER_INVALID;
 
 
 /*
  * Prototypes
  */
-static void fsm_search (void);
-static void fsm_run (void);
-static void fsm_init( event_t *evt );
+static uint16_t fsm_dist (void);
+static void fsm_mode( event_t *evt );
+static void fsm_begin( event_t *evt );
+static void fsm_blink( event_t *evt );
+static void fsm_adcDone( event_t *evt );
+static int fsm_near( event_t *evt );
+static int fsm_far( event_t *evt );
+static void fsm_search( event_t *evt );
+static void fsm_turnAround( event_t *evt );
+static void fsm_run( event_t *evt );
+
+
+/*
+ * Transitions.
+ */
+static const hsm_trans_t PROGMEM fsm_init_custom[] = {
+   { .source = EVENT_CUST_DHB_READY, .target = HSM_INTERNAL, .guard = NULL, .action = fsm_mode },
+   HSM_TRANS_END
+};
+static const hsm_trans_t PROGMEM fsm_init_spi[] = {
+   { .source = HSM_ANY, .target = FSM_SEARCH, .guard = NULL, .action = fsm_begin },
+   HSM_TRANS_END
+};
+static const hsm_trans_t PROGMEM fsm_active_timer[] = {
+   { .source = FSM_TIMER_BLINK, .target = HSM_INTERNAL, .guard = NULL, .action = fsm_blink },
+   HSM_TRANS_END
+};
+static const hsm_trans_t PROGMEM fsm_active_adc[] = {
+   { .source = HSM_ANY, .target = HSM_INTERNAL, .guard = NULL, .action = fsm_adcDone },
+   HSM_TRANS_END
+};
+static const hsm_trans_t PROGMEM fsm_search_timer[] = {
+   { .source = FSM_TIMER_STEP, .target = FSM_RUN, .guard = fsm_near, .action = fsm_search },
+   { .source = FSM_TIMER_STEP, .target = HSM_INTERNAL, .guard = NULL, .action = fsm_search },
+   HSM_TRANS_END
+};
+static const hsm_trans_t PROGMEM fsm_run_timer[] = {
+   { .source = FSM_TIMER_STEP, .target = FSM_SEARCH, .guard = fsm_far, .action = fsm_turnAround },
+   { .source = FSM_TIMER_STEP, .target = HSM_INTERNAL, .guard = NULL, .action = fsm_run },
+   HSM_TRANS_END
+};
+
+
+/*
+ * States.
+ */
+static const hsm_state_t PROGMEM fsm_states[ FSM_NSTATES ] = {
+   [FSM_INIT]     = { .parent = HSM_NONE,
+                      .on = { [EVENT_TYPE_CUSTOM] = fsm_init_custom,
+                              [EVENT_TYPE_SPI]    = fsm_init_spi } },
+   [FSM_ACTIVE]   = { .parent = HSM_NONE,
+                      .on = { [EVENT_TYPE_TIMER] = fsm_active_timer,
+                              [EVENT_TYPE_ADC]   = fsm_active_adc } },
+   [FSM_SEARCH]   = { .parent = FSM_ACTIVE,
+                      .on = { [EVENT_TYPE_TIMER] = fsm_search_timer } },
+   [FSM_RUN]      = { .parent = FSM_ACTIVE,
+                      .on = { [EVENT_TYPE_TIMER] = fsm_run_timer } }
+};
+static hsm_t fsm_hsm;
+static hsm_stats_t fsm_stats[ FSM_NSTATES ];
 
 
 void fsm_start (void)
 {
-   fsm_state   = FSM_INIT;
    dhb_init( 1 ); /* Initialize the peripheral. */
-   timer_start( 0, 250, NULL ); /* 250 ms start delay. */
+   hsm_start( &fsm_hsm, fsm_states, fsm_stats, FSM_NSTATES, FSM_INIT );
+   fsm_tmrBlink = timer_alloc( FSM_TIMER_BLINK, NULL );
+   fsm_tmrStep  = timer_alloc( FSM_TIMER_STEP, NULL );
 }
 
 
-static void fsm_init( event_t *evt )
+void fsm( event_t *evt )
 {
-   switch (evt->type) {
-      case EVENT_TYPE_TIMER:
-         dhb_mode( 1, DHB_MODE_FBKS );
-         break;
-
-      case EVENT_TYPE_SPI:
-         fsm_state   = FSM_SEARCH;
-         timer_start( 0, 500, NULL );
-         timer_start( 1, 500, NULL );
-         adc_start( fsm_adc );
-         break;
-
-      default:
-         break;
-   }
+   hsm_dispatch( &fsm_hsm, evt );
 }
 
 
-void fsm( event_t *evt )
+/**
+ * @brief Calculate distance as average of both sensors.
+ */
+static uint16_t fsm_dist (void)
 {
-   /* Start with the init loop. */
-   if (fsm_state == FSM_INIT) {
-      fsm_init( evt );
-      return;
-   }
-   else if (fsm_state == FSM_ERR) {
-      LED0_ON();
-      return;
-   }
+   return (fsm_adcBuf[0] + fsm_adcBuf[1]) >> 1;
+}
 
-   /* Handle normal events. */
-   switch (evt->type) {
-      case EVENT_TYPE_TIMER:
-         if (evt->timer.timer == 0) {
-            LED0_TOGGLE();
-            timer_start( 0, 500, NULL );
-         }
-         else if (evt->timer.timer == 1) {
-
-            if (fsm_state == FSM_SEARCH)
-               fsm_search();
-            else if (fsm_state == FSM_RUN)
-               fsm_run();
-         }
-         break;
-
-      case EVENT_TYPE_ADC:
-         fsm_adcBuf[ fsm_adc ]  = ADCL;
-         fsm_adcBuf[ fsm_adc ] += ADCH<<8;
-         /*printf( "adc %d: %u", fsm_adc, fsm_adcBuf[ fsm_adc ] );*/
-         fsm_adc = 1-fsm_adc;
-         adc_start( fsm_adc );
-         break;
-
-      default:
-         break;
-   }
+
+static void fsm_mode( event_t *evt )
+{
+   dhb_mode( 1, DHB_MODE_FBKS );
+}
+
+
+static void fsm_begin( event_t *evt )
+{
+   timer_periodic( fsm_tmrBlink, 500 );
+   timer_periodic( fsm_tmrStep, 500 );
+   adc_start( fsm_adc );
+}
+
+
+static void fsm_blink( event_t *evt )
+{
+   LED0_TOGGLE();
 }
 
 
-static void fsm_search (void)
+static void fsm_adcDone( event_t *evt )
 {
-   uint16_t dist;
+   fsm_adcBuf[ evt->adc.channel ] = evt->adc.value;
+   /*printf( "adc %d: %u", fsm_adc, fsm_adcBuf[ fsm_adc ] );*/
+   fsm_adc = 1-fsm_adc;
+   adc_start( fsm_adc );
+}
 
+
+/**
+ * @brief Found free space while searching.
+ */
+static int fsm_near( event_t *evt )
+{
+   return (fsm_dist() < 300);
+}
+
+
+/**
+ * @brief Ran out of free space while running.
+ */
+static int fsm_far( event_t *evt )
+{
+   return (fsm_dist() > 400);
+}
+
+
+static void fsm_search( event_t *evt )
+{
    fsm_speed = 20;
    if (fsm_turn > 0) {
       dhb_target( 1, fsm_speed, -fsm_speed );
@@ -114,51 +188,38 @@ static void fsm_search (void)
       dhb_target( 1, -fsm_speed, fsm_speed );
       fsm_turn = -1;
    }
+}
 
-   /* Calculate distance as average of both sensors. */
-   dist = (fsm_adcBuf[0] + fsm_adcBuf[1]) >> 1;
-
-   if ((dist < 300) && (fsm_turn < 0))
-      fsm_state = FSM_RUN;
 
-   timer_start( 1, 500, NULL );
+static void fsm_turnAround( event_t *evt )
+{
+   /* Choose direction to turn. */
+   if (fsm_adcBuf[0] > fsm_adcBuf[1])
+      fsm_turn = 1;
+   else
+      fsm_turn = 0;
+
+   /* Back up. */
+   fsm_speed = -50;
+   dhb_target( 1, fsm_speed, fsm_speed );
 }
 
 
-static void fsm_run (void)
+static void fsm_run( event_t *evt )
 {
-   uint16_t dist;
    int16_t speed;
    int16_t diff;
 
-   /* Calculate distance as average of both sensors. */
-   dist = (fsm_adcBuf[0] + fsm_adcBuf[1]) >> 1;
-
-   if (dist > 400) {
-      /* Choose direction to turn. */
-      if (fsm_adcBuf[0] > fsm_adcBuf[1])
-         fsm_turn = 1;
-      else
-         fsm_turn = 0;
-
-      /* Change state. */
-      fsm_state = FSM_SEARCH;
-      fsm_speed = -50;
-   }
-   else {
-      speed = (512 - dist)/3;
-      diff  = fsm_speed - speed;
-      diff  = ABS(diff);
-      if (diff > 20)
-         fsm_speed = speed;
-      if (fsm_speed > 64)
-         fsm_speed = 64;
-   }
+   speed = (512 - fsm_dist())/3;
+   diff  = fsm_speed - speed;
+   diff  = ABS(diff);
+   if (diff > 20)
+      fsm_speed = speed;
+   if (fsm_speed > 64)
+      fsm_speed = 64;
 
    /* Adjust speed. */
    dhb_target( 1, fsm_speed, fsm_speed );
-
-   timer_start( 1, 500, NULL );
 }
 
 
@@ -6,79 +6,136 @@
 #include <stdio.h>
 
 #include "fsm.h"
+#include "hsm.h"
 #include "timer.h"
 #include "mod/dhb.h"
 #include "event_cust.h"
 #include "spim.h"
 
 
-static int fsm_action = 0;
+/*
+ * States.
+ */
+#define FSM_START       0 /**< Waiting for the module to be enumerated. */
+#define FSM_SETUP       1 /**< Waiting to set the targets. */
+#define FSM_POLL        2 /**< Cycling the module. */
+#define FSM_NSTATES     3
+
+
+/*
+ * Timers.
+ */
+#define FSM_TIMER_POLL  1 /**< Delay between cycles. */
+#define FSM_TIMER_SETUP 2 /**< Delay before setting targets. */
+static int fsm_tmrPoll  = TIMER_INVALID;
+static int fsm_tmrSetup = TIMER_INVALID;
+
+
+/*
+ * Actions.
+ */
+static int fsm_found( event_t *evt );
+static void fsm_setMode( event_t *evt );
+static void fsm_cycle( event_t *evt );
+static void fsm_printCycle( event_t *evt );
+
+
+/*
+ * Transitions.
+ */
+static const hsm_trans_t PROGMEM fsm_start_custom[] = {
+   { .source = EVENT_CUST_DHB_READY, .target = FSM_SETUP, .guard = fsm_found, .action = fsm_setMode },
+   HSM_TRANS_END
+};
+static const hsm_trans_t PROGMEM fsm_setup_timer[] = {
+   { .source = FSM_TIMER_SETUP, .target = FSM_POLL, .guard = NULL, .action = fsm_cycle },
+   HSM_TRANS_END
+};
+static const hsm_trans_t PROGMEM fsm_poll_timer[] = {
+   { .source = FSM_TIMER_POLL, .target = HSM_INTERNAL, .guard = NULL, .action = fsm_cycle },
+   HSM_TRANS_END
+};
+static const hsm_trans_t PROGMEM fsm_poll_custom[] = {
+   { .source = EVENT_CUST_DHB_CYCLE, .target = HSM_INTERNAL, .guard = NULL, .action = fsm_printCycle },
+   HSM_TRANS_END
+};
+
+
+/*
+ * States.
+ */
+static const hsm_state_t PROGMEM fsm_states[ FSM_NSTATES ] = {
+   [FSM_START]    = { .parent = HSM_NONE,
+                      .on = { [EVENT_TYPE_CUSTOM] = fsm_start_custom } },
+   [FSM_SETUP]    = { .parent = HSM_NONE,
+                      .on = { [EVENT_TYPE_TIMER] = fsm_setup_timer } },
+   [FSM_POLL]     = { .parent = HSM_NONE,
+                      .on = { [EVENT_TYPE_TIMER]  = fsm_poll_timer,
+                              [EVENT_TYPE_CUSTOM] = fsm_poll_custom } }
+};
+static hsm_t fsm_hsm;
+static hsm_stats_t fsm_stats[ FSM_NSTATES ];
 
 
 void fsm_start (void)
 {
    dhb_init(1);
-   timer_start( 0, 250, NULL ); /* 250 ms start delay. */
+   hsm_start( &fsm_hsm, fsm_states, fsm_stats, FSM_NSTATES, FSM_START );
+   fsm_tmrPoll  = timer_alloc( FSM_TIMER_POLL, NULL );
+   fsm_tmrSetup = timer_alloc( FSM_TIMER_SETUP, NULL );
 }
 
 
 void fsm( event_t *evt )
 {
-   uint16_t cura, curb;
+   hsm_dispatch( &fsm_hsm, evt );
+}
+
+
+/**
+ * @brief Module answered enumeration.
+ */
+static int fsm_found( event_t *evt )
+{
+   if (evt->custom.data == 0)
+      printf( "DHB not found\n" );
+   return (evt->custom.data != 0);
+}
+
+
+static void fsm_setMode( event_t *evt )
+{
+   const dhb_info_t *info;
+
+   info = dhb_info( 1 );
+   printf( "DHB v%u caps %02X spi %u00 kHz telemetry %u Hz\n",
+         info->version, info->caps, info->spi_max, info->telem_hz );
+   dhb_mode( 1, DHB_MODE_FBKS );
+   timer_start( fsm_tmrSetup, 250 );
+}
+
+
+static void fsm_cycle( event_t *evt )
+{
+   /* Targets, feedback and current in one frame. */
+   dhb_cycle( 1, 70, 40 );
+   LED0_TOGGLE();
+   /* Pipelined replies only come in with the next cycle. */
+   timer_start( fsm_tmrPoll, 100 );
+}
+
+
+static void fsm_printCycle( event_t *evt )
+{
    int16_t fbka, fbkb;
+   uint16_t cura, curb;
 
-   switch (evt->type) {
-      case EVENT_TYPE_TIMER:
-         if (evt->timer.timer == 0) {
-            dhb_mode( 1, DHB_MODE_FBKS );
-            timer_start( 2, 250, NULL );
-         }
-         else if (evt->timer.timer == 1) {
-            if (fsm_action)
-               dhb_feedback( 1 );
-            else
-               dhb_current( 1 );
-            /*
-            int n;
-            char *inbuf;
-            inbuf = spim_inbuf( &n );
-            printf( "%02x %02x %02x %02x %02x %02x %02x %02x %02x\n",
-                  inbuf[0], inbuf[1], inbuf[2], inbuf[3],
-                  inbuf[4], inbuf[5], inbuf[6], inbuf[7],
-                  inbuf[8] );
-            */
-            fsm_action = 1 - fsm_action;
-            LED0_TOGGLE();
-         }
-         else if (evt->timer.timer == 2) {
-            dhb_target( 1, 70, 40 );
-            timer_start( 1, 100, NULL );
-         }
-         break;
-
-      case EVENT_TYPE_CUSTOM:
-         if (evt->custom.id == EVENT_CUST_DHB_FEEDBACK) {
-            if (evt->custom.data == 0)
-               printf( "DHB Feedback CRC error\n" );
-            else {
-               dhb_feedbackValue( 1, &fbka, &fbkb );
-               printf( "fbk %d %d\n", fbka, fbkb );
-            }
-            timer_start( 1, 100, NULL );
-         }
-         else if (evt->custom.id == EVENT_CUST_DHB_CURRENT) {
-            if (evt->custom.data == 0)
-               printf( "DHB Current CRC error\n" );
-            else {
-               dhb_currentValue( 1, &cura, &curb );
-               printf( "cur %u %u\n", cura, curb );
-            }
-            timer_start( 1, 100, NULL );
-         }
-         break;
-
-      default:
-         break;
+   if (evt->custom.data == 0)
+      printf( "DHB Cycle CRC error\n" );
+   else {
+      dhb_feedbackValue( 1, &fbka, &fbkb );
+      dhb_currentValue( 1, &cura, &curb );
+      printf( "fbk %d %d cur %u %u\n", fbka, fbkb, cura, curb );
    }
 }
 
@@ -0,0 +1,224 @@
+
+
+#include "hsm.h"
+
+#include <stdio.h>
+#include <avr/pgmspace.h>
+
+#include "timer.h"
+
+
+/*
+ * Flash accessors.
+ */
+#define HSM_PARENT( hsm, s )     pgm_read_byte( &(hsm)->states[s].parent )
+#define HSM_ENTRY( hsm, s )      ((hsm_entry_t) pgm_read_word( &(hsm)->states[s].entry ))
+#define HSM_EXIT( hsm, s )       ((hsm_entry_t) pgm_read_word( &(hsm)->states[s].exit ))
+#define HSM_ON( hsm, s, type )   ((const hsm_trans_t*) pgm_read_word( &(hsm)->states[s].on[type] ))
+
+
+/*
+ * Prototypes.
+ */
+static uint8_t hsm_depth( const hsm_t *hsm, uint8_t s );
+static uint8_t hsm_lca( const hsm_t *hsm, uint8_t a, uint8_t b );
+static void hsm_enter( hsm_t *hsm, uint8_t s );
+static void hsm_exit( hsm_t *hsm, uint8_t s );
+static void hsm_enterPath( hsm_t *hsm, uint8_t top, uint8_t s );
+static void hsm_transition( hsm_t *hsm, const hsm_trans_t *t, event_t *evt );
+
+
+/**
+ * @brief Gets the depth of a state in the hierarchy.
+ */
+static uint8_t hsm_depth( const hsm_t *hsm, uint8_t s )
+{
+   uint8_t d = 0;
+   while ((s = HSM_PARENT( hsm, s )) != HSM_NONE)
+      d++;
+   return d;
+}
+
+
+/**
+ * @brief Gets the lowest common ancestor of two states.
+ *
+ * A state is not its own ancestor, so a self transition exits and reenters.
+ */
+static uint8_t hsm_lca( const hsm_t *hsm, uint8_t a, uint8_t b )
+{
+   uint8_t da, db;
+
+   if (a == b)
+      return HSM_PARENT( hsm, a );
+
+   /* Bring both to the same depth. */
+   da = hsm_depth( hsm, a );
+   db = hsm_depth( hsm, b );
+   while (da > db) {
+      a = HSM_PARENT( hsm, a );
+      da--;
+   }
+   while (db > da) {
+      b = HSM_PARENT( hsm, b );
+      db--;
+   }
+
+   /* Climb together. */
+   while (a != b) {
+      a = HSM_PARENT( hsm, a );
+      b = HSM_PARENT( hsm, b );
+   }
+   return a;
+}
+
+
+/**
+ * @brief Enters a single state.
+ */
+static void hsm_enter( hsm_t *hsm, uint8_t s )
+{
+   hsm_entry_t func;
+
+   hsm->stats[s].entered++;
+   hsm->stats[s].since = timer_ticks();
+
+   func = HSM_ENTRY( hsm, s );
+   if (func != NULL)
+      func();
+}
+
+
+/**
+ * @brief Exits a single state.
+ */
+static void hsm_exit( hsm_t *hsm, uint8_t s )
+{
+   hsm_entry_t func;
+
+   func = HSM_EXIT( hsm, s );
+   if (func != NULL)
+      func();
+
+   hsm->stats[s].residency += (uint16_t)(timer_ticks() - hsm->stats[s].since);
+}
+
+
+/**
+ * @brief Enters all the states from below top down to s.
+ */
+static void hsm_enterPath( hsm_t *hsm, uint8_t top, uint8_t s )
+{
+   if (s == top)
+      return;
+   hsm_enterPath( hsm, top, HSM_PARENT( hsm, s ) );
+   hsm_enter( hsm, s );
+}
+
+
+/**
+ * @brief Takes a transition.
+ */
+static void hsm_transition( hsm_t *hsm, const hsm_trans_t *t, event_t *evt )
+{
+   uint8_t s, lca;
+
+   /* Internal transitions only run the action. */
+   if (t->target == HSM_INTERNAL) {
+      if (t->action != NULL)
+         t->action( evt );
+      return;
+   }
+
+   /* Exit up to the common ancestor. */
+   lca = hsm_lca( hsm, hsm->cur, t->target );
+   for (s = hsm->cur; s != lca; s = HSM_PARENT( hsm, s ))
+      hsm_exit( hsm, s );
+
+   /* Run the action. */
+   if (t->action != NULL)
+      t->action( evt );
+
+   /* Enter down to the target. */
+   hsm->cur = t->target;
+   hsm_enterPath( hsm, lca, t->target );
+}
+
+
+void hsm_start( hsm_t *hsm, const hsm_state_t *states, hsm_stats_t *stats,
+      uint8_t nstates, uint8_t initial )
+{
+   uint8_t i;
+
+   hsm->states  = states;
+   hsm->stats   = stats;
+   hsm->nstates = nstates;
+   hsm->cur     = initial;
+
+   /* Clear statistics. */
+   for (i=0; i<nstates; i++) {
+      stats[i].residency = 0;
+      stats[i].entered   = 0;
+      stats[i].since     = 0;
+   }
+
+   /* Enter the initial state. */
+   hsm_enterPath( hsm, HSM_NONE, initial );
+}
+
+
+int hsm_dispatch( hsm_t *hsm, event_t *evt )
+{
+   uint8_t s, source;
+   hsm_trans_t t;
+   const hsm_trans_t *list;
+
+   source = event_source( evt );
+
+   /* Climb the hierarchy looking for a handler. */
+   for (s = hsm->cur; s != HSM_NONE; s = HSM_PARENT( hsm, s )) {
+      list = HSM_ON( hsm, s, evt->type );
+      if (list == NULL)
+         continue;
+
+      /* Go through the transitions for this event type. */
+      for (;; list++) {
+         memcpy_P( &t, list, sizeof(t) );
+         if (t.target == HSM_NONE)
+            break;
+         if ((t.source != HSM_ANY) && (t.source != source))
+            continue;
+         if ((t.guard != NULL) && !t.guard( evt ))
+            continue;
+
+         hsm_transition( hsm, &t, evt );
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+
+uint8_t hsm_state( const hsm_t *hsm )
+{
+   return hsm->cur;
+}
+
+
+void hsm_stats( const hsm_t *hsm, uint8_t state, hsm_stats_t *stats )
+{
+   uint8_t s;
+
+   *stats = hsm->stats[ state ];
+
+   /* Add the current stay if active. */
+   for (s = hsm->cur; s != HSM_NONE; s = HSM_PARENT( hsm, s )) {
+      if (s == state) {
+         stats->residency += (uint16_t)(timer_ticks() - stats->since);
+         break;
+      }
+   }
+}
+
+
@@ -0,0 +1,141 @@
+#ifndef _HSM_H
+#  define _HSM_H
+
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+#include "event.h"
+
+
+/**
+ * @file
+ *
+ * @brief Table driven hierarchical state machine engine.
+ *
+ * States and transitions are described by const tables kept in flash. Each
+ *  state has a table of transition lists indexed by event type, so finding the
+ *  transitions for an event is a single lookup per level of hierarchy.
+ *
+ * @code
+ * static const hsm_trans_t PROGMEM idle_timer[] = {
+ *    { .source = 0, .target = ST_RUN, .guard = NULL, .action = run_start },
+ *    HSM_TRANS_END
+ * };
+ * static const hsm_state_t PROGMEM states[] = {
+ *    [ST_IDLE] = { .parent = HSM_NONE, .on = { [EVENT_TYPE_TIMER] = idle_timer } },
+ *    ...
+ * };
+ * @endcode
+ */
+
+
+#define HSM_NONE        0xFF /**< No state, used for top level parents. */
+#define HSM_INTERNAL    0xFE /**< Target for internal transitions (no state change). */
+#define HSM_ANY         0xFF /**< Matches events from any source. */
+#define HSM_TRANS_END   { .source = HSM_ANY, .target = HSM_NONE, .guard = NULL, .action = NULL } /**< Ends a transition list. */
+
+
+typedef void (*hsm_entry_t)(void); /**< Entry or exit action. */
+typedef int (*hsm_guard_t)(event_t*); /**< Guard, return 1 to allow the transition. */
+typedef void (*hsm_action_t)(event_t*); /**< Transition action. */
+
+
+/**
+ * @brief A transition.
+ *
+ * Transitions must target leaf states.
+ */
+typedef struct hsm_trans_s {
+   uint8_t source; /**< Source of the event or HSM_ANY. */
+   uint8_t target; /**< State to go to, HSM_INTERNAL to stay. */
+   hsm_guard_t guard; /**< Guard or NULL to always take. */
+   hsm_action_t action; /**< Action or NULL for none. */
+} hsm_trans_t;
+
+
+/**
+ * @brief A state.
+ */
+typedef struct hsm_state_s {
+   uint8_t parent; /**< Parent state or HSM_NONE. */
+   hsm_entry_t entry; /**< Run when entering the state or NULL. */
+   hsm_entry_t exit; /**< Run when exiting the state or NULL. */
+   const hsm_trans_t *on[ EVENT_TYPE_MAX ]; /**< Transitions by event type, NULL if none. */
+} hsm_state_t;
+
+
+/**
+ * @brief State statistics.
+ */
+typedef struct hsm_stats_s {
+   uint32_t residency; /**< Ticks spent in the state (including substates). */
+   uint16_t entered; /**< Times the state was entered. */
+   uint16_t since; /**< Tick the state was last entered. */
+} hsm_stats_t;
+
+
+/**
+ * @brief A running state machine.
+ */
+typedef struct hsm_s {
+   const hsm_state_t *states; /**< State table in flash. */
+   hsm_stats_t *stats; /**< Statistics, one per state. */
+   uint8_t nstates; /**< Amount of states. */
+   uint8_t cur; /**< Current leaf state. */
+} hsm_t;
+
+
+/**
+ * @brief Starts a state machine.
+ *
+ * Entry actions are run from the top level state down to the initial state.
+ *
+ *    @param hsm State machine to start.
+ *    @param states State table in flash.
+ *    @param stats Statistics to fill, must have nstates elements.
+ *    @param nstates Amount of states.
+ *    @param initial Initial leaf state.
+ */
+void hsm_start( hsm_t *hsm, const hsm_state_t *states, hsm_stats_t *stats,
+      uint8_t nstates, uint8_t initial );
+
+
+/**
+ * @brief Dispatches an event to a state machine.
+ *
+ * Looks for the first transition matching the event's type and source whose
+ *  guard passes, starting at the current state and moving up through its
+ *  parents. Exit actions, the transition action and entry actions are run in
+ *  that order.
+ *
+ *    @param hsm State machine to dispatch to.
+ *    @param evt Event to dispatch.
+ *    @return 1 if a transition was taken, 0 if the event was ignored.
+ */
+int hsm_dispatch( hsm_t *hsm, event_t *evt );
+
+
+/**
+ * @brief Gets the current state.
+ *
+ *    @param hsm State machine to get state of.
+ *    @return The current leaf state.
+ */
+uint8_t hsm_state( const hsm_t *hsm );
+
+
+/**
+ * @brief Gets the statistics of a state.
+ *
+ *    @param hsm State machine to get statistics of.
+ *    @param state State to get statistics of.
+ *    @param[out] stats Statistics, residency includes the time spent so far
+ *                      if the state is active.
+ */
+void hsm_stats( const hsm_t *hsm, uint8_t state, hsm_stats_t *stats );
+
+
+#endif /* _HSM_H */
+
+
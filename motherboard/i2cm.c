@@ -4,6 +4,7 @@
 
 #include "i2cm.h"
 #include "event.h"
+#include "wdog.h"
 
 #include <avr/interrupt.h>
 
@@ -49,7 +50,7 @@
 /*
  * Buffers.
  */
-static char i2c_buf[ SPI_BUFFER_LEN ]; /**< I2C buffer (rw) */
+static char i2c_buf[ I2C_BUFFER_LEN ]; /**< I2C buffer (rw) */
 static volatile int  i2c_len     = 0; /**< Length of the buffer to write or read. */
 static volatile int  i2c_pos     = 0; /**< Position within the buffer. */
 static int  i2c_state            = I2C_STATE_NONE; /**< Current I2C stat. */
@@ -57,6 +58,12 @@ static uint8_t i2c_twcr          = 0; /**< Temporary variable to store the TWCR
 static uint8_t i2c_ok            = 0; /**< Set to 1 if transmission was completed successfully. */
 
 
+/*
+ * Prototypes.
+ */
+static void i2cm_done (void);
+
+
 /**
  * @brief Initializes the SPI perpipheral as master.
  */
@@ -96,7 +103,7 @@ void i2cm_start( uint8_t addr, int rw )
 {
    /* Clear buffers. */
    i2c_pos     = 0;
-   i2c_len     = 1; /* Length is 1 because of the address+rw byte. */
+   i2c_len     = 0;
    i2c_ok      = 0;
    i2c_state   = I2C_STATE_NONE;
 
@@ -106,14 +113,14 @@ void i2cm_start( uint8_t addr, int rw )
                _BV(TWINT) | /* Clear interrupt flag. */
                _BV(TWSTA); /**< Send start condition. */
 
-   /* First char must be address and rw. */
+   /* First char must be address and rw, events report it as the source. */
    i2c_buf[ i2c_len++ ] = (addr<<1) | rw;
 }
 
 
 void i2cm_transmitChar( char ch )
 {
-   if (i2c_len >= SPI_BUFFER_LEN)
+   if (i2c_len >= I2C_BUFFER_LEN)
       return;
    i2c_buf[ i2c_len++ ] = ch;
 }
@@ -123,8 +130,8 @@ void i2cm_transmitString( const char *data, int len )
 {
    int i, n;
    n = len;
-   if (i2c_len + n > SPI_BUFFER_LEN)
-      n = SPI_BUFFER_LEN - i2c_len;
+   if (i2c_len + n > I2C_BUFFER_LEN)
+      n = I2C_BUFFER_LEN - i2c_len;
    for (i=0; i<n; i++) {
       i2c_buf[ i2c_len++ ] = data[i];
    }
@@ -134,6 +141,7 @@ void i2cm_transmitString( const char *data, int len )
 void i2cm_end (void)
 {
    /* Start transmission. */
+   wdog_start( WDOG_TASK_I2C, WDOG_I2C_TIMEOUT );
    TWCR = i2c_twcr;
 }
 
@@ -185,12 +193,31 @@ int i2cm_idle (void)
 
 
 /**
- * @brief Signal handler indicating transfer complete.
+ * @brief Finishes the transfer, runs in the interrupt.
+ *
+ * No interrupt follows a STOP, so this must be called wherever the transfer
+ *  ends.
  */
-ISR( TWI_vect )
+static void i2cm_done (void)
 {
    event_t evt;
 
+   wdog_stop( WDOG_TASK_I2C );
+
+   /* Send end of transmission event. */
+   evt.type      = EVENT_TYPE_I2C;
+   evt.i2c.address = i2c_buf[0] >> 1;
+   evt.i2c.rw    = i2c_buf[0] & 0x01;
+   evt.i2c.ok    = i2c_ok;
+   event_push( &evt );
+}
+
+
+/**
+ * @brief Signal handler indicating transfer complete.
+ */
+ISR( TWI_vect )
+{
    switch (TWSR) {
 
       /* Writing. */
@@ -206,8 +233,10 @@ ISR( TWI_vect )
          }
          else { /* Send STOP after last byte. */
             i2c_ok = 1; /* It went OK. */
-            TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | /* Keep running like before. */
+            TWCR = _BV(TWEN) | /* Keep i2c enabled. */
+                   _BV(TWINT) | /* Clear interrupt. */
                    _BV(TWSTO); /* Send STOP. */
+            i2cm_done();
          }
          break;
 
@@ -232,6 +261,7 @@ ISR( TWI_vect )
          TWCR = _BV(TWEN) | /* Keep i2c enabled. */
                 _BV(TWINT) | /* Clear interrupt. */
                 _BV(TWSTO); /* Send STOP. */
+         i2cm_done();
          break;
 
       /* Arbitration. */
@@ -249,13 +279,7 @@ ISR( TWI_vect )
       default:
          i2c_state = TWSR; /* Store state. */
          TWCR = _BV(TWEN); /* Keep i2c enabled. */
-
-         /* Send end of transmission event. */
-         evt.type      = EVENT_TYPE_I2C;
-         evt.i2c.address = i2c_buf[0] >> 1;
-         evt.i2c.rw    = i2c_buf[0] & 0x01;
-         evt.i2c.ok    = i2c_ok;
-         event_push( &evt );
+         i2cm_done();
          break;
    }
 }
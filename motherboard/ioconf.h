@@ -20,7 +20,7 @@
 #define PWM1_DDR           DDRD
 #define PWM1_PORT          PORTD
 #define PWM1A              PD5
-#define PWM1B              PD4
+#define PWM1B              PD4 /* XCK1, unusable with SPIM_BACKEND_USART. */
 #define PWM2_DDR           DDRD
 #define PWM2_PORT          PORTD
 #define PWM2A              PD7
@@ -48,6 +48,24 @@
 #define SPI_SCK            PB7
 
 
+/* USART1 in master SPI mode, XCK1 is shared with PWM1B so pwm_init leaves it
+ *  alone and OC1B must stay disconnected (COM1B1:0 = 0) with this backend. */
+#define MSPI_DDR           DDRD
+#define MSPI_PORT          PORTD
+#define MSPI_MISO          PD2
+#define MSPI_MOSI          PD3
+#define MSPI_SCK           PD4
+
+
+/* Software SPI, defaults to the SPI pins. */
+#define SWSPI_DDR          DDRB
+#define SWSPI_PORT         PORTB
+#define SWSPI_PIN          PINB
+#define SWSPI_MOSI         PB5
+#define SWSPI_MISO         PB6
+#define SWSPI_SCK          PB7
+
+
 /* Module Global. */
 #define MOD_ON_INT         PCIE2
 #define MOD_ON_MSK         PCMSK2
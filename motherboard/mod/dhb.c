@@ -1,5 +1,7 @@
 
 
+#include "conf.h"
+
 #include "mod.h"
 
 #include "dhb.h"
@@ -9,22 +11,98 @@
 #include "mod_def.h"
 #include "event.h"
 #include "event_cust.h"
+#include "wdog.h"
+#include "timer.h"
+#include "dhb/frame.h"
 
-#include <util/crc16.h>
+#include <avr/interrupt.h>
 #include <stdio.h>
+#include <string.h>
+
+
+#define DHB_FRAMES      (MOD_PORT_NUM*3) /**< Frames that can be in flight, a legacy cycle takes three. */
+#define DHB_TIMER_ENUM  0xF0 /**< Timer identifier for enumeration, port gets added. */
+#define DHB_ENUM_RETRY  50 /**< Milliseconds to wait for an enumeration reply. */
+#define DHB_SPI_LEGACY  50 /**< Fastest clock in 100 kHz of modules that don't report it. */
+#define DHB_PIPELINED(port)   (dhb_infos[(port)-1].caps & DHB_CAP_PIPE) /**< Port takes pipelined frames. */
+#if !EVENT_DEFERRED
+#  error "DHB replies are handled from event_poll, EVENT_DEFERRED must be set."
+#endif /* !EVENT_DEFERRED */
+
+
+/*
+ * Frame states.
+ */
+#define DHB_FRAME_FREE     0 /**< Can be used. */
+#define DHB_FRAME_TAKEN    1 /**< Being filled in, not sent yet. */
+#define DHB_FRAME_SENT     2 /**< Queued or on the bus. */
+#define DHB_FRAME_DONE     3 /**< Clocked, reply waiting to be handled. */
+
+
+/*
+ * Enumeration states.
+ */
+#define DHB_ENUM_VERSION   0 /**< Asking the version, all generations answer it. */
+#define DHB_ENUM_IDENT     1 /**< Asking identity and capabilities. */
+#define DHB_ENUM_DONE      2 /**< Module is known. */
+#define DHB_ENUM_FAILED    3 /**< Module never answered. */
+
+
+/**
+ * @brief A frame to a DHB, the SPI transaction works on the buffers in place.
+ */
+typedef struct dhb_frame_s {
+   spim_trans_t trans; /**< SPI transaction. */
+   char tx[ FRAME_MAX ]; /**< Outgoing frame. */
+   char rx[ FRAME_MAX ]; /**< Reply. */
+   char prev; /**< Command whose reply a pipelined frame carries. */
+   volatile uint8_t state; /**< DHB_FRAME_* state. */
+   uint8_t seq; /**< Order it was sent in, replies are handled in it. */
+   uint8_t cycle; /**< Part of a cycle split up for a legacy module. */
+   uint8_t div; /**< Clock divider it was clocked with. */
+} dhb_frame_t;
 
 
 /*
  * Internal usage variables.
  */
+static dhb_frame_t dhb_frames[ DHB_FRAMES ]; /**< Frames to the modules. */
 static int16_t dhb_var_feedback[MOD_PORT_NUM*2]; /**< Current speed value. */
 static uint16_t dhb_var_current[MOD_PORT_NUM*2]; /**< Current current value. */
+static uint8_t dhb_var_param[MOD_PORT_NUM]; /**< Last parameter gotten. */
+static int16_t dhb_var_paramValue[MOD_PORT_NUM]; /**< Value of the last parameter gotten. */
+static uint8_t dhb_cycleBad[MOD_PORT_NUM]; /**< Feedback of a legacy cycle failed. */
+static uint8_t dhb_inflight = 0; /**< Commands sent and not handled yet. */
+static uint8_t dhb_seqSent = 0; /**< Sequence of the next frame sent. */
+static uint8_t dhb_seqNext = 0; /**< Sequence of the next frame to handle. */
+static event_sub_t dhb_subs[MOD_PORT_NUM]; /**< SPI events of the ports. */
+static spim_trans_t dhb_flushTrans[MOD_PORT_NUM]; /**< Clocks out a stale frame. */
+static const char dhb_flushBuf[ FRAME_MAX ]; /**< Padding, never taken as a header. */
+static uint8_t dhb_spiLimit[MOD_PORT_NUM]; /**< Fastest SPI clock both sides allow. */
+static uint8_t dhb_spiFastest[MOD_PORT_NUM]; /**< Fastest SPI clock known to work. */
+static uint8_t dhb_spiGood[MOD_PORT_NUM]; /**< Good replies since the last clock change. */
+static char dhb_pipeCmd[MOD_PORT_NUM]; /**< Last pipelined command, its reply comes with the next frame. */
+static dhb_info_t dhb_infos[MOD_PORT_NUM]; /**< What the modules reported. */
+static volatile uint8_t dhb_enum[MOD_PORT_NUM]; /**< Enumeration state. */
+static uint8_t dhb_tries[MOD_PORT_NUM]; /**< Enumeration requests left. */
+static int dhb_tmr[MOD_PORT_NUM] = { TIMER_INVALID, TIMER_INVALID }; /**< Enumeration timers. */
 
 
 /*
  * Prototypes.
  */
-static int dhb_send( int port, char cmd, char *data, int len );
+static dhb_frame_t* dhb_frame (void);
+static int dhb_send( int port, dhb_frame_t *frame, char cmd );
+static int dhb_poll( int port, char cmd );
+static void dhb_speed( int port, uint8_t div, int ok );
+static int dhb_spi_callback( spim_trans_t *trans );
+static int dhb_flushDone( spim_trans_t *trans );
+static int dhb_spiEvent( event_t *evt );
+static dhb_frame_t* dhb_handle (void);
+static void dhb_reply( int port, char cmd, const uint8_t *data, uint8_t cycle );
+static void dhb_enumStep( int id );
+static void dhb_enumReply( int port, char cmd, const uint8_t *data );
+static void dhb_ready( int port );
 
 
 int dhb_init( int port )
@@ -40,14 +118,47 @@ int dhb_init( int port )
    if (mod->id != MODULE_ID_NONE)
       return -1;
 
+   /* Enumeration runs off a timer while the module comes up. */
+   dhb_tmr[port-1] = timer_alloc( DHB_TIMER_ENUM+port, dhb_enumStep );
+   if (dhb_tmr[port-1] == TIMER_INVALID)
+      return -1;
+
+   /* Replies get handled when the SPI event is dispatched. */
+   event_subscribe( &dhb_subs[port-1], EVENT_TYPE_SPI, port, dhb_spiEvent );
+
    /* Turn port on. */
    mod_on( port );
 
-   /* Set data. */
+   /* Set data, version comes with enumeration. */
    mod->id        = MODULE_ID_DHB;
-   mod->version   = 1;
+   mod->version   = 0;
    mod->on        = 1;
 
+   /* Classic frames only until the capabilities are known. */
+   memset( &dhb_infos[port-1], 0, sizeof(dhb_info_t) );
+   dhb_pipeCmd[port-1]    = DHB_CMD_NONE;
+
+   /* Start slow and speed up as replies come in fine. */
+   spim_setSpeed( port, SPIM_DIV_128 );
+   spim_setBurst( port, SPIM_BURST_OFF );
+   dhb_spiLimit[port-1]   = DHB_SPI_FASTEST;
+   dhb_spiFastest[port-1] = DHB_SPI_FASTEST;
+   dhb_spiGood[port-1]    = 0;
+
+   /* A module that stayed up may be stuck in a frame or hold a pipelined
+    *  reply, a frame of padding ends it before the first request. */
+   dhb_flushTrans[port-1].port = port;
+   dhb_flushTrans[port-1].len  = FRAME_MAX;
+   dhb_flushTrans[port-1].tx   = dhb_flushBuf;
+   dhb_flushTrans[port-1].rx   = NULL;
+   dhb_flushTrans[port-1].func = dhb_flushDone;
+   spim_submit( &dhb_flushTrans[port-1] );
+
+   /* Ask once it's up. */
+   dhb_enum[port-1]       = DHB_ENUM_VERSION;
+   dhb_tries[port-1]      = DHB_ENUM_TRIES;
+   timer_start( dhb_tmr[port-1], DHB_BOOT_DELAY );
+
    return 0;
 }
 
@@ -61,6 +172,13 @@ void dhb_exit( int port )
    if (mod->id != MODULE_ID_DHB)
       return;
 
+   /* Stop enumerating. */
+   timer_free( dhb_tmr[port-1] );
+   dhb_tmr[port-1] = TIMER_INVALID;
+   dhb_enum[port-1] = DHB_ENUM_FAILED;
+   event_unsubscribe( &dhb_subs[port-1] );
+   spim_setBurst( port, SPIM_BURST_OFF );
+
    mod->id        = MODULE_ID_NONE;
    mod->version   = 0;
    mod->on        = 0;
@@ -68,33 +186,217 @@ void dhb_exit( int port )
 }
 
 
-static int dhb_send( int port, char cmd, char *data, int len )
+const dhb_info_t* dhb_info( int port )
+{
+   return &dhb_infos[port-1];
+}
+
+
+/**
+ * @brief Steps the enumeration of a module, runs off its timer.
+ *
+ *    @param id Identifier of the timer.
+ */
+static void dhb_enumStep( int id )
+{
+   int port;
+
+   port = id - DHB_TIMER_ENUM;
+   switch (dhb_enum[port-1]) {
+      case DHB_ENUM_VERSION:
+      case DHB_ENUM_IDENT:
+         /* Module never answered. */
+         if (dhb_tries[port-1] == 0) {
+            dhb_enum[port-1] = DHB_ENUM_FAILED;
+            dhb_ready( port );
+            break;
+         }
+         dhb_tries[port-1]--;
+
+         /* Retry unless the reply moves us on first. */
+         timer_start( dhb_tmr[port-1], DHB_ENUM_RETRY );
+         if (dhb_enum[port-1] == DHB_ENUM_VERSION)
+            dhb_poll( port, DHB_CMD_VERSION );
+         else
+            dhb_poll( port, DHB_CMD_IDENT );
+         break;
+
+      case DHB_ENUM_DONE:
+         dhb_ready( port );
+         break;
+
+      default:
+         break;
+   }
+}
+
+
+/**
+ * @brief Handles an enumeration reply.
+ *
+ *    @param port Port that replied.
+ *    @param cmd Command replied to.
+ *    @param data Data of the reply or NULL if it was bad.
+ */
+static void dhb_enumReply( int port, char cmd, const uint8_t *data )
+{
+   dhb_info_t *info;
+
+   /* Bad replies get retried by the timer. */
+   if (data == NULL)
+      return;
+
+   info = &dhb_infos[port-1];
+   if ((cmd == DHB_CMD_VERSION) && (dhb_enum[port-1] == DHB_ENUM_VERSION)) {
+      if (data[0] == 0)
+         return;
+      info->version = data[0];
+
+      /* Older modules can't tell, go by the version. */
+      if (info->version >= DHB_VERSION_IDENT)
+         dhb_enum[port-1] = DHB_ENUM_IDENT;
+      else {
+         info->caps  = (info->version >= DHB_VERSION_CYCLE) ? DHB_CAP_CYCLE : 0;
+         info->modes = _BV(DHB_MODE_PWM) | _BV(DHB_MODE_FBKS) | _BV(DHB_MODE_TRQ);
+         info->spi_max = DHB_SPI_LEGACY;
+         dhb_enum[port-1] = DHB_ENUM_DONE;
+      }
+   }
+   else if ((cmd == DHB_CMD_IDENT) && (dhb_enum[port-1] == DHB_ENUM_IDENT)) {
+      if (data[ DHB_IDENT_ID ] != MODULE_ID_DHB)
+         return;
+      info->version  = data[ DHB_IDENT_VERSION ];
+      info->caps     = data[ DHB_IDENT_CAPS ];
+      info->modes    = data[ DHB_IDENT_MODES ];
+      info->spi_max  = data[ DHB_IDENT_SPI ];
+      info->telem_hz = (data[ DHB_IDENT_TELEM ]<<8) + data[ DHB_IDENT_TELEM+1 ];
+      dhb_enum[port-1] = DHB_ENUM_DONE;
+   }
+   else
+      return;
+
+   /* Next step right away. */
+   dhb_tries[port-1] = DHB_ENUM_TRIES;
+   timer_start( dhb_tmr[port-1], 1 );
+}
+
+
+/**
+ * @brief Finishes enumeration, picking the fastest features both sides have.
+ *
+ *    @param port Port that was enumerated.
+ */
+static void dhb_ready( int port )
+{
+   uint8_t div;
+   event_t new_evt;
+   dhb_info_t *info;
+
+   new_evt.type         = EVENT_TYPE_CUSTOM;
+   new_evt.custom.id    = EVENT_CUST_DHB_READY;
+   new_evt.custom.data  = 0; /* 0 is error. */
+
+   info = &dhb_infos[port-1];
+   if (dhb_enum[port-1] == DHB_ENUM_DONE) {
+      mod_get( port )->version = info->version;
+
+      /* Slower of what the board and the module can do. */
+      div = SPIM_DIV_2;
+      while ((div < SPIM_DIV_128) &&
+            (((F_CPU/100000UL) >> (div+1)) > info->spi_max))
+         div++;
+      if (div > dhb_spiLimit[port-1])
+         dhb_spiLimit[port-1] = div;
+      if (dhb_spiLimit[port-1] > dhb_spiFastest[port-1])
+         dhb_spiFastest[port-1] = dhb_spiLimit[port-1];
+
+      /* Bursts must leave the slave its turnaround, rounded up. */
+      if (info->spi_max > 0)
+         spim_setBurst( port, (DHB_TURNAROUND*10 + info->spi_max*4 - 1) /
+               (info->spi_max*4) );
+
+      new_evt.custom.data = port;
+   }
+
+   event_push( &new_evt );
+}
+
+
+/**
+ * @brief Gets a free frame.
+ *
+ * Replies whose SPI event got dropped are handled to free their frames.
+ *
+ *    @return A frame taken for dhb_send or NULL if there are none.
+ */
+static dhb_frame_t* dhb_frame (void)
 {
    int i;
-   char crc;
+   dhb_frame_t *frame;
+
+   frame = NULL;
+   for (i=0; i<DHB_FRAMES; i++) {
+      if (dhb_frames[i].state == DHB_FRAME_FREE) {
+         frame = &dhb_frames[i];
+         break;
+      }
+   }
+   if (frame == NULL)
+      frame = dhb_handle();
+
+   if (frame != NULL) {
+      frame->state = DHB_FRAME_TAKEN;
+      frame->cycle = 0;
+   }
+   return frame;
+}
+
+
+/**
+ * @brief Sends a frame.
+ *
+ * Frames are pipelined if the module supports it.
+ *
+ *    @param port Port to send to.
+ *    @param frame Frame gotten from dhb_frame with the data already in place,
+ *                 given back if it can't be sent.
+ *    @param cmd Command to send.
+ *    @return 0 on success.
+ */
+static int dhb_send( int port, dhb_frame_t *frame, char cmd )
+{
+   uint8_t pipe, len;
    module_t *mod;
 
    /* Check module. */
    mod = mod_get( port );
-   if (mod->id != MODULE_ID_DHB)
+   if (mod->id != MODULE_ID_DHB) {
+      frame->state = DHB_FRAME_FREE;
       return -1;
+   }
 
-   /* Check sending. */
-   if (!spim_idle())
-      return -1;
+   /* Reply to the previous command rides along when pipelined. */
+   pipe = DHB_PIPELINED(port);
+   if (pipe) {
+      frame->prev         = dhb_pipeCmd[port-1];
+      dhb_pipeCmd[port-1] = cmd;
+   }
+   len = frame_encode( (uint8_t*)frame->tx, pipe, cmd, frame->prev );
+
+   /* Transaction works on the frame in place. */
+   frame->trans.port = port;
+   frame->trans.len  = len;
+   frame->trans.tx   = frame->tx;
+   frame->trans.rx   = frame->rx;
+   frame->trans.func = dhb_spi_callback;
+   frame->state      = DHB_FRAME_SENT;
+   frame->seq        = dhb_seqSent++;
 
-   /* Calculate CRC. */
-   crc = _crc_ibutton_update( 0, cmd );
-   for (i=0; i<len; i++)
-      crc = _crc_ibutton_update( crc, data[i] );
+   /* Reply must be handled in time. */
+   if (dhb_inflight++ == 0)
+      wdog_start( WDOG_TASK_DHB, WDOG_DHB_TIMEOUT );
 
-   /* Send data. */
-   spim_transmitStart();
-   spim_transmitChar( 0x80 ); /* Header. */
-   spim_transmitChar( cmd ); /* Command. */
-   spim_transmitString( data, len ); /* Data. */
-   spim_transmitChar( crc ); /* CRC. */
-   spim_transmitEnd( port );
+   spim_submit( &frame->trans );
 
    return 0;
 }
@@ -102,123 +404,385 @@ static int dhb_send( int port, char cmd, char *data, int len )
 
 int dhb_mode( int port, char mode )
 {
-   char data[1];
-   data[0] = mode;
-   return dhb_send( port, DHB_CMD_MODESET, data, sizeof(data) );
+   dhb_frame_t *frame;
+
+   /* Module must support it once it's known. */
+   if ((dhb_infos[port-1].modes != 0) && !(dhb_infos[port-1].modes & _BV(mode)))
+      return -1;
+
+   frame = dhb_frame();
+   if (frame == NULL)
+      return -1;
+   frame->tx[2] = mode;
+   return dhb_send( port, frame, DHB_CMD_MODESET );
 }
 
 
 int dhb_target( int port, int16_t t0, int16_t t1 )
 {
-   char data[4];
+   dhb_frame_t *frame;
+
+   frame = dhb_frame();
+   if (frame == NULL)
+      return -1;
 
    /* Data. */
-   data[0]  = t0>>8;
-   data[1]  = t0;
-   data[2]  = t1>>8;
-   data[3]  = t1;
+   frame->tx[2] = t0>>8;
+   frame->tx[3] = t0;
+   frame->tx[4] = t1>>8;
+   frame->tx[5] = t1;
 
    /* Send the data. */
-   return dhb_send( port, DHB_CMD_MOTORSET, data, sizeof(data) );
+   return dhb_send( port, frame, DHB_CMD_MOTORSET );
 }
 
-static int dhb_feedback_callback( event_t* evt )
+
+/**
+ * @brief Marks the frame as clocked, runs in the interrupt.
+ */
+static int dhb_spi_callback( spim_trans_t *trans )
 {
-   char *inbuf;
-   int len;
-   event_t new_evt;
-   uint8_t base_pos, crc, i;
+   ((dhb_frame_t*)trans)->div   = spim_speed( trans->port );
+   ((dhb_frame_t*)trans)->state = DHB_FRAME_DONE;
+   return 0; /* Reply gets handled from the event. */
+}
 
-   /* Macro for simplification. */
-   inbuf = spim_inbuf( &len );
 
-   /* Prepare event. */
-   new_evt.type         = EVENT_TYPE_CUSTOM;
-   new_evt.custom.id    = EVENT_CUST_DHB_FEEDBACK;
+/**
+ * @brief Drops the event of the flush, it carries no reply.
+ */
+static int dhb_flushDone( spim_trans_t *trans )
+{
+   return 1;
+}
+
+
+/**
+ * @brief Handles the replies of a port when its SPI event is dispatched.
+ *
+ * Frames are handled in the order they were sent, so those of other ports
+ *  whose event got dropped get handled on the way.
+ *
+ *    @param evt SPI event.
+ *    @return 1 to destroy the event if it carried a reply.
+ */
+static int dhb_spiEvent( event_t *evt )
+{
+   dhb_frame_t *frame;
+   char cmd;
+
+   while ((frame = dhb_handle()) != NULL) {
+      if (frame->trans.port != evt->spi.port)
+         continue;
+      /* Commands without reply let the event through. */
+      cmd = (frame->tx[0] == DHB_HEADER_PIPE) ? frame->prev : frame->tx[1];
+      return (frame_replyLen( cmd ) > 0);
+   }
+   return 0;
+}
 
-   /* Check CRC. */
-   crc = 0;
-   for (i=0; i<len-1; i++)
-      crc = _crc_ibutton_update( crc, inbuf[i] );
-   if (crc != inbuf[len-1]) {
-      new_evt.custom.data  = 0; /* 0 is error. */
-      event_push( &new_evt );
-      return 1;
+
+/**
+ * @brief Handles the reply of the oldest frame sent if it was clocked.
+ *
+ *    @return The frame handled, already free, or NULL if it wasn't clocked.
+ */
+static dhb_frame_t* dhb_handle (void)
+{
+   int i, port;
+   char cmd;
+   uint8_t pipe;
+   const uint8_t *data;
+   dhb_frame_t *frame;
+
+   /* Oldest frame sent. */
+   frame = NULL;
+   for (i=0; i<DHB_FRAMES; i++) {
+      if ((dhb_frames[i].state == DHB_FRAME_DONE) &&
+            (dhb_frames[i].seq == dhb_seqNext)) {
+         frame = &dhb_frames[i];
+         break;
+      }
+   }
+   if (frame == NULL)
+      return NULL;
+   dhb_seqNext++;
+
+   if (--dhb_inflight == 0)
+      wdog_stop( WDOG_TASK_DHB );
+
+   /* Pipelined frames carry the reply to the previous command. */
+   port = frame->trans.port;
+   pipe = (frame->tx[0] == DHB_HEADER_PIPE);
+   cmd  = pipe ? frame->prev : frame->tx[1];
+   if (frame_replyLen( cmd ) > 0) {
+      data = frame_decode( (const uint8_t*)frame->rx, pipe, cmd );
+      switch (cmd) {
+         case DHB_CMD_VERSION:
+         case DHB_CMD_IDENT:
+            dhb_enumReply( port, cmd, data );
+            break;
+         default:
+            /* Reply was clocked in this frame, whatever clock sent the
+             *  command. */
+            dhb_speed( port, frame->div, data != NULL );
+            dhb_reply( port, cmd, data, frame->cycle );
+            break;
+      }
    }
 
-   /* Store value. */
-   base_pos = (evt->spi.port-1)<<1;
-   dhb_var_feedback[base_pos+0] = (inbuf[3]<<8) + inbuf[4];
-   dhb_var_feedback[base_pos+1] = (inbuf[5]<<8) + inbuf[6];
+   /* Frame is still readable until it gets used again. */
+   frame->state = DHB_FRAME_FREE;
+   return frame;
+}
+
+
+/**
+ * @brief Stores the values of a reply and generates its event.
+ *
+ *    @param port Port that replied.
+ *    @param cmd Command replied to.
+ *    @param data Data of the reply or NULL if it was bad.
+ *    @param cycle Reply is part of a cycle split up for a legacy module.
+ */
+static void dhb_reply( int port, char cmd, const uint8_t *data, uint8_t cycle )
+{
+   event_t new_evt;
+   uint8_t base_pos;
+
+   /* Prepare event, 0 is error. */
+   new_evt.type         = EVENT_TYPE_CUSTOM;
+   new_evt.custom.data  = (data != NULL) ? port : 0;
+   base_pos             = (port-1)<<1;
+
+   /* Store values. */
+   switch (cmd) {
+      case DHB_CMD_MOTORGET:
+         new_evt.custom.id = EVENT_CUST_DHB_FEEDBACK;
+         if (data != NULL) {
+            dhb_var_feedback[base_pos+0] = (data[0]<<8) + data[1];
+            dhb_var_feedback[base_pos+1] = (data[2]<<8) + data[3];
+         }
+         /* Cycle event comes with the current. */
+         if (cycle) {
+            dhb_cycleBad[port-1] = (data == NULL);
+            return;
+         }
+         break;
+
+      case DHB_CMD_CURRENT:
+         new_evt.custom.id = EVENT_CUST_DHB_CURRENT;
+         if (data != NULL) {
+            dhb_var_current[base_pos+0]  = (data[0]<<8) + data[1];
+            dhb_var_current[base_pos+1]  = (data[2]<<8) + data[3];
+         }
+         if (cycle) {
+            new_evt.custom.id = EVENT_CUST_DHB_CYCLE;
+            if (dhb_cycleBad[port-1])
+               new_evt.custom.data = 0;
+         }
+         break;
+
+      case DHB_CMD_PARAMGET:
+         new_evt.custom.id = EVENT_CUST_DHB_PARAM;
+         if (data != NULL) {
+            dhb_var_param[port-1]      = data[0];
+            dhb_var_paramValue[port-1] = (data[1]<<8) + data[2];
+         }
+         break;
+
+      default: /* DHB_CMD_CYCLE */
+         new_evt.custom.id = EVENT_CUST_DHB_CYCLE;
+         if (data != NULL) {
+            dhb_var_feedback[base_pos+0] = (data[0]<<8) + data[1];
+            dhb_var_feedback[base_pos+1] = (data[2]<<8) + data[3];
+            dhb_var_current[base_pos+0]  = (data[4]<<8) + data[5];
+            dhb_var_current[base_pos+1]  = (data[6]<<8) + data[7];
+         }
+         break;
+   }
 
    /* Generate event. */
-   new_evt.custom.data  = evt->spi.port;
    event_push( &new_evt );
-   event_setCallback( EVENT_TYPE_SPI, NULL ); /* Disable callback. */
-   return 1; /* Destroy event. */
 }
+
+
+/**
+ * @brief Negotiates the SPI clock of a port.
+ *
+ * Steps the clock up after DHB_SPI_STEP_UP good replies and backs off on a
+ *  CRC error, not going past the failed clock again until DHB_SPI_RECOVER
+ *  good replies.
+ *
+ *    @param port Port that replied.
+ *    @param div Clock divider the reply was clocked with.
+ *    @param ok Whether the reply was fine.
+ */
+static void dhb_speed( int port, uint8_t div, int ok )
+{
+   uint8_t cur;
+
+   cur = spim_speed( port );
+   if (!ok) {
+      /* Frames queued at a faster clock already backed off. */
+      if (div < cur)
+         return;
+      if (div < SPIM_DIV_128)
+         div++;
+      dhb_spiFastest[port-1] = div;
+      dhb_spiGood[port-1]    = 0;
+      spim_setSpeed( port, div );
+   }
+   else if (div != cur)
+      return; /* Says nothing about the current clock. */
+   else if (cur > dhb_spiFastest[port-1]) {
+      if (++dhb_spiGood[port-1] >= DHB_SPI_STEP_UP) {
+         dhb_spiGood[port-1] = 0;
+         spim_setSpeed( port, cur-1 );
+      }
+   }
+   else if (cur > dhb_spiLimit[port-1]) {
+      /* Errors may have been noise, try the failed clock again. */
+      if (++dhb_spiGood[port-1] >= DHB_SPI_RECOVER) {
+         dhb_spiGood[port-1] = 0;
+         dhb_spiFastest[port-1]--;
+      }
+   }
+}
+
+
+/**
+ * @brief Sends a command that only gets a reply.
+ *
+ *    @param port Port to send to.
+ *    @param cmd Command to send.
+ *    @return 0 on success.
+ */
+static int dhb_poll( int port, char cmd )
+{
+   dhb_frame_t *frame;
+
+   frame = dhb_frame();
+   if (frame == NULL)
+      return -1;
+
+   return dhb_send( port, frame, cmd );
+}
+
+
 int dhb_feedback( int port )
 {
-   char data[] = { 0x01, 0x02, 0x03, 0x04, 0x05 };
-   int ret = dhb_send( port, DHB_CMD_MOTORGET, data, sizeof(data) );
-   if (ret == 0)
-      event_setCallback( EVENT_TYPE_SPI, dhb_feedback_callback );
-   return ret;
+   return dhb_poll( port, DHB_CMD_MOTORGET );
 }
 void dhb_feedbackValue( int port, int16_t *mota, int16_t *motb )
 {
+   /* Replies are handled from the main loop, no need to lock. */
    *mota = dhb_var_feedback[(port-1)*2+0];
    *motb = dhb_var_feedback[(port-1)*2+1];
 }
 
 
-static int dhb_current_callback( event_t* evt )
+int dhb_current( int port )
 {
-   char *inbuf;
-   int len;
-   event_t new_evt;
-   uint8_t base_pos, crc, i;
-
-   /* Macro for simplification. */
-   inbuf = spim_inbuf( &len );
+   return dhb_poll( port, DHB_CMD_CURRENT );
+}
+void dhb_currentValue( int port, uint16_t *mota, uint16_t *motb )
+{
+   /* Replies are handled from the main loop, no need to lock. */
+   *mota = dhb_var_current[(port-1)*2+0];
+   *motb = dhb_var_current[(port-1)*2+1];
+}
 
-   /* Prepare event. */
-   new_evt.type         = EVENT_TYPE_CUSTOM;
-   new_evt.custom.id    = EVENT_CUST_DHB_CURRENT;
 
-   /* Check CRC. */
-   crc = 0;
-   for (i=0; i<len-1; i++)
-      crc = _crc_ibutton_update( crc, inbuf[i] );
-   if (crc != inbuf[len-1]) {
-      new_evt.custom.data  = 0; /* 0 is error. */
-      event_push( &new_evt );
-      return 1;
+int dhb_cycle( int port, int16_t t0, int16_t t1 )
+{
+   int i;
+   dhb_frame_t *frame, *frames[3];
+
+   /* Older modules take three frames, all or none get sent. */
+   if (!(dhb_infos[port-1].caps & DHB_CAP_CYCLE)) {
+      for (i=0; i<3; i++) {
+         frames[i] = dhb_frame();
+         if (frames[i] == NULL) {
+            while (i-- > 0)
+               frames[i]->state = DHB_FRAME_FREE;
+            return -1;
+         }
+         frames[i]->cycle = 1;
+      }
+      frames[0]->tx[2] = t0>>8;
+      frames[0]->tx[3] = t0;
+      frames[0]->tx[4] = t1>>8;
+      frames[0]->tx[5] = t1;
+      if (dhb_send( port, frames[0], DHB_CMD_MOTORSET )) {
+         frames[1]->state = DHB_FRAME_FREE;
+         frames[2]->state = DHB_FRAME_FREE;
+         return -1;
+      }
+      /* Same module, these can't fail any more. */
+      dhb_send( port, frames[1], DHB_CMD_MOTORGET );
+      dhb_send( port, frames[2], DHB_CMD_CURRENT );
+      return 0;
    }
 
-   /* Store value. */
-   base_pos = (evt->spi.port-1)<<1;
-   dhb_var_current[base_pos+0] = (inbuf[3]<<8) + inbuf[4];
-   dhb_var_current[base_pos+1] = (inbuf[5]<<8) + inbuf[6];
+   frame = dhb_frame();
+   if (frame == NULL)
+      return -1;
 
-   /* Generate event. */
-   new_evt.custom.data  = evt->spi.port;
-   event_push( &new_evt );
-   event_setCallback( EVENT_TYPE_SPI, NULL ); /* Disable callback. */
-   return 1; /* Destroy event. */
+   /* Targets. */
+   frame->tx[2] = t0>>8;
+   frame->tx[3] = t0;
+   frame->tx[4] = t1>>8;
+   frame->tx[5] = t1;
+
+   return dhb_send( port, frame, DHB_CMD_CYCLE );
 }
-int dhb_current( int port )
+
+
+int dhb_param_set( int port, uint8_t param, int16_t value )
 {
-   char data[] = { 0x01, 0x02, 0x03, 0x04, 0x05 };
-   int ret = dhb_send( port, DHB_CMD_CURRENT, data, sizeof(data) );
-   if (ret == 0)
-      event_setCallback( EVENT_TYPE_SPI, dhb_current_callback );
-   return ret;
+   dhb_frame_t *frame;
+
+   if (!(dhb_infos[port-1].caps & DHB_CAP_PARAM))
+      return -1;
+
+   frame = dhb_frame();
+   if (frame == NULL)
+      return -1;
+   frame->tx[2] = param;
+   frame->tx[3] = value>>8;
+   frame->tx[4] = value;
+   return dhb_send( port, frame, DHB_CMD_PARAMSET );
 }
-void dhb_currentValue( int port, uint16_t *mota, uint16_t *motb )
+
+
+int dhb_param_get( int port, uint8_t param )
 {
-   *mota = dhb_var_current[(port-1)*2+0];
-   *motb = dhb_var_current[(port-1)*2+1];
+   dhb_frame_t *frame;
+
+   if (!(dhb_infos[port-1].caps & DHB_CAP_PARAM))
+      return -1;
+
+   frame = dhb_frame();
+   if (frame == NULL)
+      return -1;
+   frame->tx[2] = param;
+   return dhb_send( port, frame, DHB_CMD_PARAMGET );
+}
+void dhb_param_value( int port, uint8_t *param, int16_t *value )
+{
+   /* Replies are handled from the main loop, no need to lock. */
+   *param = dhb_var_param[port-1];
+   *value = dhb_var_paramValue[port-1];
+}
+
+
+int dhb_param_save( int port )
+{
+   if (!(dhb_infos[port-1].caps & DHB_CAP_PARAM))
+      return -1;
+
+   return dhb_poll( port, DHB_CMD_PARAMSAVE );
 }
 
 
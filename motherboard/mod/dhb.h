@@ -9,21 +9,49 @@
 #include "dhb/hbridge.h"
 
 
+/**
+ * @brief What a Dual H-Bridge module reported when enumerated.
+ */
+typedef struct dhb_info_s {
+   uint8_t version; /**< Firmware version, 0 until enumerated. */
+   uint8_t caps; /**< DHB_CAP_* flags. */
+   uint8_t modes; /**< Bit per supported DHB_MODE_*. */
+   uint8_t spi_max; /**< Fastest SPI clock in 100 kHz. */
+   uint16_t telem_hz; /**< Telemetry rate in Hz, 0 if not reported. */
+} dhb_info_t;
+
+
 /**
  * @brief Attempts to detect and initialize the existance of the Dual H-Bridge module on a port.
  *
+ * Enumeration goes on in the background once the module is up, asking the
+ *  version and then the identity and capabilities if the module has them.
+ *  EVENT_CUST_DHB_READY is generated when done with the port as data, or 0
+ *  if the module never answered. Until then only classic frames are used.
+ *
+ * @note Uses the timer identifiers 0xF0 plus the port.
+ *
  *    @param port Port to detect the Dual H-Bridge module on.
  *    @return 0 if module was detected and initialized properly, -1 if it wasn't.
  */
 int dhb_init( int port );
 
 
+/**
+ * @brief Gets what the module reported when enumerated.
+ *
+ *    @param port Port the module is on.
+ *    @return Information of the module.
+ */
+const dhb_info_t* dhb_info( int port );
+
+
 /**
  * @brief Sets the motor controller mode.
  *
  *    @param port Port the module is on.
  *    @param mode Mode to set.
- *    @return 0 on success.
+ *    @return 0 on success, -1 if the module doesn't support the mode.
  */
 int dhb_mode( int port, char mode );
 
@@ -61,6 +89,61 @@ int dhb_current( int port );
 void dhb_currentValue( int port, uint16_t *mota, uint16_t *motb );
 
 
+/**
+ * @brief Runs a full control cycle in a single frame.
+ *
+ * Sets the targets like dhb_target and gets the feedback and current of the
+ *  same instant, EVENT_CUST_DHB_CYCLE is generated when the reply is in and
+ *  they can be read with dhb_feedbackValue and dhb_currentValue. Modules
+ *  without DHB_CAP_CYCLE get the three separate commands instead, either all
+ *  of them get sent or none, and the event comes with the current reply.
+ *
+ *    @param port Port the dhb board is on.
+ *    @param t0 Target for motor 0.
+ *    @param t1 Target for motor 1.
+ *    @return 0 on success.
+ */
+int dhb_cycle( int port, int16_t t0, int16_t t1 );
+
+
+/**
+ * @brief Sets a controller parameter, takes effect right away.
+ *
+ * Only lasts until the module resets unless saved with dhb_param_save.
+ *
+ *    @param port Port the dhb board is on.
+ *    @param param DHB_PARAM_* to set.
+ *    @param value Value to set, the module ignores it if out of range.
+ *    @return 0 on success, -1 if the module doesn't have DHB_CAP_PARAM.
+ */
+int dhb_param_set( int port, uint8_t param, int16_t value );
+
+
+/**
+ * @brief Gets a controller parameter.
+ *
+ * EVENT_CUST_DHB_PARAM is generated when the reply is in and it can be read
+ *  with dhb_param_value. Pipelined replies come in with the next frame.
+ *
+ *    @param port Port the dhb board is on.
+ *    @param param DHB_PARAM_* to get.
+ *    @return 0 on success, -1 if the module doesn't have DHB_CAP_PARAM.
+ */
+int dhb_param_get( int port, uint8_t param );
+void dhb_param_value( int port, uint8_t *param, int16_t *value );
+
+
+/**
+ * @brief Saves the controller parameters in the module's EEPROM.
+ *
+ * The module boots with them from then on, writing takes it about 100 ms.
+ *
+ *    @param port Port the dhb board is on.
+ *    @return 0 on success, -1 if the module doesn't have DHB_CAP_PARAM.
+ */
+int dhb_param_save( int port );
+
+
 #endif /* _MOD_HBRIDGE_H */
 
 
@@ -0,0 +1,102 @@
+
+
+#include "probe.h"
+
+#include <stdio.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "timer.h"
+
+
+static probe_t *probe_list = NULL; /**< Registered probes. */
+
+
+void probe_init( probe_t *probe, const char *name )
+{
+   probe_t **link;
+
+   probe->name = name;
+   probe_reset( probe );
+
+   /* Register if not already. */
+   for (link = &probe_list; *link != NULL; link = &(*link)->next)
+      if (*link == probe)
+         return;
+   probe->next = NULL;
+   *link       = probe;
+}
+
+
+void probe_reset( probe_t *probe )
+{
+   uint8_t sreg;
+
+   sreg = SREG;
+   cli();
+   probe->min = UINT32_MAX;
+   probe->max = 0;
+   probe->sum = 0;
+   probe->n   = 0;
+   SREG = sreg;
+}
+
+
+void probe_begin( probe_t *probe )
+{
+   probe->start = timer_now_us();
+}
+
+
+void probe_end( probe_t *probe )
+{
+   probe_add( probe, timer_elapsed( probe->start ) );
+}
+
+
+void probe_add( probe_t *probe, uint32_t us )
+{
+   uint8_t sreg;
+
+   sreg = SREG;
+   cli();
+
+   /* Stop counting instead of wrapping the average. */
+   if ((probe->n == UINT16_MAX) || (probe->sum > UINT32_MAX - us)) {
+      SREG = sreg;
+      return;
+   }
+
+   if (us < probe->min)
+      probe->min = us;
+   if (us > probe->max)
+      probe->max = us;
+   probe->sum += us;
+   probe->n++;
+
+   SREG = sreg;
+}
+
+
+uint32_t probe_avg( const probe_t *probe )
+{
+   if (probe->n == 0)
+      return 0;
+   return probe->sum / probe->n;
+}
+
+
+void probe_print (void)
+{
+   probe_t *p;
+
+   for (p=probe_list; p!=NULL; p=p->next) {
+      if (p->n == 0)
+         printf( "%s: none\n", p->name );
+      else
+         printf( "%s: n %u min %lu avg %lu max %lu us\n", p->name, p->n,
+               p->min, probe_avg(p), p->max );
+   }
+}
+
+
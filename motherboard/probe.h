@@ -0,0 +1,105 @@
+
+
+#ifndef _PROBE_H
+#  define _PROBE_H
+
+
+#include <stdint.h>
+
+
+/**
+ * @file
+ *
+ * @brief Latency probes.
+ *
+ * A probe collects minimum, average and maximum durations in microseconds of
+ *  whatever is measured between probe_begin and probe_end. The probe is owned
+ *  by the caller and registered so probe_print can dump all of them.
+ *
+ * @code
+ * static probe_t fsm_probe;
+ * probe_init( &fsm_probe, "fsm" );
+ * ...
+ * probe_begin( &fsm_probe );
+ * fsm( evt );
+ * probe_end( &fsm_probe );
+ * @endcode
+ */
+
+
+/**
+ * @brief A latency probe.
+ */
+typedef struct probe_s {
+   const char *name; /**< Name of the probe. */
+   uint32_t start; /**< Timestamp of the current measurement. */
+   uint32_t min; /**< Shortest measurement. */
+   uint32_t max; /**< Longest measurement. */
+   uint32_t sum; /**< Sum of all measurements. */
+   uint16_t n; /**< Amount of measurements. */
+   struct probe_s *next; /**< Next registered probe. */
+} probe_t;
+
+
+/**
+ * @brief Initializes and registers a probe.
+ *
+ *    @param probe Probe to initialize.
+ *    @param name Name to print the probe with.
+ */
+void probe_init( probe_t *probe, const char *name );
+
+
+/**
+ * @brief Clears the measurements of a probe.
+ *
+ *    @param probe Probe to clear.
+ */
+void probe_reset( probe_t *probe );
+
+
+/**
+ * @brief Starts a measurement.
+ *
+ * Safe to call from interrupts, the measurement can end elsewhere.
+ *
+ *    @param probe Probe to start measuring.
+ */
+void probe_begin( probe_t *probe );
+
+
+/**
+ * @brief Ends a measurement started with probe_begin.
+ *
+ *    @param probe Probe to end measuring.
+ */
+void probe_end( probe_t *probe );
+
+
+/**
+ * @brief Adds a measurement taken elsewhere.
+ *
+ *    @param probe Probe to add the measurement to.
+ *    @param us Duration in microseconds.
+ */
+void probe_add( probe_t *probe, uint32_t us );
+
+
+/**
+ * @brief Gets the average of a probe.
+ *
+ *    @param probe Probe to get the average of.
+ *    @return Average duration in microseconds or 0 if there are none.
+ */
+uint32_t probe_avg( const probe_t *probe );
+
+
+/**
+ * @brief Prints all the registered probes.
+ */
+void probe_print (void);
+
+
+#endif /* _PROBE_H */
+
+
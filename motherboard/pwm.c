@@ -3,6 +3,7 @@
 #include "conf.h"
 
 #include "pwm.h"
+#include "spim.h"
 
 
 /**
@@ -12,7 +13,11 @@ static __inline void pwm_initIO (void)
 {
    /* Set pins as output. */
    PWM0_DDR |= _BV(PWM0A) | _BV(PWM0B);
+#if SPIM_BACKEND == SPIM_BACKEND_USART
+   PWM1_DDR |= _BV(PWM1A); /* PWM1B is the SPI clock. */
+#else /* SPIM_BACKEND == SPIM_BACKEND_USART */
    PWM1_DDR |= _BV(PWM1A) | _BV(PWM1B);
+#endif /* SPIM_BACKEND == SPIM_BACKEND_USART */
    PWM2_DDR |= _BV(PWM2A) | _BV(PWM2B);
 }
 
@@ -1,13 +1,193 @@
 
 
+#include "conf.h"
 
-//#include "spim_sw.c"
+#include "spim.h"
+#include "event.h"
+#include "wdog.h"
+
+#include <stddef.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
 
 
 /*
- * Uses TWI.
+ * Transaction queue.
  */
-#include "spim_hw.c"
+static spim_trans_t * volatile spi_cur = NULL; /**< Transaction on the bus, head of the queue. */
+static spim_trans_t *spi_last          = NULL; /**< Last queued transaction. */
+static uint8_t spi_div[ SPIM_PORTS+1 ] = { /**< Clock divider of each port. */
+   [0 ... SPIM_PORTS] = SPIM_DIV_128
+};
+static uint8_t spi_burst[ SPIM_PORTS+1 ] = { /**< Delay loops between burst bytes of each port. */
+   [0 ... SPIM_PORTS] = SPIM_BURST_OFF
+};
+
+
+/*
+ * Prototypes.
+ */
+static void spim_select( int port );
+static spim_trans_t* spim_done( spim_trans_t *trans );
+/* Implemented by the backend. */
+static void spim_begin( spim_trans_t *trans );
+
+
+/**
+ * @brief Selects the slave on a port.
+ *
+ *    @param port Port to select, 0 to unselect all.
+ */
+static void spim_select( int port )
+{
+   switch (port) {
+      case 1:
+         MOD1_SS_PORT &= ~_BV(MOD1_SS_P);
+         MOD2_SS_PORT |=  _BV(MOD2_SS_P);
+         break;
+
+      case 2:
+         MOD1_SS_PORT |=  _BV(MOD1_SS_P);
+         MOD2_SS_PORT &= ~_BV(MOD2_SS_P);
+         break;
+   
+      default:
+         MOD1_SS_PORT |= _BV(MOD1_SS_P);
+         MOD2_SS_PORT |= _BV(MOD2_SS_P);
+         break;
+   }
+}
+
+
+/**
+ * @brief Finishes the transaction on the bus.
+ *
+ * Called by the backend when the last byte is in, interrupts must be off.
+ *
+ *    @param trans Transaction that finished.
+ *    @return Next transaction to start or NULL if the queue is empty.
+ */
+static spim_trans_t* spim_done( spim_trans_t *trans )
+{
+   event_t evt;
+
+   /* Unselect slaves. */
+   spim_select( 0 );
+
+   /* Dequeue. */
+   spi_cur = trans->next;
+   if (spi_cur == NULL) {
+      spi_last = NULL;
+      wdog_stop( WDOG_TASK_SPI );
+   }
+   else
+      wdog_kick( WDOG_TASK_SPI );
+
+   /* End transmission event. */
+   if ((trans->func == NULL) || !trans->func( trans )) {
+      evt.type      = EVENT_TYPE_SPI;
+      evt.spi.port  = trans->port;
+      evt.spi.len   = trans->len;
+      event_push( &evt );
+   }
+
+   /* Caller owns it again. */
+   trans->queued = 0;
+
+   return spi_cur;
+}
+
+
+int spim_submit( spim_trans_t *trans )
+{
+   uint8_t sreg, start;
 
+   if (trans->len == 0)
+      return -1;
+
+   sreg = SREG;
+   cli();
+
+   /* Still in flight. */
+   if (trans->queued) {
+      SREG = sreg;
+      return -1;
+   }
+   trans->queued = 1;
+   trans->next   = NULL;
+
+   /* Start if the bus is idle or queue. */
+   start = (spi_cur == NULL);
+   if (start) {
+      spi_cur  = trans;
+      spi_last = trans;
+      wdog_start( WDOG_TASK_SPI, WDOG_SPI_TIMEOUT );
+   }
+   else {
+      spi_last->next = trans;
+      spi_last       = trans;
+   }
+
+   SREG = sreg;
+
+   /* Owning the head of the queue, nothing else starts the bus. */
+   if (start)
+      spim_begin( trans );
+   return 0;
+}
+
+
+void spim_setSpeed( int port, uint8_t div )
+{
+   if ((port < 0) || (port > SPIM_PORTS) || (div > SPIM_DIV_128))
+      return;
+   spi_div[ port ] = div;
+}
+
+
+void spim_setBurst( int port, uint8_t gap )
+{
+   uint16_t loops;
+
+   if ((port < 0) || (port > SPIM_PORTS))
+      return;
+
+   /* Delay loop takes 3 cycles. */
+   loops = SPIM_BURST_OFF;
+   if (gap != SPIM_BURST_OFF) {
+      loops = ((uint16_t)gap * (F_CPU/1000000UL) + 2) / 3;
+      if (loops >= SPIM_BURST_OFF)
+         loops = SPIM_BURST_OFF; /* Interrupt leaves a gap anyway. */
+   }
+   spi_burst[ port ] = loops;
+}
+
+
+uint8_t spim_speed( int port )
+{
+   if ((port < 0) || (port > SPIM_PORTS))
+      return SPIM_DIV_128;
+   return spi_div[ port ];
+}
+
+
+int spim_idle (void)
+{
+   return (spi_cur == NULL);
+}
+
+
+/*
+ * Backend, must implement spim_init, spim_exit, spim_begin and call spim_done
+ *  when a transaction finishes. spim_begin runs with interrupts on from
+ *  spim_submit and off when chained from spim_done.
+ */
+#if SPIM_BACKEND == SPIM_BACKEND_SW
+#include "spim_sw.c"
+#elif SPIM_BACKEND == SPIM_BACKEND_USART
+#include "spim_usart.c"
+#else /* SPIM_BACKEND_HW */
+#include "spim_hw.c"
+#endif /* SPIM_BACKEND */
 
 
@@ -4,101 +4,152 @@
 #  define _SPIM_H
 
 
-/**
- * @brief Initializes the SPI as master.
- */
-void spim_init (void);
+#include <stdint.h>
+
+#include "conf.h"
 
 
 /**
- * @brief Exits the SPI subsystem.
+ * @file
+ *
+ * @brief SPI master with a queue of caller owned transactions.
+ *
+ * A transaction describes the port, the amount of bytes to clock and the
+ *  buffers to clock them out of and into. The interrupt works on the buffers
+ *  in place so they must stay valid until the transaction completes. The
+ *  completion interrupt of a transaction starts the next one so the bus
+ *  doesn't wait on the main loop.
+ *
+ * @code
+ * static char tx[4], rx[4];
+ * static spim_trans_t trans = { .tx = tx, .rx = rx };
+ * trans.port = port;
+ * trans.len  = sizeof(tx);
+ * trans.func = done_callback;
+ * if (spim_submit( &trans ))
+ *    return -1; // Still in flight.
+ * @endcode
  */
-void spim_exit (void);
 
 
-/**
- * @brief Starts a transmission.
+/*
+ * Clock dividers of fck, fastest first.
+ */
+#define SPIM_DIV_2      0 /**< fck/2 */
+#define SPIM_DIV_4      1 /**< fck/4 */
+#define SPIM_DIV_8      2 /**< fck/8 */
+#define SPIM_DIV_16     3 /**< fck/16 */
+#define SPIM_DIV_32     4 /**< fck/32 */
+#define SPIM_DIV_64     5 /**< fck/64 */
+#define SPIM_DIV_128    6 /**< fck/128, default. */
+#define SPIM_PORTS      2 /**< Ports with their own clock. */
+#define SPIM_BURST_OFF  0xFF /**< Port may not be burst, see spim_setBurst. */
+
+
+/*
+ * Backends.
  */
-void spim_transmitStart (void);
+#define SPIM_BACKEND_HW       0 /**< SPI peripheral. */
+#define SPIM_BACKEND_SW       1 /**< Bit banged. */
+#define SPIM_BACKEND_USART    2 /**< USART1 in master SPI mode. */
+
+
+struct spim_trans_s;
 
 
 /**
- * @brief Adds a char to the output buffer.
+ * @brief Transaction completion callback.
+ *
+ * Run from the completion interrupt so it must be short and may not submit
+ *  transactions.
  *
- *    @param ch Char to add.
+ *    @param trans Transaction that completed.
+ *    @return Non-zero to not push the SPI event.
  */
-void spim_transmitChar( char ch );
+typedef int (*spim_callback_t)( struct spim_trans_s *trans );
 
 
 /**
- * @brief Adds a string to the output buffer.
- *
- *    @param data Data to add.
- *    @param len Length of the data to add.
+ * @brief A SPI transaction, owned by the caller.
  */
-void spim_transmitString( const char *data, int len );
+typedef struct spim_trans_s {
+   uint8_t port; /**< Port to transmit on. */
+   uint8_t len; /**< Bytes to transfer. */
+   const char *tx; /**< Outgoing data, len bytes. */
+   char *rx; /**< Incoming data, len bytes or NULL to discard. */
+   spim_callback_t func; /**< Completion callback or NULL. */
+   volatile uint8_t queued; /**< Set while queued or on the bus, don't touch. */
+   struct spim_trans_s *next; /**< Next queued transaction, don't touch. */
+} spim_trans_t;
 
 
 /**
- * @brief Starts the spi transmission on the port.
- *
- *    @param port Port to start transmitting data on.
+ * @brief Initializes the SPI as master.
  */
-void spim_transmitEnd( int port );
+void spim_init (void);
 
 
 /**
- * @brief Begins a transmission.
- *
- *    @param data Data to transmit.
- *    @param len Length of the data to transmit.
+ * @brief Exits the SPI subsystem.
  */
-void spim_transmit( int port, const char *data, int len );
+void spim_exit (void);
 
 
 /**
- * @brief Gets the data read during the transmission.
+ * @brief Queues a transaction.
+ *
+ * A SPI event with the port and length is pushed when the transaction
+ *  completes unless the callback says otherwise. The transaction and its
+ *  buffers may not be modified until then.
  *
- *    @param data Data to read (should be allocated already).
- *    @param max Length of the buffer being filled.
- *    @return Amount read.
+ *    @param trans Transaction to queue.
+ *    @return 0 on success, -1 if it is empty or already queued.
  */
-int spim_read( char *data, int max );
+int spim_submit( spim_trans_t *trans );
 
 
 /**
- * @brief Reads a single character.
+ * @brief Sets the clock divider of a port.
  *
- *    @return Character read (or 0x00 if nothing left).
+ * Applied when the next transaction on the port starts.
+ *
+ *    @param port Port to set the clock of.
+ *    @param div Clock divider, one of SPIM_DIV_*.
  */
-char spim_readChar (void);
+void spim_setSpeed( int port, uint8_t div );
 
 
 /**
- * @brief Checks to see if the SPI module is idle.
+ * @brief Lets the backend clock short frames on a port back to back.
  *
- *    @return 1 if idle.
+ * Only the SPI peripheral backend bursts, and only when started with
+ *  interrupts enabled. Ports start with SPIM_BURST_OFF since the gap the
+ *  slave needs isn't known until it's asked.
+ *
+ *    @param port Port to set the burst of.
+ *    @param gap Microseconds the slave needs between bytes, SPIM_BURST_OFF to
+ *               never burst.
  */
-int spim_idle (void);
+void spim_setBurst( int port, uint8_t gap );
 
 
 /**
- * @brief Gets the incoming buffer.
+ * @brief Gets the clock divider of a port.
  *
- *    @param[out] len Length of incoming buffer.
- *    @return The incoming buffer.
+ *    @param port Port to get the clock of.
+ *    @return Clock divider, one of SPIM_DIV_*.
  */
-char* spim_inbuf( int *len );
+uint8_t spim_speed( int port );
 
 
 /**
- * @brief Gets the outgoing buffer.
+ * @brief Checks to see if the SPI module is idle.
  *
- *    @param[out] len Length of outgoing buffer.
- *    @return The outgoing buffer.
+ *    @return 1 if there are no transactions queued or running.
  */
-char* spim_outbuf( int *len );
+int spim_idle (void);
 
 
 #endif /* _SPIM_H */
 
+
@@ -1,22 +1,31 @@
-
-
 #include "conf.h"
 
 #include "spim.h"
 #include "event.h"
 
 #include <avr/interrupt.h>
+#include <util/delay_basic.h>
 
 
 /*
  * Buffers.
  */
-static char spi_outBuf[ SPI_BUFFER_LEN ]; /**< Outgoing SPI master buffer. */
-static char spi_inBuf[ SPI_BUFFER_LEN ]; /**< Incoming SPI master buffer. */
-static volatile int  spi_len    = 0; /**< Current write SPI master buffer. */
-static volatile int  spi_inPos  = 0; /**< Incoming SPI master buffer position. */
-static volatile int  spi_outPos = 0; /**< Outgoing SPI master buffer position. */
-static volatile int  spi_port   = 0; /**< Currently selected SPI port. */
+static volatile uint8_t spi_pos = 0; /**< Position within the current transaction. */
+
+
+/*
+ * Clock.
+ */
+#define SPI_2X    0x80 /**< Set SPI2X in SPSR. */
+static const uint8_t spi_divBits[] = { /**< SPR bits of each divider. */
+   [SPIM_DIV_2]   = SPI_2X,
+   [SPIM_DIV_4]   = 0,
+   [SPIM_DIV_8]   = SPI_2X | _BV(SPR0),
+   [SPIM_DIV_16]  = _BV(SPR0),
+   [SPIM_DIV_32]  = SPI_2X | _BV(SPR1),
+   [SPIM_DIV_64]  = _BV(SPR1),
+   [SPIM_DIV_128] = _BV(SPR1) | _BV(SPR0)
+};
 
 
 /**
@@ -70,142 +79,89 @@ void spim_exit (void)
  */
 ISR( SPI_STC_vect )
 {
-   event_t evt;
+   spim_trans_t *trans;
 
    /* Get last character. */
-   spi_inBuf[ spi_outPos-1 ] = SPDR;
-
-   /* Finished, so we break. */
-   if (spi_outPos >= spi_len) {
-      /* Unselect slaves. */
-      MOD1_SS_PORT |=  _BV(MOD1_SS_P);
-      MOD2_SS_PORT |=  _BV(MOD2_SS_P);
-      /* Disable SPI. */
-      SPCR         &= ~_BV(SPE);
-
-      /* End transmission event. */
-      evt.type      = EVENT_TYPE_SPI;
-      evt.spi.port  = spi_port;
-      event_push( &evt );
-   }
+   trans = spi_cur;
+   if (trans->rx != NULL)
+      trans->rx[ spi_pos-1 ] = SPDR;
 
-   /* Get ready for next write. */
-   SPDR = spi_outBuf[ spi_outPos++ ];
-}
-
-
-void spim_transmitStart (void)
-{
-   /* Clear buffers. */
-   spi_outPos  = 1;
-   spi_inPos   = 0;
-   spi_len     = 0;
-}
-
-
-void spim_transmitChar( char ch )
-{
-   if (spi_len >= SPI_BUFFER_LEN)
+   /* Write next character. */
+   if (spi_pos < trans->len) {
+      SPDR = trans->tx[ spi_pos++ ];
       return;
-   spi_outBuf[ spi_len++ ] = ch;
-}
-
-
-void spim_transmitString( const char *data, int len )
-{
-   int i, n;
-   n = len;
-   if (spi_len + n > SPI_BUFFER_LEN)
-      n = SPI_BUFFER_LEN - spi_len;
-   for (i=0; i<n; i++) {
-      spi_outBuf[ spi_len++ ] = data[i];
-   }
-}
-
-
-void spim_transmitEnd( int port )
-{
-   /* Set the port. */
-   spi_port = port;
-   switch (spi_port) {
-      case 1:
-         MOD1_SS_PORT &= ~_BV(MOD1_SS_P);
-         MOD2_SS_PORT |=  _BV(MOD2_SS_P);
-         break;
-
-      case 2:
-         MOD1_SS_PORT |=  _BV(MOD1_SS_P);
-         MOD2_SS_PORT &= ~_BV(MOD2_SS_P);
-         break;
-   
-      default:
-         MOD1_SS_PORT |= _BV(MOD1_SS_P);
-         MOD2_SS_PORT |= _BV(MOD2_SS_P);
-         break;
    }
 
-   /* Enable SPI. */
-   SPCR |= _BV(SPE);
-
-   /* Write first byte. */
-   SPDR  = spi_outBuf[0];
-}
-
-
-/**
- * @brief Transmits data.
- */
-void spim_transmit( int port, const char *data, int len )
-{
-   spim_transmitStart();
-   spim_transmitString( data, len );
-   spim_transmitEnd( port );
+   /* Finished, start the next one right away. */
+   trans = spim_done( trans );
+   if (trans != NULL)
+      spim_begin( trans );
+   else
+      SPCR &= ~_BV(SPE); /* Disable SPI. */
 }
 
 
 /**
- * @brief Reads data.
+ * @brief Starts a transaction on the bus.
+ *
+ * Short frames on a fast clock are clocked polled with the SPI interrupt off
+ *  except for the last byte, so they take a single interrupt to complete.
+ *  Bytes are spaced by the gap set with spim_setBurst so the slave keeps up.
+ *  Only done with interrupts enabled, chained from the interrupt they would
+ *  stay off for the whole burst.
+ *
+ *    @param trans Transaction to start.
  */
-int spim_read( char *data, int max )
+static void spim_begin( spim_trans_t *trans )
 {
-   int i;
+   uint8_t bits;
+#if SPIM_BURST_LEN > 0
+   uint8_t i, gap;
+   uint16_t cycles;
+   char c;
+#endif /* SPIM_BURST_LEN > 0 */
 
-   i = 0;
-   while ((i < max) && (spi_inPos < spi_len))
-      data[ i++ ] = spi_inBuf[ spi_inPos++ ];
-
-   return i;
-}
-
-
-/**
- * @brief Reads a character.
- */
-char spim_readChar (void)
-{
-   return spi_inBuf[ spi_inPos++ ];
-}
+   /* Set the port. */
+   spim_select( trans->port );
 
+   /* Set the clock of the port. */
+   bits = spi_divBits[ spim_speed( trans->port ) ];
+   SPCR = (SPCR & ~(_BV(SPR1) | _BV(SPR0))) | (bits & (_BV(SPR1) | _BV(SPR0)));
+   SPSR = (bits & SPI_2X) ? _BV(SPI2X) : 0;
 
-/**
- * @brief SPI module is idle.
- */
-int spim_idle (void)
-{
-   return (!(SPCR & _BV(SPE)));
-}
+   /* Enable SPI. */
+   SPCR |= _BV(SPE);
 
+#if SPIM_BURST_LEN > 0
+   /* Burst all but the last byte if it polls for little enough. */
+   gap = spi_burst[ trans->port ];
+   if ((trans->len <= SPIM_BURST_LEN) && (gap != SPIM_BURST_OFF) &&
+         (SREG & _BV(SREG_I))) {
+      cycles = (trans->len-1) * ((16 << spim_speed( trans->port )) + 3*gap);
+      if (cycles <= SPIM_BURST_US * (F_CPU/1000000UL)) {
+         SPCR &= ~_BV(SPIE);
+         for (i=0; i<trans->len-1; i++) {
+            SPDR = trans->tx[i];
+            while (!(SPSR & _BV(SPIF)));
+            c    = SPDR; /* Clears SPIF. */
+            if (trans->rx != NULL)
+               trans->rx[i] = c;
+            if (gap)
+               _delay_loop_1( gap );
+         }
+         SPCR |= _BV(SPIE);
+
+         /* Last byte completes through the interrupt. */
+         spi_pos = trans->len;
+         SPDR    = trans->tx[ trans->len-1 ];
+         return;
+      }
+   }
+#endif /* SPIM_BURST_LEN > 0 */
 
-char* spim_inbuf( int *len )
-{
-   *len = sizeof( spi_inBuf );
-   return spi_inBuf;
+   /* Write first byte. */
+   spi_pos = 1;
+   SPDR    = trans->tx[0];
 }
 
 
-char* spim_outbuf( int *len )
-{
-   *len = sizeof( spi_outBuf );
-   return spi_outBuf;
-}
-
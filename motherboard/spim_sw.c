@@ -1,69 +1,48 @@
-
-
 #include "conf.h"
 
 #include "spim.h"
 #include "event.h"
 
 #include <avr/interrupt.h>
+#include <util/delay_basic.h>
+
+
+/*
+ * Clock phase and polarity.
+ */
+#if SPIM_SW_MODE & 0x02 /* CPOL */
+#define SPI_SCK_IDLE()     SWSPI_PORT |=  _BV(SWSPI_SCK)
+#define SPI_SCK_ACTIVE()   SWSPI_PORT &= ~_BV(SWSPI_SCK)
+#else /* CPOL */
+#define SPI_SCK_IDLE()     SWSPI_PORT &= ~_BV(SWSPI_SCK)
+#define SPI_SCK_ACTIVE()   SWSPI_PORT |=  _BV(SWSPI_SCK)
+#endif /* CPOL */
+#define SPI_CPHA           (SPIM_SW_MODE & 0x01)
+#define SPI_OVERHEAD       8 /**< Cycles per half bit spent outside the delay. */
 
 
 /*
  * Buffers.
  */
-static int spi_cycle = 0;
-static int spi_pos   = 0;
-static char spi_en   = 0;
-static char spi_spdr = 0x00;
-static char spi_outBuf[ SPI_BUFFER_LEN ]; /**< Outgoing SPI master buffer. */
-static char spi_inBuf[ SPI_BUFFER_LEN ]; /**< Incoming SPI master buffer. */
-static volatile int  spi_len    = 0; /**< Current write SPI master buffer. */
-static volatile int  spi_inPos  = 0; /**< Incoming SPI master buffer position. */
-static volatile int  spi_outPos = 0; /**< Outgoing SPI master buffer position. */
-static volatile int  spi_port   = 0; /**< Currently selected SPI port. */
+static volatile uint8_t spi_pos = 0; /**< Position within the current transaction. */
+static uint8_t spi_half         = 0; /**< Delay loops per half bit. */
+
+
+/*
+ * Prototypes.
+ */
+static uint8_t spim_byte( uint8_t out );
 
 
 /**
- * @brief Initializes the SPI perpipheral as master.
+ * @brief Initializes the bit banged SPI master.
  */
 void spim_init (void)
 {
-   /* Enable Timer 1. */
-   PRR   &= ~_BV(PRTIM2);
-
-   /* CTC Mode
-    *
-    *               f_clk
-    * f_ctc = -----------------
-    *         2 * N * (1 + TOP)
-    *
-    *    f_clk
-    * ------------- - 1 = TOP
-    * f_ctc * 2 * N
-    *
-    *  f_clk   = 20e6
-    *  f_ctc   = 8e3 (1 kHz SPI)
-    *  N       = 8
-    *  TOP     = 155.25 ~= 155
-    *
-    *  Since we generate 2 interrupts each cycle, we'll need it to be at twice.
-    *
-    *  TOP*2 = 76
-    */
-   TCCR2A = _BV(WGM21); /* CTC mode. */
-   TCCR2B = _BV(CS21) | _BV(CS20); /* 8 prescaler. */
-   TCNT2  = 0; /* Clear timer. */
-   OCR2A  = 155;
-   OCR2B  = 0;
-   TIMSK2 &= ~_BV(OCIE2A); /* Disable interrupt. */
-
    /* Configure pins. */
-   SPI_DDR &= ~_BV(SPI_MISO); /* MISO as input. */
-   SPI_DDR |= _BV(SPI_MOSI) | _BV(SPI_SCK) | _BV(SPI_SS); /* MOSI and SCK as output. */
-
-   /* Defaults. */
-   SPI_PORT |= _BV(SPI_MOSI);
-   SPI_PORT &= ~_BV(SPI_SCK);
+   SWSPI_DDR &= ~_BV(SWSPI_MISO); /* MISO as input. */
+   SWSPI_DDR |= _BV(SWSPI_MOSI) | _BV(SWSPI_SCK); /* MOSI and SCK as output. */
+   SPI_SCK_IDLE();
 
    /* Initialize slave SS pins. */
    MOD1_SS_DDR |= _BV(MOD1_SS_P);
@@ -73,8 +52,24 @@ void spim_init (void)
    MOD1_SS_PORT |=  _BV(MOD1_SS_P);
    MOD2_SS_PORT |=  _BV(MOD2_SS_P);
 
-   /* Start out stopped. */
-   spi_en = 0;
+#if SPIM_SW_PACED
+   /* Enable Timer 2. */
+   PRR   &= ~_BV(PRTIM2);
+
+   /* CTC Mode, paces the bytes.
+    *
+    *  f_clk   = 20e6
+    *  N       = 8
+    *  count   = 0.4 us
+    *  TOP     = gap / 0.4 us - 1
+    */
+   TCCR2A = _BV(WGM21); /* CTC mode. */
+   TCCR2B = _BV(CS21); /* 8 prescaler. */
+   TCNT2  = 0; /* Clear timer. */
+   OCR2A  = SPIM_SW_GAP_US*5/2 - 1;
+   OCR2B  = 0;
+   TIMSK2 &= ~_BV(OCIE2A); /* Disable interrupt. */
+#endif /* SPIM_SW_PACED */
 }
 
 
@@ -83,207 +78,150 @@ void spim_init (void)
  */
 void spim_exit (void)
 {
-   PRR  |= _BV(PRTIM2);
+#if SPIM_SW_PACED
+   TIMSK2 &= ~_BV(OCIE2A); /* Disable interrupt. */
+   PRR    |= _BV(PRTIM2);
+#endif /* SPIM_SW_PACED */
 }
 
 
 /**
- * @brief Signal handler indicating transfer complete.
+ * @brief Clocks a byte in and out.
+ *
+ * MSB first, each half bit is stretched to roughly match the clock divider of
+ *  the port.
  *
- * M 80 CM X1 X2 X3 X4 X5... CRC
- * S 00 80 CM Y1 Y2 Y3 Y4... CRC
+ * Mode 0 and 2 (CPHA=0):
+ * MOSI  X=======X=======
+ * SCK   ____----____----   (inverted for CPOL=1)
+ * MISO      ^       ^      sampled on the leading edge
  *
+ * Mode 1 and 3 (CPHA=1):
+ * MOSI  X=======X=======
+ * SCK   ----____----____   (inverted for CPOL=1)
+ * MISO      ^       ^      sampled on the trailing edge
  *
- * FRA      X   X   X   X
- * CLK  ____--__--__--__--__
- * SAM       X   X   X   X
- * BYT      0000111122223333
- * CYC      0123012301230123
+ *    @param out Byte to send.
+ *    @return Byte received.
  */
-ISR( TIMER2_COMPA_vect )
+static uint8_t spim_byte( uint8_t out )
 {
-   event_t evt;
+   uint8_t i, in;
 
-   /* Increment cycle. */
-   spi_cycle = (spi_cycle+1)%4;
+   in = 0;
+   for (i=0; i<8; i++) {
+#if SPI_CPHA
+      SPI_SCK_ACTIVE();
+#endif /* SPI_CPHA */
 
-   /* In this cycle stage. we basically write the byte. */
-   if (spi_cycle == 0) {
       /* Write bit. */
-      if (spi_spdr & 0x80)
-         SPI_PORT |= _BV(SPI_MOSI);
+      if (out & 0x80)
+         SWSPI_PORT |= _BV(SWSPI_MOSI);
       else
-         SPI_PORT &= ~_BV(SPI_MOSI);
-
-      /* Set clock up. */
-      SPI_PORT |= _BV(SPI_SCK);
-      spi_clk = 1;
-
-      spi_pos++;
-   }
-   /* Sample. */
-   else if (spi_cycle == 1) {
-      /* Read bit. */
-      spi_spdr <<= 1;
-      if (SPI_PIN & _BV(SPI_MISO))
-         spi_spdr |= 0x01;
+         SWSPI_PORT &= ~_BV(SWSPI_MOSI);
+      out <<= 1;
+      if (spi_half)
+         _delay_loop_1( spi_half );
+
+#if SPI_CPHA
+      SPI_SCK_IDLE();
+#else /* SPI_CPHA */
+      SPI_SCK_ACTIVE();
+#endif /* SPI_CPHA */
+
+      /* Sample. */
+      in <<= 1;
+      if (SWSPI_PIN & _BV(SWSPI_MISO))
+         in |= 0x01;
+      if (spi_half)
+         _delay_loop_1( spi_half );
+
+#if !SPI_CPHA
+      SPI_SCK_IDLE();
+#endif /* !SPI_CPHA */
    }
-   /* Down phase. */
-   else if (spi_cycle == 2) {
-      SPI_PORT &= ~_BV(SPI_SCK);
-      spi_clk = 0;
-   }
-   /* Skip phase. */
-   else if (spi_cycle == 3) {
-      if (spi_pos >= 8) {
-         spi_pos = 0;
-
-         /* Get last character. */
-         spi_inBuf[ spi_outPos-1 ] = spi_spdr;
-
-         /* Finished, so we break. */
-         if (spi_outPos >= spi_len) {
-            /* Unselect slaves. */
-            MOD1_SS_PORT |=  _BV(MOD1_SS_P);
-            MOD2_SS_PORT |=  _BV(MOD2_SS_P);
-
-            /* End transmission event. */
-            evt.type      = EVENT_TYPE_SPI;
-            evt.spi.port  = spi_port;
-            event_push( &evt );
-
-            /* Disable SPI. */
-            TIMSK2 &= ~_BV(OCIE2A); /* Disable interrupt. */
-            spi_en = 0;
-         }
-
-         /* Get ready for next write. */
-         spi_spdr = spi_outBuf[ spi_outPos++ ];
-      }
-   }
-}
-
 
-void spim_transmitStart (void)
-{
-   /* Clear buffers. */
-   spi_outPos  = 1;
-   spi_inPos   = 0;
-   spi_len     = 0;
-}
-
-
-void spim_transmitChar( char ch )
-{
-   if (spi_len >= SPI_BUFFER_LEN)
-      return;
-   spi_outBuf[ spi_len++ ] = ch;
-}
-
-
-void spim_transmitString( const char *data, int len )
-{
-   int i, n;
-   n = len;
-   if (spi_len + n > SPI_BUFFER_LEN)
-      n = SPI_BUFFER_LEN - spi_len;
-   for (i=0; i<n; i++) {
-      spi_outBuf[ spi_len++ ] = data[i];
-   }
-}
-
-
-void spim_transmitEnd( int port )
-{
-   /* Set the port. */
-   spi_port = port;
-   switch (spi_port) {
-      case 1:
-         MOD1_SS_PORT &= ~_BV(MOD1_SS_P);
-         MOD2_SS_PORT |=  _BV(MOD2_SS_P);
-         break;
-
-      case 2:
-         MOD1_SS_PORT |=  _BV(MOD1_SS_P);
-         MOD2_SS_PORT &= ~_BV(MOD2_SS_P);
-         break;
-   
-      default:
-         MOD1_SS_PORT |= _BV(MOD1_SS_P);
-         MOD2_SS_PORT |= _BV(MOD2_SS_P);
-         break;
-   }
-
-   /* Enable SPI. */
-   spi_en = 1;
-
-   /* Write first byte. */
-   spi_spdr  = spi_outBuf[0];
-
-   /* Writing first bit. */
-   spi_pos = 0;
-   spi_clk = 0;
-
-   /* Start timer. */
-   TCNT2  = 0; /* Clear timer. */
-   TIMSK2 = _BV(OCIE2A); /* Enable interrupt. */
+   return in;
 }
 
 
+#if SPIM_SW_PACED
 /**
- * @brief Transmits data.
+ * @brief Clocks the next byte, paced by the timer.
  */
-void spim_transmit( int port, const char *data, int len )
-{
-   spim_transmitStart();
-   spim_transmitString( data, len );
-   spim_transmitEnd( port );
-}
-
-
-/**
- * @brief Reads data.
- */
-int spim_read( char *data, int max )
+ISR( TIMER2_COMPA_vect )
 {
-   int i;
-
-   i = 0;
-   while ((i < max) && (spi_inPos < spi_len))
-      data[ i++ ] = spi_inBuf[ spi_inPos++ ];
-
-   return i;
-}
-
+   uint8_t c;
+   spim_trans_t *trans;
+
+   /* Clock the byte. */
+   trans = spi_cur;
+   c     = spim_byte( trans->tx[ spi_pos ] );
+   if (trans->rx != NULL)
+      trans->rx[ spi_pos ] = c;
+   if (++spi_pos < trans->len) {
+      /* Gap counts from the end of the byte, it takes longer than the gap
+       *  on slow ports. */
+      TCNT2 = 0;
+      TIFR2 = _BV(OCF2A);
+      return;
+   }
 
-/**
- * @brief Reads a character.
- */
-char spim_readChar (void)
-{
-   return spi_inBuf[ spi_inPos++ ];
+   /* Finished, start the next one right away. */
+   trans = spim_done( trans );
+   if (trans != NULL)
+      spim_begin( trans );
+   else
+      TIMSK2 &= ~_BV(OCIE2A); /* Disable interrupt. */
 }
+#endif /* SPIM_SW_PACED */
 
 
 /**
- * @brief SPI module is idle.
+ * @brief Starts a transaction on the bus.
+ *
+ * When paced the bytes are clocked from the timer interrupt, otherwise the
+ *  whole queue is clocked before returning with interrupts as the caller has
+ *  them, only finishing each transaction locks them.
+ *
+ *    @param trans Transaction to start.
  */
-int spim_idle (void)
-{
-   return !spi_en;
-}
-
-
-char* spim_inbuf( int *len )
+static void spim_begin( spim_trans_t *trans )
 {
-   *len = sizeof( spi_inBuf );
-   return spi_inBuf;
+   uint16_t half;
+#if !SPIM_SW_PACED
+   uint8_t c, sreg;
+#endif /* !SPIM_SW_PACED */
+
+   do {
+      /* Set the port. */
+      spim_select( trans->port );
+
+      /* Half bit of fck/(2<<div) is 1<<div cycles, the loop takes 3. Round
+       *  up so the clock is never faster than the port allows. */
+      half     = 1 << spim_speed( trans->port );
+      spi_half = (half > SPI_OVERHEAD) ? (half - SPI_OVERHEAD + 2) / 3 : 0;
+      spi_pos  = 0;
+
+#if SPIM_SW_PACED
+      /* Start timer. */
+      TCNT2  = 0; /* Clear timer. */
+      TIFR2  = _BV(OCF2A); /* Clear pending. */
+      TIMSK2 = _BV(OCIE2A); /* Enable interrupt. */
+      return;
+#else /* SPIM_SW_PACED */
+      /* Clock the frame. */
+      for (spi_pos=0; spi_pos<trans->len; spi_pos++) {
+         c = spim_byte( trans->tx[ spi_pos ] );
+         if (trans->rx != NULL)
+            trans->rx[ spi_pos ] = c;
+      }
+      sreg  = SREG;
+      cli();
+      trans = spim_done( trans );
+      SREG  = sreg;
+#endif /* SPIM_SW_PACED */
+   } while (trans != NULL);
 }
 
 
-char* spim_outbuf( int *len )
-{
-   *len = sizeof( spi_outBuf );
-   return spi_outBuf;
-}
-
@@ -0,0 +1,121 @@
+#include "conf.h"
+
+#include "spim.h"
+#include "event.h"
+
+#include <avr/interrupt.h>
+
+
+/*
+ * Buffers.
+ */
+static volatile uint8_t spi_inPos  = 0; /**< Bytes received of the current transaction. */
+static volatile uint8_t spi_outPos = 0; /**< Bytes written of the current transaction. */
+
+
+/**
+ * @brief Initializes USART1 as SPI master.
+ *
+ * The transmit register is double buffered so bytes go out back to back as
+ *  long as the receive interrupt writes the next one within a byte time.
+ */
+void spim_init (void)
+{
+   /* Power up USART1. */
+   PRR &= ~_BV(PRUSART1);
+
+   /* Configure pins. */
+   MSPI_DDR &= ~_BV(MSPI_MISO); /* MISO as input. */
+   MSPI_DDR |= _BV(MSPI_MOSI) | _BV(MSPI_SCK); /* MOSI and SCK as output. */
+
+   /* Initialize slave SS pins. */
+   MOD1_SS_DDR |= _BV(MOD1_SS_P);
+   MOD2_SS_DDR |= _BV(MOD2_SS_P);
+
+   /* Unselect slaves. */
+   MOD1_SS_PORT |=  _BV(MOD1_SS_P);
+   MOD2_SS_PORT |=  _BV(MOD2_SS_P);
+
+   /* Configure the USART, baud rate must be set after enabling. */
+   UBRR1    = 0;
+   UCSR1C   = _BV(UMSEL11) | _BV(UMSEL10); /* Master SPI mode 0, MSB first. */
+   UCSR1B   = _BV(RXCIE1) | /* Enable receive interrupt. */
+              _BV(RXEN1) | _BV(TXEN1); /* Enable receiver and transmitter. */
+   UBRR1    = 63; /* fck/128 */
+}
+
+
+/**
+ * @brief Exits the SPI subsystem.
+ */
+void spim_exit (void)
+{
+   /* Disable peripheral. */
+   UCSR1B   = 0;
+
+   /* Power down USART1. */
+   PRR     |= _BV(PRUSART1);
+}
+
+
+/**
+ * @brief Signal handler indicating a byte was received.
+ *
+ * A byte is received for each one sent so the transmit side is kept one
+ *  byte ahead.
+ */
+ISR( USART1_RX_vect )
+{
+   char c;
+   spim_trans_t *trans;
+
+   /* Get last character. */
+   trans = spi_cur;
+   c     = UDR1;
+   if (trans->rx != NULL)
+      trans->rx[ spi_inPos ] = c;
+   spi_inPos++;
+
+   /* Keep the transmit buffer full. */
+   if (spi_outPos < trans->len)
+      UDR1 = trans->tx[ spi_outPos++ ];
+   if (spi_inPos < trans->len)
+      return;
+
+   /* Finished, start the next one right away. */
+   trans = spim_done( trans );
+   if (trans != NULL)
+      spim_begin( trans );
+}
+
+
+/**
+ * @brief Starts a transaction on the bus.
+ *
+ *    @param trans Transaction to start.
+ */
+static void spim_begin( spim_trans_t *trans )
+{
+   uint8_t sreg;
+
+   /* Set the port. */
+   spim_select( trans->port );
+
+   /* Set the clock of the port, fck/(2*(UBRR+1)). */
+   UBRR1      = (1 << spim_speed( trans->port )) - 1;
+
+   /* Fill both levels of the transmit buffer, the receive interrupt of the
+    *  first byte must not refill it in between. */
+   sreg       = SREG;
+   cli();
+   spi_inPos  = 0;
+   spi_outPos = 0;
+   UDR1       = trans->tx[ spi_outPos++ ];
+   if (spi_outPos < trans->len) {
+      while (!(UCSR1A & _BV(UDRE1)));
+      UDR1    = trans->tx[ spi_outPos++ ];
+   }
+   SREG       = sreg;
+}
+
+
@@ -0,0 +1,22 @@
+
+
+#ifndef _HOST_AVR_INTERRUPT_H
+#  define _HOST_AVR_INTERRUPT_H
+
+
+#include <avr/io.h>
+
+
+/*
+ * Interrupts only exist as the I bit, vectors become plain functions the
+ *  tests call to fake an interrupt. Disabling them is counted.
+ */
+extern unsigned long host_cli; /**< Times interrupts were disabled. */
+#define cli()        (host_cli++, SREG &= ~_BV(SREG_I))
+#define sei()        (SREG |= _BV(SREG_I))
+#define ISR( vect )  void vect (void); void vect (void)
+
+
+#endif /* _HOST_AVR_INTERRUPT_H */
+
+
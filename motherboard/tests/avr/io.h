@@ -0,0 +1,124 @@
+
+
+#ifndef _HOST_AVR_IO_H
+#  define _HOST_AVR_IO_H
+
+
+#include <stdint.h>
+
+
+/**
+ * @file
+ *
+ * @brief Registers of the ATmega644P the host tests need, plain variables
+ *  defined in host.c that the tests drive by hand.
+ */
+
+
+#define _BV(bit)     (1 << (bit))
+
+
+/* Memory. */
+#define RAMEND       0x10FF
+
+
+/* Status. */
+extern volatile uint8_t SREG;
+#define SREG_I       7
+
+
+/* Power reduction. */
+extern volatile uint8_t PRR;
+#define PRTIM2       6
+#define PRTIM0       5
+#define PRUSART1     4
+#define PRSPI        2
+
+
+/* Port B. */
+extern volatile uint8_t PORTB;
+extern volatile uint8_t DDRB;
+extern volatile uint8_t PINB;
+#define PB0          0
+#define PB1          1
+#define PB2          2
+#define PB3          3
+#define PB4          4
+#define PB5          5
+#define PB6          6
+#define PB7          7
+
+
+/* Port D. */
+extern volatile uint8_t PORTD;
+extern volatile uint8_t DDRD;
+extern volatile uint8_t PIND;
+#define PD2          2
+#define PD3          3
+#define PD4          4
+#define PD5          5
+#define PD6          6
+#define PD7          7
+
+
+/* TIMER0. */
+extern volatile uint8_t TCCR0A;
+extern volatile uint8_t TCCR0B;
+extern volatile uint8_t TCNT0;
+extern volatile uint8_t OCR0A;
+extern volatile uint8_t OCR0B;
+extern volatile uint8_t TIMSK0;
+extern volatile uint8_t TIFR0;
+#define WGM01        1
+#define CS00         0
+#define CS02         2
+#define OCIE0A       1
+#define TOV0         0
+#define OCF0A        1
+#define OCF0B        2
+
+
+/* TIMER2. */
+extern volatile uint8_t TCCR2A;
+extern volatile uint8_t TCCR2B;
+extern volatile uint8_t TCNT2;
+extern volatile uint8_t OCR2A;
+extern volatile uint8_t OCR2B;
+extern volatile uint8_t TIMSK2;
+extern volatile uint8_t TIFR2;
+#define WGM21        1
+#define CS21         1
+#define OCIE2A       1
+#define OCF2A        1
+
+
+/* SPI. */
+extern volatile uint8_t SPCR;
+extern volatile uint8_t SPSR;
+extern volatile uint8_t SPDR;
+#define SPIE         7
+#define SPE          6
+#define MSTR         4
+#define SPR1         1
+#define SPR0         0
+#define SPIF         7
+#define SPI2X        0
+
+
+/* USART1. */
+extern volatile uint16_t UBRR1;
+extern volatile uint8_t UCSR1A;
+extern volatile uint8_t UCSR1B;
+extern volatile uint8_t UCSR1C;
+extern volatile uint8_t UDR1;
+#define UDRE1        5
+#define RXCIE1       7
+#define RXEN1        4
+#define TXEN1        3
+#define UMSEL11      7
+#define UMSEL10      6
+
+
+#endif /* _HOST_AVR_IO_H */
+
+
@@ -0,0 +1,21 @@
+
+
+#ifndef _HOST_AVR_PGMSPACE_H
+#  define _HOST_AVR_PGMSPACE_H
+
+
+#include <string.h>
+
+
+/*
+ * Flash is ordinary memory on the host.
+ */
+#define PROGMEM
+#define pgm_read_byte( p )          (*(const uint8_t*)(p))
+#define pgm_read_word( p )          (*(p)) /* Pointers are wider than a word here. */
+#define memcpy_P( dst, src, n )     memcpy( (dst), (src), (n) )
+
+
+#endif /* _HOST_AVR_PGMSPACE_H */
+
+
@@ -0,0 +1,44 @@
+
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+
+unsigned long host_cli = 0; /**< Times interrupts were disabled. */
+
+
+/*
+ * Registers, interrupts start enabled like after sei() in main.
+ */
+volatile uint8_t SREG = _BV(SREG_I);
+volatile uint8_t PRR;
+volatile uint8_t PORTB;
+volatile uint8_t DDRB;
+volatile uint8_t PINB;
+volatile uint8_t PORTD;
+volatile uint8_t DDRD;
+volatile uint8_t PIND;
+volatile uint8_t TCCR0A;
+volatile uint8_t TCCR0B;
+volatile uint8_t TCNT0;
+volatile uint8_t OCR0A;
+volatile uint8_t OCR0B;
+volatile uint8_t TIMSK0;
+volatile uint8_t TIFR0;
+volatile uint8_t TCCR2A;
+volatile uint8_t TCCR2B;
+volatile uint8_t TCNT2;
+volatile uint8_t OCR2A;
+volatile uint8_t OCR2B;
+volatile uint8_t TIMSK2;
+volatile uint8_t TIFR2;
+volatile uint8_t SPCR;
+volatile uint8_t SPSR;
+volatile uint8_t SPDR;
+volatile uint16_t UBRR1;
+volatile uint8_t UCSR1A;
+volatile uint8_t UCSR1B;
+volatile uint8_t UCSR1C;
+volatile uint8_t UDR1;
+
+
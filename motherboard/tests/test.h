@@ -0,0 +1,80 @@
+
+
+#ifndef _TEST_H
+#  define _TEST_H
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+
+/**
+ * @file
+ *
+ * @brief Minimal checks for the host tests.
+ *
+ * Each test program is one file of test functions run by its main, a failed
+ *  check prints where it was and makes the program exit with an error.
+ *
+ * Benchmarks only print what they measure, host timings are too noisy to fail
+ *  on.
+ */
+
+
+static int test_failed = 0; /**< Checks that failed so far. */
+
+
+/**
+ * @brief Checks a condition, carries on if it fails.
+ */
+#define TEST_CHECK( cond ) \
+do { \
+   if (!(cond)) { \
+      printf( "%s:%d: %s\n", __FILE__, __LINE__, #cond ); \
+      test_failed++; \
+   } \
+} while (0)
+
+
+/**
+ * @brief Runs a test function.
+ */
+#define TEST_RUN( func ) \
+do { \
+   int test_before = test_failed; \
+   func(); \
+   printf( "%s %s\n", (test_failed == test_before) ? "ok  " : "FAIL", #func ); \
+} while (0)
+
+
+/**
+ * @brief Prints a benchmark result.
+ */
+#define TEST_BENCH( what, fmt, ... ) \
+   printf( "bench %s: " fmt "\n", what, __VA_ARGS__ )
+
+
+/**
+ * @brief Gets a monotonic host time for benchmarks.
+ *
+ *    @return Nanoseconds from an arbitrary start.
+ */
+static inline uint64_t test_ns (void)
+{
+   struct timespec ts;
+
+   clock_gettime( CLOCK_MONOTONIC, &ts );
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/**
+ * @brief Exit status of the test program.
+ */
+#define TEST_EXIT()     ((test_failed == 0) ? 0 : 1)
+
+
+#endif /* _TEST_H */
+
+
@@ -0,0 +1,746 @@
+
+
+#include "conf.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <avr/interrupt.h>
+
+#include "event.h"
+#include "timer.h"
+#include "test.h"
+
+
+#define TEST_STACK_SIZE    8 /**< Depth of the old event stack. */
+#define TEST_BENCH_N       200000 /**< Events per benchmark run. */
+
+
+static uint32_t test_us = 0; /**< Fake microsecond clock. */
+static volatile event_t test_stack[ TEST_STACK_SIZE ]; /**< Old shift-down event stack. */
+static volatile int test_top = 0; /**< Events in the old stack. */
+
+
+/*
+ * Prototypes.
+ */
+static void test_custom( event_t *evt, uint8_t id, int16_t data );
+static void test_fifo (void);
+static void test_wrap (void);
+static void test_full (void);
+static void test_lanes (void);
+static void test_latency (void);
+static int test_work( event_t *evt );
+static void test_flat (void);
+static int test_destroy( event_t *evt );
+static void test_batch (void);
+static unsigned long test_drain( int batch, int n, int *left );
+static void test_batchCost (void);
+static void test_timer( event_t *evt, uint8_t timer );
+static void test_coalesce (void);
+static int test_slow( event_t *evt );
+static void test_budget (void);
+static void test_produce( uint8_t *seq, int n );
+static void test_stress (void);
+static void test_stackPush( event_t *evt );
+static int test_stackPoll( event_t *evt );
+static uint64_t test_benchRing( int depth );
+static uint64_t test_benchStack( int depth );
+static void test_bench (void);
+
+
+uint32_t timer_now_us (void)
+{
+   return test_us;
+}
+
+
+/**
+ * @brief Builds a custom event, they go to the low lane and never merge.
+ */
+static void test_custom( event_t *evt, uint8_t id, int16_t data )
+{
+   evt->type        = EVENT_TYPE_CUSTOM;
+   evt->custom.id   = id;
+   evt->custom.data = data;
+}
+
+
+/**
+ * @brief Events come out in the order they went in.
+ */
+static void test_fifo (void)
+{
+   int i;
+   event_t evt;
+
+   event_init();
+   TEST_CHECK( !event_pending() );
+
+   for (i=0; i<4; i++) {
+      test_custom( &evt, i, 100+i );
+      event_push( &evt );
+   }
+   TEST_CHECK( event_pending() );
+
+   for (i=0; i<4; i++) {
+      TEST_CHECK( event_poll( &evt ) == 1 );
+      TEST_CHECK( evt.type == EVENT_TYPE_CUSTOM );
+      TEST_CHECK( evt.custom.id == i );
+      TEST_CHECK( evt.custom.data == 100+i );
+   }
+   TEST_CHECK( event_poll( &evt ) == 0 );
+   TEST_CHECK( !event_pending() );
+}
+
+
+/**
+ * @brief Free running head and tail wrap around the ring and the counters.
+ */
+static void test_wrap (void)
+{
+   int i;
+   event_t evt;
+
+   event_init();
+   for (i=0; i<300; i++) {
+      test_custom( &evt, i & 0xFF, i );
+      event_push( &evt );
+      test_custom( &evt, 0, 0 );
+      TEST_CHECK( event_poll( &evt ) == 1 );
+      TEST_CHECK( evt.custom.data == i );
+   }
+   TEST_CHECK( !event_pending() );
+}
+
+
+/**
+ * @brief A full lane drops new events and counts them.
+ */
+static void test_full (void)
+{
+   int i;
+   event_t evt;
+   event_stats_t stats;
+
+   event_init();
+   for (i=0; i<EVENT_QUEUE_SIZE+3; i++) {
+      test_custom( &evt, i, i );
+      event_push( &evt );
+   }
+   event_stats( EVENT_LANE_LOW, &stats );
+   TEST_CHECK( stats.dropped == 3 );
+   TEST_CHECK( stats.highwater == EVENT_QUEUE_SIZE );
+
+   /* Oldest ones were kept. */
+   for (i=0; i<EVENT_QUEUE_SIZE; i++) {
+      TEST_CHECK( event_poll( &evt ) == 1 );
+      TEST_CHECK( evt.custom.id == i );
+   }
+   TEST_CHECK( event_poll( &evt ) == 0 );
+}
+
+
+/**
+ * @brief Higher lanes go first whatever the order they were pushed in.
+ */
+static void test_lanes (void)
+{
+   event_t evt;
+
+   event_init();
+   test_custom( &evt, 1, 0 );
+   event_push( &evt );
+   test_timer( &evt, 2 );
+   event_push( &evt );
+   evt.type          = EVENT_TYPE_SPI;
+   evt.spi.port      = 1;
+   evt.spi.len       = 6;
+   event_push( &evt );
+
+   TEST_CHECK( event_poll( &evt ) && (evt.type == EVENT_TYPE_SPI) );
+   TEST_CHECK( event_poll( &evt ) && (evt.type == EVENT_TYPE_TIMER) );
+   TEST_CHECK( event_poll( &evt ) && (evt.type == EVENT_TYPE_CUSTOM) );
+
+   /* Moving a type to another lane. */
+   event_setLane( EVENT_TYPE_CUSTOM, EVENT_LANE_HIGH );
+   test_timer( &evt, 2 );
+   event_push( &evt );
+   test_custom( &evt, 1, 0 );
+   event_push( &evt );
+   TEST_CHECK( event_poll( &evt ) && (evt.type == EVENT_TYPE_CUSTOM) );
+   TEST_CHECK( event_poll( &evt ) && (evt.type == EVENT_TYPE_TIMER) );
+}
+
+
+/**
+ * @brief Latency is the worst time an event waited in its lane.
+ */
+static void test_latency (void)
+{
+   event_t evt;
+   event_stats_t stats;
+
+   event_init();
+   test_us = 100;
+   test_custom( &evt, 1, 0 );
+   event_push( &evt );
+   test_us = 350;
+   test_custom( &evt, 2, 0 );
+   event_push( &evt );
+   test_us = 400;
+   TEST_CHECK( event_poll( &evt ) == 1 );
+   TEST_CHECK( event_poll( &evt ) == 1 );
+
+   event_stats( EVENT_LANE_LOW, &stats );
+   TEST_CHECK( stats.latency == 300 );
+   event_stats( EVENT_LANE_HIGH, &stats );
+   TEST_CHECK( stats.latency == 0 );
+
+   /* Clock wrapping past 16 bits between push and poll. */
+   event_init();
+   test_us = 0x1FFF0;
+   test_custom( &evt, 1, 0 );
+   event_push( &evt );
+   test_us = 0x20010;
+   TEST_CHECK( event_poll( &evt ) == 1 );
+   event_stats( EVENT_LANE_LOW, &stats );
+   TEST_CHECK( stats.latency == 0x20 );
+}
+
+
+/**
+ * @brief Callback that takes 100 us to handle an event.
+ */
+static int test_work( event_t *evt )
+{
+   test_us += 100;
+   return 0;
+}
+
+
+/**
+ * @brief High lane latency stays flat however deep the low lane gets.
+ *
+ * Low lane callbacks take time, so a high lane event stuck behind them would
+ *  see its latency grow with the depth.
+ */
+static void test_flat (void)
+{
+   int depth, i;
+   uint16_t high, low;
+   event_t evt;
+   event_stats_t stats;
+
+   event_init();
+   event_setCallback( EVENT_TYPE_CUSTOM, test_work );
+   high = 0;
+   low  = 0;
+   for (depth=0; depth<=EVENT_QUEUE_SIZE; depth++) {
+      /* Low lane filled first, ADC would coalesce. */
+      for (i=0; i<depth; i++) {
+         test_custom( &evt, i, i );
+         event_push( &evt );
+      }
+      test_us += 10;
+      evt.type     = EVENT_TYPE_SPI;
+      evt.spi.port = 1;
+      evt.spi.len  = 6;
+      event_push( &evt );
+      test_us += 10;
+      while (event_poll( &evt ));
+
+      event_stats( EVENT_LANE_HIGH, &stats );
+      if (depth == 0)
+         high = stats.latency;
+      TEST_CHECK( stats.latency == high );
+      TEST_CHECK( stats.dropped == 0 );
+
+      /* The load is real. */
+      event_stats( EVENT_LANE_LOW, &stats );
+      TEST_CHECK( (depth < 2) || (stats.latency > low) );
+      low = stats.latency;
+   }
+   TEST_CHECK( high == 10 );
+}
+
+
+/**
+ * @brief Subscription that destroys every event it gets.
+ */
+static int test_destroy( event_t *evt )
+{
+   return 1;
+}
+
+
+/**
+ * @brief Batches come out in priority order without destroyed events.
+ */
+static void test_batch (void)
+{
+   int i;
+   event_t evt, evts[ EVENT_BATCH_MAX ];
+   event_sub_t sub;
+
+   event_init();
+   test_custom( &evt, 1, 0 );
+   event_push( &evt );
+   evt.type          = EVENT_TYPE_ADC;
+   evt.adc.channel   = 3;
+   evt.adc.value     = 512;
+   event_push( &evt );
+   evt.type          = EVENT_TYPE_SPI;
+   evt.spi.port      = 1;
+   evt.spi.len       = 6;
+   event_push( &evt );
+   test_timer( &evt, 2 );
+   event_push( &evt );
+
+   TEST_CHECK( event_pollBatch( evts, EVENT_BATCH_MAX ) == 4 );
+   TEST_CHECK( evts[0].type == EVENT_TYPE_SPI );
+   TEST_CHECK( evts[1].type == EVENT_TYPE_TIMER );
+   TEST_CHECK( evts[2].type == EVENT_TYPE_CUSTOM );
+   TEST_CHECK( evts[3].type == EVENT_TYPE_ADC );
+   TEST_CHECK( !event_pending() );
+
+   /* Never more than asked for. */
+   for (i=0; i<3; i++) {
+      test_custom( &evt, i, i );
+      event_push( &evt );
+   }
+   TEST_CHECK( event_pollBatch( evts, 2 ) == 2 );
+   TEST_CHECK( (evts[0].custom.id == 0) && (evts[1].custom.id == 1) );
+   TEST_CHECK( event_pollBatch( evts, 2 ) == 1 );
+   TEST_CHECK( evts[0].custom.id == 2 );
+
+   /* Only the subscribed source gets destroyed, the rest close the gap. */
+   event_subscribe( &sub, EVENT_TYPE_CUSTOM, 5, test_destroy );
+   for (i=4; i<8; i++) {
+      test_custom( &evt, i, i );
+      event_push( &evt );
+   }
+   TEST_CHECK( event_pollBatch( evts, EVENT_BATCH_MAX ) == 3 );
+   TEST_CHECK( evts[0].custom.id == 4 );
+   TEST_CHECK( evts[1].custom.id == 6 );
+   TEST_CHECK( evts[2].custom.id == 7 );
+
+   /* All destroyed still empties the lanes. */
+   test_custom( &evt, 5, 0 );
+   event_push( &evt );
+   TEST_CHECK( event_pollBatch( evts, EVENT_BATCH_MAX ) == 0 );
+   TEST_CHECK( !event_pending() );
+
+   event_unsubscribe( &sub );
+   event_push( &evt );
+   TEST_CHECK( event_pollBatch( evts, EVENT_BATCH_MAX ) == 1 );
+}
+
+
+/**
+ * @brief Drains the lanes like the main loop does.
+ *
+ *    @param batch Whether to use event_pollBatch or event_poll.
+ *    @param n Events to queue first.
+ *    @param[out] left Events left queued after one pass.
+ *    @return Times interrupts were disabled to drain them.
+ */
+static unsigned long test_drain( int batch, int n, int *left )
+{
+   int i;
+   unsigned long start;
+   event_t evt, evts[ EVENT_BATCH_MAX ];
+
+   event_init();
+   for (i=0; i<n; i++) {
+      evt.type       = (i & 1) ? EVENT_TYPE_SPI : EVENT_TYPE_MODULE;
+      evt.raw.source = i;
+      event_push( &evt );
+   }
+
+   /* Same shape as the loop in main. */
+   start = host_cli;
+   cli();
+   if (batch) {
+      while (event_pollBatch( evts, EVENT_BATCH_MAX ) > 0) {
+         sei();
+         cli();
+      }
+   }
+   else {
+      while (event_poll( &evt )) {
+         sei();
+         cli();
+      }
+   }
+   sei();
+
+   *left = 0;
+   while (event_poll( &evt ))
+      (*left)++;
+   return host_cli - start;
+}
+
+
+/**
+ * @brief Batches take far fewer critical sections per event.
+ */
+static void test_batchCost (void)
+{
+   int left;
+   unsigned long single, batched;
+
+   single  = test_drain( 0, EVENT_BATCH_MAX, &left );
+   TEST_CHECK( left == 0 );
+   batched = test_drain( 1, EVENT_BATCH_MAX, &left );
+   TEST_CHECK( left == 0 );
+
+   /* One to check for events, one per event or one per batch. */
+   TEST_CHECK( single == EVENT_BATCH_MAX + 1 );
+   TEST_CHECK( batched == 2 );
+   TEST_BENCH( "batch", "%d events %lu cli single %lu cli batched",
+         EVENT_BATCH_MAX, single, batched );
+}
+
+
+/**
+ * @brief Builds a timer event, they merge by counting.
+ */
+static void test_timer( event_t *evt, uint8_t timer )
+{
+   evt->type         = EVENT_TYPE_TIMER;
+   evt->timer.timer  = timer;
+   evt->timer.count  = 1;
+   evt->timer.handle = 0;
+}
+
+
+/**
+ * @brief Queued events of the same source merge according to their rule.
+ */
+static void test_coalesce (void)
+{
+   int i;
+   event_t evt;
+   event_stats_t stats;
+
+   /* Timers count the times they went off. */
+   event_init();
+   test_timer( &evt, 1 );
+   event_push( &evt );
+   test_timer( &evt, 2 );
+   event_push( &evt );
+   for (i=0; i<3; i++) {
+      test_timer( &evt, 1 );
+      event_push( &evt );
+   }
+   TEST_CHECK( event_poll( &evt ) && (evt.timer.timer == 1) && (evt.timer.count == 4) );
+   TEST_CHECK( event_poll( &evt ) && (evt.timer.timer == 2) && (evt.timer.count == 1) );
+   TEST_CHECK( event_poll( &evt ) == 0 );
+   event_stats( EVENT_LANE_MED, &stats );
+   TEST_CHECK( stats.coalesced == 3 );
+   TEST_CHECK( stats.highwater == 2 );
+
+   /* The count saturates. */
+   for (i=0; i<300; i++) {
+      test_timer( &evt, 1 );
+      event_push( &evt );
+   }
+   TEST_CHECK( event_poll( &evt ) && (evt.timer.count == UINT8_MAX) );
+   event_stats( EVENT_LANE_MED, &stats );
+   TEST_CHECK( stats.coalesced == UINT8_MAX );
+
+   /* ADC keeps the latest value of each channel, in its first place. */
+   for (i=0; i<4; i++) {
+      evt.type        = EVENT_TYPE_ADC;
+      evt.adc.channel = i & 1;
+      evt.adc.value   = 100+i;
+      event_push( &evt );
+   }
+   TEST_CHECK( event_poll( &evt ) && (evt.adc.channel == 0) && (evt.adc.value == 102) );
+   TEST_CHECK( event_poll( &evt ) && (evt.adc.channel == 1) && (evt.adc.value == 103) );
+
+   /* Once taken a new one gets queued. */
+   test_timer( &evt, 1 );
+   event_push( &evt );
+   TEST_CHECK( event_poll( &evt ) && (evt.timer.count == 1) );
+
+   /* Custom events never merge unless asked to. */
+   for (i=0; i<2; i++) {
+      test_custom( &evt, 7, i );
+      event_push( &evt );
+   }
+   TEST_CHECK( event_poll( &evt ) && (evt.custom.data == 0) );
+   TEST_CHECK( event_poll( &evt ) && (evt.custom.data == 1) );
+   event_setCoalesce( EVENT_TYPE_CUSTOM, EVENT_COALESCE_REPLACE );
+   for (i=0; i<2; i++) {
+      test_custom( &evt, 7, i );
+      event_push( &evt );
+   }
+   TEST_CHECK( event_poll( &evt ) && (evt.custom.data == 1) );
+   TEST_CHECK( event_poll( &evt ) == 0 );
+}
+
+
+/**
+ * @brief Subscription that takes a third of the budget and destroys.
+ */
+static int test_slow( event_t *evt )
+{
+   test_us += EVENT_DISPATCH_BUDGET_US / 3 + 1;
+   return 1;
+}
+
+
+/**
+ * @brief Polling gives up once the callbacks ran out of time.
+ */
+static void test_budget (void)
+{
+   int i, n;
+   event_t evt;
+   event_sub_t sub;
+
+   event_init();
+   event_subscribe( &sub, EVENT_TYPE_CUSTOM, 5, test_slow );
+   for (i=0; i<EVENT_QUEUE_SIZE; i++) {
+      test_custom( &evt, 5, i );
+      event_push( &evt );
+   }
+
+   /* Three callbacks fit, at least one always runs. */
+   n = 0;
+   while (event_pending()) {
+      TEST_CHECK( event_poll( &evt ) == 0 );
+      n++;
+   }
+   TEST_CHECK( n == (EVENT_QUEUE_SIZE+2) / 3 );
+
+   /* Surviving events still come out right away. */
+   test_custom( &evt, 5, 0 );
+   event_push( &evt );
+   test_custom( &evt, 6, 0 );
+   event_push( &evt );
+   TEST_CHECK( event_poll( &evt ) && (evt.custom.id == 6) );
+}
+
+
+/**
+ * @brief Fakes an interrupt pushing a burst, one event per lane in turn.
+ *
+ *    @param seq Next sequence number of each lane, carried in the events.
+ *    @param n Events to push.
+ */
+static void test_produce( uint8_t *seq, int n )
+{
+   int i;
+   uint8_t sreg;
+   event_t evt;
+
+   /* Pushing from an interrupt. */
+   sreg = SREG;
+   cli();
+   for (i=0; i<n; i++) {
+      switch (rand() % EVENT_LANE_MAX) {
+         case EVENT_LANE_HIGH:
+            evt.type        = EVENT_TYPE_SPI;
+            evt.spi.port    = 1;
+            evt.spi.len     = seq[ EVENT_LANE_HIGH ]++;
+            break;
+         case EVENT_LANE_MED:
+            test_timer( &evt, 1 );
+            evt.timer.handle = seq[ EVENT_LANE_MED ]++;
+            break;
+         default:
+            test_custom( &evt, 1, seq[ EVENT_LANE_LOW ]++ );
+            break;
+      }
+      event_push( &evt );
+   }
+   SREG = sreg;
+}
+
+
+/**
+ * @brief Bursts from a fake interrupt between polls never lose or reorder
+ *  events without counting them.
+ */
+static void test_stress (void)
+{
+   int round, step, i, lane, polled[ EVENT_LANE_MAX ];
+   uint8_t seq[ EVENT_LANE_MAX ], next[ EVENT_LANE_MAX ], got;
+   event_t evt;
+   event_stats_t stats;
+
+   srand( 1234 );
+   for (round=0; round<200; round++) {
+      event_init();
+      event_setCoalesce( EVENT_TYPE_TIMER, EVENT_COALESCE_NONE );
+      for (i=0; i<EVENT_LANE_MAX; i++) {
+         seq[i]    = 0;
+         next[i]   = 0;
+         polled[i] = 0;
+      }
+
+      /* Producer outruns the consumer for a while, then it catches up. */
+      for (step=0; step<40; step++) {
+         if (step < 30)
+            test_produce( seq, rand() % 5 );
+         for (i=rand()%3; (i>0) && event_poll( &evt ); i--) {
+            if (evt.type == EVENT_TYPE_SPI) {
+               lane = EVENT_LANE_HIGH;
+               got  = evt.spi.len;
+            }
+            else if (evt.type == EVENT_TYPE_TIMER) {
+               lane = EVENT_LANE_MED;
+               got  = evt.timer.handle;
+            }
+            else {
+               lane = EVENT_LANE_LOW;
+               got  = evt.custom.data;
+            }
+
+            /* Dropped events only leave a gap. */
+            TEST_CHECK( (uint8_t)(got - next[ lane ]) < (uint8_t)(seq[ lane ] - next[ lane ]) );
+            next[ lane ] = got+1;
+            polled[ lane ]++;
+         }
+      }
+      while (event_poll( &evt ))
+         polled[ (evt.type == EVENT_TYPE_SPI) ? EVENT_LANE_HIGH :
+               (evt.type == EVENT_TYPE_TIMER) ? EVENT_LANE_MED : EVENT_LANE_LOW ]++;
+
+      /* Everything pushed was polled or counted as dropped. */
+      for (i=0; i<EVENT_LANE_MAX; i++) {
+         event_stats( i, &stats );
+         TEST_CHECK( polled[i] + stats.dropped == seq[i] );
+         TEST_CHECK( stats.highwater <= EVENT_QUEUE_SIZE );
+      }
+   }
+}
+
+
+/**
+ * @brief Pushes to the old shift-down stack, kept to compare against.
+ */
+static void test_stackPush( event_t *evt )
+{
+   if (test_top >= TEST_STACK_SIZE)
+      return;
+   test_stack[ test_top++ ] = *evt;
+}
+
+
+/**
+ * @brief Polls the old shift-down stack, every event left moves down.
+ */
+static int test_stackPoll( event_t *evt )
+{
+   int i;
+
+   if (test_top <= 0)
+      return 0;
+   *evt = test_stack[0];
+   for (i=1; i<test_top; i++)
+      test_stack[i-1] = test_stack[i];
+   test_top--;
+   return 1;
+}
+
+
+/**
+ * @brief Times pushing and polling the ring with events already queued.
+ *
+ *    @param depth Events kept queued.
+ *    @return Best nanoseconds for TEST_BENCH_N events.
+ */
+static uint64_t test_benchRing( int depth )
+{
+   int i, rep;
+   uint64_t start, t, best;
+   event_t evt;
+
+   best = UINT64_MAX;
+   for (rep=0; rep<5; rep++) {
+      event_init();
+      test_custom( &evt, 1, 0 );
+      for (i=0; i<depth; i++)
+         event_push( &evt );
+      start = test_ns();
+      for (i=0; i<TEST_BENCH_N; i++) {
+         event_push( &evt );
+         event_poll( &evt );
+      }
+      t = test_ns() - start;
+      if (t < best)
+         best = t;
+   }
+   return best;
+}
+
+
+/**
+ * @brief Times pushing and polling the old stack with events already queued.
+ *
+ *    @param depth Events kept queued.
+ *    @return Best nanoseconds for TEST_BENCH_N events.
+ */
+static uint64_t test_benchStack( int depth )
+{
+   int i, rep;
+   uint64_t start, t, best;
+   event_t evt;
+
+   best = UINT64_MAX;
+   for (rep=0; rep<5; rep++) {
+      test_top = 0;
+      test_custom( &evt, 1, 0 );
+      for (i=0; i<depth; i++)
+         test_stackPush( &evt );
+      start = test_ns();
+      for (i=0; i<TEST_BENCH_N; i++) {
+         test_stackPush( &evt );
+         test_stackPoll( &evt );
+      }
+      t = test_ns() - start;
+      if (t < best)
+         best = t;
+   }
+   return best;
+}
+
+
+/**
+ * @brief Compares the ring with the old stack as the queue fills.
+ *
+ * The ring does more per event (lanes, stamps, subscriptions) so only how
+ *  the cost grows with the depth compares.
+ */
+static void test_bench (void)
+{
+   int depth;
+
+   for (depth=0; depth<TEST_STACK_SIZE; depth=2*depth+1)
+      TEST_BENCH( "event", "depth %d ring %.1f ns stack %.1f ns", depth,
+            (double)test_benchRing( depth ) / TEST_BENCH_N,
+            (double)test_benchStack( depth ) / TEST_BENCH_N );
+}
+
+
+int main (void)
+{
+   TEST_RUN( test_fifo );
+   TEST_RUN( test_wrap );
+   TEST_RUN( test_full );
+   TEST_RUN( test_lanes );
+   TEST_RUN( test_latency );
+   TEST_RUN( test_flat );
+   TEST_RUN( test_batch );
+   TEST_RUN( test_batchCost );
+   TEST_RUN( test_coalesce );
+   TEST_RUN( test_budget );
+   TEST_RUN( test_stress );
+   TEST_RUN( test_bench );
+   return TEST_EXIT();
+}
+
+
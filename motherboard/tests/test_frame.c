@@ -0,0 +1,397 @@
+
+
+#include <string.h>
+
+#include "crc8.h"
+#include "dhb/frame.h"
+#include "dhb/hbridge.h"
+#include "test.h"
+
+
+#define TEST_FUZZ_N        100000 /**< Frames the fuzz decodes. */
+#define TEST_BENCH_N       1000000 /**< Bytes per benchmark run. */
+
+
+static uint32_t test_seed = 1; /**< State of test_rand, fixed so runs repeat. */
+static volatile uint8_t test_sink; /**< Keeps benchmarked CRCs from being optimized out. */
+
+
+/*
+ * Prototypes.
+ */
+static uint8_t test_rand (void);
+static uint8_t test_crcBits( uint8_t crc, uint8_t data );
+static uint8_t test_crcReply( uint8_t cmd, const uint8_t *data, uint8_t len );
+static uint64_t test_benchTable( const uint8_t *data );
+static uint64_t test_benchBits( const uint8_t *data );
+static void test_crc (void);
+static void test_lens (void);
+static void test_classic (void);
+static void test_pipe (void);
+static void test_decode (void);
+static void test_fuzz (void);
+static void test_bench (void);
+
+
+/**
+ * @brief Linear congruential generator, good enough to shake the decoder.
+ */
+static uint8_t test_rand (void)
+{
+   test_seed = test_seed * 1103515245UL + 12345UL;
+   return test_seed >> 16;
+}
+
+
+/**
+ * @brief CRC a bit at a time like _crc_ibutton_update from avr-libc.
+ */
+static uint8_t test_crcBits( uint8_t crc, uint8_t data )
+{
+   uint8_t i;
+
+   crc ^= data;
+   for (i=0; i<8; i++) {
+      if (crc & 0x01)
+         crc = (crc >> 1) ^ 0x8C;
+      else
+         crc >>= 1;
+   }
+   return crc;
+}
+
+
+/**
+ * @brief Reply CRC worked out a bit at a time, independent of frame_crc.
+ */
+static uint8_t test_crcReply( uint8_t cmd, const uint8_t *data, uint8_t len )
+{
+   uint8_t i, crc;
+
+   crc = test_crcBits( 0, cmd );
+   for (i=0; i<len; i++)
+      crc = test_crcBits( crc, data[i] );
+   return crc;
+}
+
+
+/**
+ * @brief Times the table CRC.
+ *
+ *    @param data TEST_BENCH_N bytes to run through.
+ *    @return Best nanoseconds for TEST_BENCH_N bytes.
+ */
+static uint64_t test_benchTable( const uint8_t *data )
+{
+   int i, rep;
+   uint8_t crc;
+   uint64_t start, t, best;
+
+   best = UINT64_MAX;
+   for (rep=0; rep<5; rep++) {
+      crc   = 0;
+      start = test_ns();
+      for (i=0; i<TEST_BENCH_N; i++)
+         crc = crc8_update( crc, data[i] );
+      t = test_ns() - start;
+      test_sink = crc;
+      if (t < best)
+         best = t;
+   }
+   return best;
+}
+
+
+/**
+ * @brief Times the bitwise CRC.
+ *
+ *    @param data TEST_BENCH_N bytes to run through.
+ *    @return Best nanoseconds for TEST_BENCH_N bytes.
+ */
+static uint64_t test_benchBits( const uint8_t *data )
+{
+   int i, rep;
+   uint8_t crc;
+   uint64_t start, t, best;
+
+   best = UINT64_MAX;
+   for (rep=0; rep<5; rep++) {
+      crc   = 0;
+      start = test_ns();
+      for (i=0; i<TEST_BENCH_N; i++)
+         crc = test_crcBits( crc, data[i] );
+      t = test_ns() - start;
+      test_sink = crc;
+      if (t < best)
+         best = t;
+   }
+   return best;
+}
+
+
+/**
+ * @brief The table gives the same CRC as going through the bits.
+ */
+static void test_crc (void)
+{
+   int i, j;
+   uint8_t crc;
+   const char *check = "123456789";
+
+   for (i=0; i<256; i++)
+      for (j=0; j<256; j+=17)
+         TEST_CHECK( crc8_update( j, i ) == test_crcBits( j, i ) );
+
+   /* Standard check value of CRC-8/MAXIM. */
+   crc = 0;
+   for (i=0; check[i] != '\0'; i++)
+      crc = crc8_update( crc, check[i] );
+   TEST_CHECK( crc == 0xA1 );
+}
+
+
+/**
+ * @brief Every frame fits in FRAME_MAX and unknown commands are caught.
+ */
+static void test_lens (void)
+{
+   uint8_t cmd, prev;
+   uint8_t buf[ FRAME_MAX ];
+
+   TEST_CHECK( frame_reqLen( DHB_CMD_CYCLE ) == 4 );
+   TEST_CHECK( frame_replyLen( DHB_CMD_CYCLE ) == 8 );
+   TEST_CHECK( frame_replyLen( DHB_CMD_IDENT ) == DHB_IDENT_LEN );
+   TEST_CHECK( frame_reqLen( DHB_CMD_PARAMSAVE+1 ) == FRAME_INVALID );
+   TEST_CHECK( frame_replyLen( DHB_CMD_PARAMSAVE+1 ) == 0 );
+
+   memset( buf, 0, sizeof(buf) );
+   for (cmd=DHB_CMD_VERSION; cmd<=DHB_CMD_PARAMSAVE; cmd++) {
+      TEST_CHECK( frame_encode( buf, 0, cmd, DHB_CMD_NONE ) <= FRAME_MAX );
+      for (prev=DHB_CMD_NONE; prev<=DHB_CMD_PARAMSAVE; prev++)
+         TEST_CHECK( frame_encode( buf, 1, cmd, prev ) <= FRAME_MAX );
+   }
+
+   /* The classic cycle is the longest. */
+   TEST_CHECK( frame_encode( buf, 0, DHB_CMD_CYCLE, DHB_CMD_NONE ) == FRAME_MAX );
+}
+
+
+/**
+ * @brief Classic frames leave room for the reply and its CRC.
+ */
+static void test_classic (void)
+{
+   uint8_t buf[ FRAME_MAX ];
+   const uint8_t set[4] = { 0x01, 0x80, 0xFF, 0x7F };
+
+   /* Request data and no reply. */
+   memcpy( &buf[2], set, sizeof(set) );
+   TEST_CHECK( frame_encode( buf, 0, DHB_CMD_MOTORSET, DHB_CMD_NONE ) == 7 );
+   TEST_CHECK( (buf[0] == DHB_HEADER) && (buf[1] == DHB_CMD_MOTORSET) );
+   TEST_CHECK( memcmp( &buf[2], set, sizeof(set) ) == 0 );
+   TEST_CHECK( buf[6] == frame_crc( DHB_CMD_MOTORSET, set, sizeof(set) ) );
+
+   /* Reply padding counts up so it never looks like a header. */
+   TEST_CHECK( frame_encode( buf, 0, DHB_CMD_MOTORGET, DHB_CMD_NONE ) == 8 );
+   TEST_CHECK( buf[2] == frame_crc( DHB_CMD_MOTORGET, NULL, 0 ) );
+   TEST_CHECK( (buf[3] == 1) && (buf[7] == 5) );
+
+   /* Version reply predates CRCs. */
+   TEST_CHECK( frame_encode( buf, 0, DHB_CMD_VERSION, DHB_CMD_NONE ) == 4 );
+}
+
+
+/**
+ * @brief Pipelined frames only pad for the previous reply.
+ */
+static void test_pipe (void)
+{
+   uint8_t buf[ FRAME_MAX ];
+
+   memset( buf, 0xAA, sizeof(buf) );
+   TEST_CHECK( frame_encode( buf, 1, DHB_CMD_CYCLE, DHB_CMD_CYCLE ) == 10 );
+   TEST_CHECK( (buf[0] == DHB_HEADER_PIPE) && (buf[1] == DHB_CMD_CYCLE) );
+   TEST_CHECK( buf[6] == frame_crc( DHB_CMD_CYCLE, &buf[2], 4 ) );
+   TEST_CHECK( (buf[7] == 0) && (buf[9] == 0) );
+
+   /* Request is longer than the reply. */
+   TEST_CHECK( frame_encode( buf, 1, DHB_CMD_MOTORSET, DHB_CMD_NONE ) == 7 );
+   TEST_CHECK( frame_encode( buf, 1, DHB_CMD_MOTORSET, DHB_CMD_VERSION ) == 7 );
+}
+
+
+/**
+ * @brief Replies are found where the slave puts them and checked.
+ */
+static void test_decode (void)
+{
+   uint8_t rx[ FRAME_MAX ];
+   const uint8_t get[4] = { 0x12, 0x34, 0xFE, 0xDC };
+
+   /* Classic, after the echo of the header, command and request. */
+   memset( rx, 0, sizeof(rx) );
+   rx[2] = DHB_CMD_MOTORGET;
+   memcpy( &rx[3], get, sizeof(get) );
+   rx[7] = frame_crc( DHB_CMD_MOTORGET, get, sizeof(get) );
+   TEST_CHECK( frame_decode( rx, 0, DHB_CMD_MOTORGET ) == &rx[3] );
+
+   rx[4] ^= 0x10;
+   TEST_CHECK( frame_decode( rx, 0, DHB_CMD_MOTORGET ) == NULL );
+   rx[4] ^= 0x10;
+   rx[2]  = DHB_CMD_CURRENT;
+   TEST_CHECK( frame_decode( rx, 0, DHB_CMD_MOTORGET ) == NULL );
+
+   /* Classic with request data, reply after it. */
+   memset( rx, 0, sizeof(rx) );
+   rx[2] = DHB_CMD_PARAMGET;
+   rx[4] = DHB_PARAM_RATE;
+   rx[5] = 0x01;
+   rx[6] = 0xF4;
+   rx[7] = frame_crc( DHB_CMD_PARAMGET, &rx[4], 3 );
+   TEST_CHECK( frame_decode( rx, 0, DHB_CMD_PARAMGET ) == &rx[4] );
+
+   /* Version has no CRC. */
+   rx[2] = DHB_CMD_VERSION;
+   rx[3] = DHB_VERSION;
+   TEST_CHECK( frame_decode( rx, 0, DHB_CMD_VERSION ) == &rx[3] );
+
+   /* Pipelined, led by the previous command. */
+   memset( rx, 0, sizeof(rx) );
+   rx[0] = DHB_CMD_MOTORGET;
+   memcpy( &rx[1], get, sizeof(get) );
+   rx[5] = frame_crc( DHB_CMD_MOTORGET, get, sizeof(get) );
+   TEST_CHECK( frame_decode( rx, 1, DHB_CMD_MOTORGET ) == &rx[1] );
+
+   rx[5] ^= 0x01;
+   TEST_CHECK( frame_decode( rx, 1, DHB_CMD_MOTORGET ) == NULL );
+
+   /* Slave dropped the reply. */
+   rx[0] = DHB_CMD_NONE;
+   rx[1] = frame_crc( DHB_CMD_NONE, NULL, 0 );
+   TEST_CHECK( frame_decode( rx, 1, DHB_CMD_MOTORGET ) == NULL );
+}
+
+
+/**
+ * @brief Random replies to every command, classic and pipelined, are only
+ *  taken with the right command and CRC and nothing past the frame is read.
+ *
+ * Classic frames of commands without a reply are left out, there's nothing
+ *  in them to decode.
+ *
+ * Half the replies are led by the command and half of those get a good CRC,
+ *  then a quarter have a bit flipped, otherwise hardly any would pass.
+ */
+static void test_fuzz (void)
+{
+   long i;
+   int j, bad;
+   uint8_t pipe, cmd, lead, off, n, crc, len, ok, flipped;
+   uint8_t buf[ 2*FRAME_MAX ], scratch[ FRAME_MAX ];
+   int taken[2][ DHB_CMD_PARAMSAVE+1 ], caught;
+   const uint8_t *data;
+
+   memset( taken, 0, sizeof(taken) );
+   bad    = 0;
+   caught = 0;
+   for (i=0; i<TEST_FUZZ_N; i++) {
+      pipe = test_rand() & 0x01;
+      cmd  = test_rand() % (DHB_CMD_PARAMSAVE+1);
+      for (j=0; j<(int)sizeof(buf); j++)
+         buf[j] = test_rand();
+
+      /* Where the reply is and the shortest frame that carries it. */
+      n = frame_replyLen( cmd );
+      if (pipe) {
+         lead = 0;
+         off  = 1;
+         crc  = 1;
+         len  = n + 2;
+      }
+      else {
+         /* No reply is clocked, the driver doesn't decode these. */
+         if (n == 0)
+            continue;
+         lead = 2;
+         off  = 3 + frame_reqLen( cmd );
+         crc  = (cmd != DHB_CMD_VERSION);
+         len  = frame_encode( scratch, 0, cmd, DHB_CMD_NONE );
+      }
+      if ((len > FRAME_MAX) || (off + n + crc > len)) {
+         bad++;
+         continue;
+      }
+
+      if (test_rand() & 0x01) {
+         buf[lead] = cmd;
+         if (test_rand() & 0x01)
+            buf[off+n] = test_crcReply( cmd, &buf[off], n );
+      }
+      ok = (buf[lead] == cmd) &&
+            (!crc || (buf[off+n] == test_crcReply( cmd, &buf[off], n )));
+
+      /* A single bit flipped in a good reply always shows. */
+      flipped = 0;
+      if (ok && crc && ((test_rand() & 0x03) == 0)) {
+         j = test_rand() % (n + 2);
+         buf[ (j == 0) ? lead : off+j-1 ] ^= 1 << (test_rand() & 0x07);
+         ok      = 0;
+         flipped = 1;
+      }
+
+      data = frame_decode( buf, pipe, cmd );
+      if (data != (ok ? &buf[off] : NULL))
+         bad++;
+      if (ok)
+         taken[pipe][cmd]++;
+      if (flipped && (data == NULL))
+         caught++;
+
+      /* Same answer whatever follows the frame. */
+      for (j=len; j<(int)sizeof(buf); j++)
+         buf[j] = ~buf[j];
+      if (frame_decode( buf, pipe, cmd ) != data)
+         bad++;
+   }
+
+   TEST_CHECK( bad == 0 );
+   TEST_CHECK( caught > 0 );
+   for (pipe=0; pipe<2; pipe++)
+      for (cmd=DHB_CMD_NONE; cmd<=DHB_CMD_PARAMSAVE; cmd++)
+         TEST_CHECK( (taken[pipe][cmd] > 0) ||
+               (!pipe && (frame_replyLen( cmd ) == 0)) );
+}
+
+
+/**
+ * @brief Compares the table CRC with going through the bits.
+ *
+ * Host times only show the ratio, on the AVR the table is a flash load where
+ *  the bits are a loop of 8 shifts and branches.
+ */
+static void test_bench (void)
+{
+   int i;
+   static uint8_t data[ TEST_BENCH_N ];
+
+   for (i=0; i<TEST_BENCH_N; i++)
+      data[i] = test_rand();
+   TEST_BENCH( "crc8", "table %.2f ns/byte bits %.2f ns/byte",
+         (double)test_benchTable( data ) / TEST_BENCH_N,
+         (double)test_benchBits( data ) / TEST_BENCH_N );
+}
+
+
+int main (void)
+{
+   TEST_RUN( test_crc );
+   TEST_RUN( test_lens );
+   TEST_RUN( test_classic );
+   TEST_RUN( test_pipe );
+   TEST_RUN( test_decode );
+   TEST_RUN( test_fuzz );
+   TEST_RUN( test_bench );
+   return TEST_EXIT();
+}
+
+
@@ -0,0 +1,366 @@
+
+
+#include "conf.h"
+
+#include <string.h>
+
+#include "event.h"
+#include "hsm.h"
+#include "timer.h"
+#include "test.h"
+
+
+/*
+ * The states.
+ *
+ *  ROOT
+ *   +- A
+ *   |   +- A1
+ *   |   +- A2
+ *   +- B
+ *       +- B1
+ */
+#define ST_ROOT   0
+#define ST_A      1
+#define ST_A1     2
+#define ST_A2     3
+#define ST_B      4
+#define ST_B1     5
+#define ST_N      6
+
+
+static uint16_t test_now = 0; /**< Fake tick counter. */
+static char test_log[ 64 ]; /**< What the machine did. */
+static int test_allow = 0; /**< What the guard answers. */
+
+
+/*
+ * Prototypes.
+ */
+static void test_rec( const char *what );
+static void test_entry0 (void);
+static void test_entry1 (void);
+static void test_entry2 (void);
+static void test_entry3 (void);
+static void test_entry4 (void);
+static void test_entry5 (void);
+static void test_exit0 (void);
+static void test_exit1 (void);
+static void test_exit2 (void);
+static void test_exit3 (void);
+static void test_exit4 (void);
+static void test_exit5 (void);
+static int test_guard( event_t *evt );
+static void test_action( event_t *evt );
+static void test_internal( event_t *evt );
+static int test_send( hsm_t *hsm, event_type_t type, uint8_t source );
+static void test_start (void);
+static void test_siblings (void);
+static void test_lca (void);
+static void test_self (void);
+static void test_internalTrans (void);
+static void test_guards (void);
+static void test_sources (void);
+static void test_stats (void);
+
+
+uint32_t timer_now_us (void)
+{
+   return 0;
+}
+
+
+uint16_t timer_ticks (void)
+{
+   return test_now;
+}
+
+
+/**
+ * @brief Appends to the log.
+ */
+static void test_rec( const char *what )
+{
+   if (test_log[0] != '\0')
+      strcat( test_log, " " );
+   strcat( test_log, what );
+}
+
+
+/*
+ * Entry and exit actions, they log "E" or "X" and the state.
+ */
+static void test_entry0 (void) { test_rec( "E0" ); }
+static void test_entry1 (void) { test_rec( "E1" ); }
+static void test_entry2 (void) { test_rec( "E2" ); }
+static void test_entry3 (void) { test_rec( "E3" ); }
+static void test_entry4 (void) { test_rec( "E4" ); }
+static void test_entry5 (void) { test_rec( "E5" ); }
+static void test_exit0 (void) { test_rec( "X0" ); }
+static void test_exit1 (void) { test_rec( "X1" ); }
+static void test_exit2 (void) { test_rec( "X2" ); }
+static void test_exit3 (void) { test_rec( "X3" ); }
+static void test_exit4 (void) { test_rec( "X4" ); }
+static void test_exit5 (void) { test_rec( "X5" ); }
+
+
+static int test_guard( event_t *evt )
+{
+   return test_allow;
+}
+
+
+static void test_action( event_t *evt )
+{
+   test_rec( "T" );
+}
+
+
+static void test_internal( event_t *evt )
+{
+   test_rec( "I" );
+}
+
+
+/*
+ * The transitions.
+ */
+static const hsm_trans_t PROGMEM test_rootCustom[] = {
+   { .source = HSM_ANY, .target = HSM_INTERNAL, .guard = NULL, .action = test_internal },
+   HSM_TRANS_END
+};
+static const hsm_trans_t PROGMEM test_aCustom[] = {
+   { .source = 2, .target = ST_B1, .guard = NULL, .action = test_action },
+   HSM_TRANS_END
+};
+static const hsm_trans_t PROGMEM test_a1Custom[] = {
+   { .source = 1, .target = ST_A2, .guard = NULL, .action = test_action },
+   HSM_TRANS_END
+};
+static const hsm_trans_t PROGMEM test_b1Custom[] = {
+   { .source = 3, .target = ST_B1, .guard = NULL, .action = test_action },
+   HSM_TRANS_END
+};
+static const hsm_trans_t PROGMEM test_b1Timer[] = {
+   { .source = HSM_ANY, .target = ST_A1, .guard = test_guard, .action = test_action },
+   { .source = 7, .target = ST_A2, .guard = NULL, .action = test_action },
+   HSM_TRANS_END
+};
+static const hsm_trans_t PROGMEM test_b1Adc[] = {
+   { .source = 4, .target = ST_A1, .guard = NULL, .action = test_action },
+   HSM_TRANS_END
+};
+
+
+/*
+ * The state table.
+ */
+static const hsm_state_t PROGMEM test_states[ ST_N ] = {
+   [ST_ROOT] = { .parent = HSM_NONE, .entry = test_entry0, .exit = test_exit0,
+         .on = { [EVENT_TYPE_CUSTOM] = test_rootCustom } },
+   [ST_A]    = { .parent = ST_ROOT, .entry = test_entry1, .exit = test_exit1,
+         .on = { [EVENT_TYPE_CUSTOM] = test_aCustom } },
+   [ST_A1]   = { .parent = ST_A, .entry = test_entry2, .exit = test_exit2,
+         .on = { [EVENT_TYPE_CUSTOM] = test_a1Custom } },
+   [ST_A2]   = { .parent = ST_A, .entry = test_entry3, .exit = test_exit3 },
+   [ST_B]    = { .parent = ST_ROOT, .entry = test_entry4, .exit = test_exit4 },
+   [ST_B1]   = { .parent = ST_B, .entry = test_entry5, .exit = test_exit5,
+         .on = { [EVENT_TYPE_CUSTOM] = test_b1Custom,
+                 [EVENT_TYPE_TIMER]  = test_b1Timer,
+                 [EVENT_TYPE_ADC]    = test_b1Adc } }
+};
+
+
+/**
+ * @brief Dispatches an event with a clean log.
+ */
+static int test_send( hsm_t *hsm, event_type_t type, uint8_t source )
+{
+   event_t evt;
+
+   evt.type           = type;
+   evt.raw.source     = source;
+   evt.raw.payload[0] = 0;
+   evt.raw.payload[1] = 0;
+   test_log[0]        = '\0';
+   return hsm_dispatch( hsm, &evt );
+}
+
+
+/**
+ * @brief Starting enters from the top down to the initial state.
+ */
+static void test_start (void)
+{
+   hsm_t hsm;
+   hsm_stats_t stats[ ST_N ];
+
+   test_log[0] = '\0';
+   hsm_start( &hsm, test_states, stats, ST_N, ST_A1 );
+   TEST_CHECK( strcmp( test_log, "E0 E1 E2" ) == 0 );
+   TEST_CHECK( hsm_state( &hsm ) == ST_A1 );
+}
+
+
+/**
+ * @brief Going to a sibling leaves the parent alone.
+ */
+static void test_siblings (void)
+{
+   hsm_t hsm;
+   hsm_stats_t stats[ ST_N ];
+
+   hsm_start( &hsm, test_states, stats, ST_N, ST_A1 );
+   TEST_CHECK( test_send( &hsm, EVENT_TYPE_CUSTOM, 1 ) == 1 );
+   TEST_CHECK( strcmp( test_log, "X2 T E3" ) == 0 );
+   TEST_CHECK( hsm_state( &hsm ) == ST_A2 );
+}
+
+
+/**
+ * @brief Transitions inherited from a parent exit up to the common ancestor.
+ */
+static void test_lca (void)
+{
+   hsm_t hsm;
+   hsm_stats_t stats[ ST_N ];
+
+   hsm_start( &hsm, test_states, stats, ST_N, ST_A2 );
+   TEST_CHECK( test_send( &hsm, EVENT_TYPE_CUSTOM, 2 ) == 1 );
+   TEST_CHECK( strcmp( test_log, "X3 X1 T E4 E5" ) == 0 );
+   TEST_CHECK( hsm_state( &hsm ) == ST_B1 );
+
+   /* Back across the tree from the deeper side. */
+   TEST_CHECK( test_send( &hsm, EVENT_TYPE_ADC, 4 ) == 1 );
+   TEST_CHECK( strcmp( test_log, "X5 X4 T E1 E2" ) == 0 );
+   TEST_CHECK( hsm_state( &hsm ) == ST_A1 );
+}
+
+
+/**
+ * @brief A self transition exits and reenters the state.
+ */
+static void test_self (void)
+{
+   hsm_t hsm;
+   hsm_stats_t stats[ ST_N ];
+
+   hsm_start( &hsm, test_states, stats, ST_N, ST_B1 );
+   TEST_CHECK( test_send( &hsm, EVENT_TYPE_CUSTOM, 3 ) == 1 );
+   TEST_CHECK( strcmp( test_log, "X5 T E5" ) == 0 );
+   TEST_CHECK( hsm_state( &hsm ) == ST_B1 );
+   TEST_CHECK( stats[ ST_B1 ].entered == 2 );
+   TEST_CHECK( stats[ ST_B ].entered == 1 );
+}
+
+
+/**
+ * @brief An internal transition only runs its action.
+ */
+static void test_internalTrans (void)
+{
+   hsm_t hsm;
+   hsm_stats_t stats[ ST_N ];
+
+   hsm_start( &hsm, test_states, stats, ST_N, ST_B1 );
+   TEST_CHECK( test_send( &hsm, EVENT_TYPE_CUSTOM, 9 ) == 1 );
+   TEST_CHECK( strcmp( test_log, "I" ) == 0 );
+   TEST_CHECK( hsm_state( &hsm ) == ST_B1 );
+   TEST_CHECK( stats[ ST_B1 ].entered == 1 );
+}
+
+
+/**
+ * @brief A failed guard moves on to the next transition.
+ */
+static void test_guards (void)
+{
+   hsm_t hsm;
+   hsm_stats_t stats[ ST_N ];
+
+   hsm_start( &hsm, test_states, stats, ST_N, ST_B1 );
+
+   /* Nothing else matches. */
+   test_allow = 0;
+   TEST_CHECK( test_send( &hsm, EVENT_TYPE_TIMER, 1 ) == 0 );
+   TEST_CHECK( test_log[0] == '\0' );
+   TEST_CHECK( hsm_state( &hsm ) == ST_B1 );
+
+   /* Next one in the list does. */
+   TEST_CHECK( test_send( &hsm, EVENT_TYPE_TIMER, 7 ) == 1 );
+   TEST_CHECK( hsm_state( &hsm ) == ST_A2 );
+
+   /* Guard lets it through. */
+   hsm_start( &hsm, test_states, stats, ST_N, ST_B1 );
+   test_allow = 1;
+   TEST_CHECK( test_send( &hsm, EVENT_TYPE_TIMER, 7 ) == 1 );
+   TEST_CHECK( hsm_state( &hsm ) == ST_A1 );
+   test_allow = 0;
+}
+
+
+/**
+ * @brief Events from other sources are not taken.
+ */
+static void test_sources (void)
+{
+   hsm_t hsm;
+   hsm_stats_t stats[ ST_N ];
+
+   hsm_start( &hsm, test_states, stats, ST_N, ST_B1 );
+   TEST_CHECK( test_send( &hsm, EVENT_TYPE_ADC, 5 ) == 0 );
+   TEST_CHECK( hsm_state( &hsm ) == ST_B1 );
+
+   /* No transitions for the type anywhere up the tree. */
+   TEST_CHECK( test_send( &hsm, EVENT_TYPE_SPI, 4 ) == 0 );
+   TEST_CHECK( test_log[0] == '\0' );
+}
+
+
+/**
+ * @brief Residency counts ticks in a state and its substates.
+ */
+static void test_stats (void)
+{
+   hsm_t hsm;
+   hsm_stats_t stats[ ST_N ], st;
+
+   /* Tick counter wraps in the middle. */
+   test_now = 0xFFF0;
+   hsm_start( &hsm, test_states, stats, ST_N, ST_A1 );
+   test_now = 0x0010;
+   test_send( &hsm, EVENT_TYPE_CUSTOM, 1 );
+   test_now = 0x0024;
+   test_send( &hsm, EVENT_TYPE_CUSTOM, 2 );
+
+   hsm_stats( &hsm, ST_A1, &st );
+   TEST_CHECK( (st.residency == 0x20) && (st.entered == 1) );
+   hsm_stats( &hsm, ST_A2, &st );
+   TEST_CHECK( (st.residency == 0x14) && (st.entered == 1) );
+   hsm_stats( &hsm, ST_A, &st );
+   TEST_CHECK( st.residency == 0x34 );
+
+   /* Active states include the stay so far. */
+   test_now = 0x0100;
+   hsm_stats( &hsm, ST_B1, &st );
+   TEST_CHECK( st.residency == 0xDC );
+   hsm_stats( &hsm, ST_ROOT, &st );
+   TEST_CHECK( (st.residency == 0x110) && (st.entered == 1) );
+   test_now = 0;
+}
+
+
+int main (void)
+{
+   TEST_RUN( test_start );
+   TEST_RUN( test_siblings );
+   TEST_RUN( test_lca );
+   TEST_RUN( test_self );
+   TEST_RUN( test_internalTrans );
+   TEST_RUN( test_guards );
+   TEST_RUN( test_sources );
+   TEST_RUN( test_stats );
+   return TEST_EXIT();
+}
+
+
@@ -0,0 +1,364 @@
+
+
+#include "conf.h"
+
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/delay_basic.h>
+
+#include "event.h"
+#include "test.h"
+
+
+/*
+ * The data and status registers go through a fake SPI peripheral. Bytes sent
+ *  must have the top bit clear and bytes received have it set, that's how a
+ *  write to SPDR is told apart from a read.
+ */
+#define SPDR               (*test_spdr())
+#define SPSR               (*test_spsr())
+static volatile uint8_t *test_spdr (void);
+static volatile uint8_t *test_spsr (void);
+
+
+#include "../spim.c"
+
+
+/*
+ * CPU cycles the model charges, rough counts and not measured.
+ */
+#define TEST_POLL_CYCLES   4 /**< One pass of polling SPIF. */
+#define TEST_ISR_CYCLES    60 /**< Vector, prologue, body and epilogue of SPI_STC_vect. */
+#define TEST_FRAME_MAX     SPIM_BURST_LEN /**< Longest frame a test sends. */
+
+
+/**
+ * @brief What a frame cost.
+ */
+typedef struct test_frame_s {
+   uint32_t cycles; /**< From the first byte started to the last one handled. */
+   int irqs; /**< Interrupts taken. */
+   uint32_t gap; /**< Fewest cycles from one byte done to the next started. */
+} test_frame_t;
+
+
+static uint32_t test_cycles = 0; /**< CPU cycles modelled so far. */
+static uint32_t test_first = 0; /**< Cycle the first byte was started. */
+static uint32_t test_end = 0; /**< Cycle the byte on the bus is done. */
+static uint32_t test_prev = 0; /**< Cycle the previous byte was done. */
+static uint32_t test_gap = 0; /**< Fewest cycles between bytes so far. */
+static uint8_t test_busy = 0; /**< A byte is being clocked. */
+static uint8_t test_spif = 0; /**< SPIF as the hardware sets it. */
+static uint8_t test_armed = 0; /**< SPSR was read with SPIF set. */
+static uint8_t test_data = 0x80; /**< SPDR as the code sees it. */
+static uint8_t test_status = 0; /**< SPSR as the code sees it. */
+static int test_bytes = 0; /**< Bytes clocked so far. */
+static int test_collisions = 0; /**< Writes while a byte was clocked. */
+static int test_irqs = 0; /**< Interrupts taken so far. */
+
+
+/*
+ * Prototypes.
+ */
+void SPI_STC_vect (void);
+static uint32_t test_byteCycles (void);
+static void test_commit (void);
+static void test_update (void);
+static void test_wait (void);
+static void test_send( uint8_t div, uint8_t gap, int len, test_frame_t *frame );
+static void test_clock (void);
+static void test_burst (void);
+static void test_fallback (void);
+static void test_chained (void);
+static void test_bench (void);
+
+
+uint32_t timer_now_us (void)
+{
+   return 0;
+}
+
+
+void wdog_start( uint8_t task, uint16_t timeout )
+{
+}
+
+
+void wdog_stop( uint8_t task )
+{
+}
+
+
+void wdog_kick( uint8_t task )
+{
+}
+
+
+/**
+ * @brief Counts the time of a busy loop.
+ */
+void _delay_loop_1( uint8_t count )
+{
+   test_cycles += 3 * ((count == 0) ? 256 : count);
+}
+
+
+/**
+ * @brief Cycles a byte takes at the clock SPCR and SPSR are set to.
+ */
+static uint32_t test_byteCycles (void)
+{
+   static const uint8_t shift[4] = { 2, 4, 6, 7 }; /* fck/4, 16, 64, 128 */
+   uint8_t s;
+
+   s = shift[ SPCR & (_BV(SPR1) | _BV(SPR0)) ];
+   if (test_status & _BV(SPI2X))
+      s--;
+   return 8UL << s;
+}
+
+
+/**
+ * @brief Starts clocking a byte if the code wrote SPDR since last looked.
+ */
+static void test_commit (void)
+{
+   if (test_data & 0x80)
+      return;
+
+   if (test_busy) {
+      test_collisions++;
+      return;
+   }
+   if (test_bytes == 0)
+      test_first = test_cycles;
+   else if (test_cycles - test_prev < test_gap)
+      test_gap = test_cycles - test_prev;
+   test_busy = 1;
+   test_end  = test_cycles + test_byteCycles();
+   test_bytes++;
+
+   /* What comes back once it's clocked. */
+   test_data = 0x80 | test_bytes;
+}
+
+
+/**
+ * @brief Sets SPIF once the byte is done.
+ */
+static void test_update (void)
+{
+   if (test_busy && (test_cycles >= test_end)) {
+      test_busy = 0;
+      test_spif = 1;
+      test_prev = test_end;
+   }
+}
+
+
+static volatile uint8_t *test_spdr (void)
+{
+   test_commit();
+
+   /* Reading SPSR then touching SPDR clears SPIF. */
+   if (test_armed) {
+      test_spif  = 0;
+      test_armed = 0;
+   }
+   return &test_data;
+}
+
+
+static volatile uint8_t *test_spsr (void)
+{
+   test_commit();
+   test_cycles += TEST_POLL_CYCLES;
+   test_update();
+
+   test_status = (test_status & ~_BV(SPIF)) | (test_spif ? _BV(SPIF) : 0);
+   test_armed  = test_spif;
+   return &test_status;
+}
+
+
+/**
+ * @brief Sleeps through the bytes and runs the interrupts until the queue
+ *  is empty.
+ */
+static void test_wait (void)
+{
+   test_commit();
+   while (!spim_idle()) {
+      if (test_busy && (test_cycles < test_end))
+         test_cycles = test_end;
+      test_update();
+      if (!test_spif || !(SPCR & _BV(SPIE)) || !(SPCR & _BV(SPE))) {
+         TEST_CHECK( !"stuck without an interrupt" );
+         return;
+      }
+
+      /* Running the vector clears the flag. */
+      test_irqs++;
+      test_cycles += TEST_ISR_CYCLES;
+      test_spif    = 0;
+      test_armed   = 0;
+      cli();
+      SPI_STC_vect();
+      sei();
+      test_commit();
+   }
+}
+
+
+/**
+ * @brief Sends a frame on port 1 and checks what came back.
+ */
+static void test_send( uint8_t div, uint8_t gap, int len, test_frame_t *frame )
+{
+   int i;
+   char tx[ TEST_FRAME_MAX ], rx[ TEST_FRAME_MAX ];
+   spim_trans_t trans = { .port = 1, .tx = tx, .rx = rx };
+
+   for (i=0; i<len; i++)
+      tx[i] = i;
+   memset( rx, 0, sizeof(rx) );
+   trans.len = len;
+   spim_setSpeed( 1, div );
+   spim_setBurst( 1, gap );
+
+   test_cycles     = 0;
+   test_bytes      = 0;
+   test_irqs       = 0;
+   test_collisions = 0;
+   test_gap        = UINT32_MAX;
+   TEST_CHECK( spim_submit( &trans ) == 0 );
+   test_wait();
+
+   TEST_CHECK( test_bytes == len );
+   TEST_CHECK( test_collisions == 0 );
+   for (i=0; i<len; i++)
+      TEST_CHECK( (uint8_t)rx[i] == (0x80 | (i+1)) );
+   frame->cycles = test_cycles - test_first;
+   frame->irqs   = test_irqs;
+   frame->gap    = test_gap;
+}
+
+
+/**
+ * @brief Every divider clocks a byte in 16 << div cycles.
+ */
+static void test_clock (void)
+{
+   uint8_t div;
+   test_frame_t f;
+
+   for (div=SPIM_DIV_2; div<=SPIM_DIV_128; div++) {
+      test_send( div, SPIM_BURST_OFF, 1, &f );
+      TEST_CHECK( f.cycles == (16UL << div) + TEST_ISR_CYCLES );
+   }
+}
+
+
+/**
+ * @brief Short fast frames take a single interrupt and keep the gap.
+ */
+static void test_burst (void)
+{
+   int len;
+   test_frame_t f;
+
+   for (len=2; len<=SPIM_BURST_LEN; len++) {
+      test_send( SPIM_DIV_2, 2, len, &f );
+      TEST_CHECK( f.irqs == 1 );
+      TEST_CHECK( f.gap >= 2 * (F_CPU/1000000UL) );
+
+      /* No gap needed, back to back. */
+      test_send( SPIM_DIV_8, 0, len, &f );
+      TEST_CHECK( f.irqs == 1 );
+      TEST_CHECK( f.cycles <= (uint32_t)len*(64 + 2*TEST_POLL_CYCLES) + TEST_ISR_CYCLES );
+   }
+}
+
+
+/**
+ * @brief Frames that would poll too long, or ports that may not burst, take
+ *  an interrupt per byte.
+ */
+static void test_fallback (void)
+{
+   test_frame_t f;
+
+   test_send( SPIM_DIV_2, SPIM_BURST_OFF, 6, &f );
+   TEST_CHECK( f.irqs == 6 );
+
+   /* 9 bytes of 1024 cycles is way past SPIM_BURST_US. */
+   test_send( SPIM_DIV_128, 0, SPIM_BURST_LEN, &f );
+   TEST_CHECK( f.irqs == SPIM_BURST_LEN );
+
+   /* Fits when shorter. */
+   test_send( SPIM_DIV_16, 2, SPIM_BURST_LEN, &f );
+   TEST_CHECK( f.irqs == SPIM_BURST_LEN );
+   test_send( SPIM_DIV_16, 2, 4, &f );
+   TEST_CHECK( f.irqs == 1 );
+}
+
+
+/**
+ * @brief Transactions chained from the interrupt don't burst.
+ */
+static void test_chained (void)
+{
+   const char tx[4] = { 1, 2, 3, 4 };
+   spim_trans_t a = { .port = 1, .len = 4, .tx = tx };
+   spim_trans_t b = { .port = 1, .len = 4, .tx = tx };
+
+   spim_setSpeed( 1, SPIM_DIV_2 );
+   spim_setBurst( 1, 0 );
+   test_irqs = 0;
+   test_collisions = 0;
+   TEST_CHECK( spim_submit( &a ) == 0 );
+   TEST_CHECK( spim_submit( &b ) == 0 );
+   test_wait();
+   TEST_CHECK( test_irqs == 1 + 4 );
+   TEST_CHECK( test_collisions == 0 );
+}
+
+
+/**
+ * @brief Compares bursting against an interrupt a byte.
+ */
+static void test_bench (void)
+{
+   int len;
+   uint8_t div;
+   test_frame_t burst, irq;
+
+   for (div=SPIM_DIV_2; div<=SPIM_DIV_8; div++) {
+      for (len=4; len<=SPIM_BURST_LEN; len+=6) {
+         test_send( div, 0, len, &burst );
+         test_send( div, SPIM_BURST_OFF, len, &irq );
+         TEST_CHECK( burst.irqs < irq.irqs );
+         TEST_CHECK( burst.cycles < irq.cycles );
+         TEST_BENCH( "spim_hw", "fck/%d %d bytes, burst %lu cycles %d irqs, "
+               "per byte %lu cycles %d irqs", 2 << div, len,
+               (unsigned long)burst.cycles, burst.irqs,
+               (unsigned long)irq.cycles, irq.irqs );
+      }
+   }
+}
+
+
+int main (void)
+{
+   event_init();
+   spim_init();
+   TEST_RUN( test_clock );
+   TEST_RUN( test_burst );
+   TEST_RUN( test_fallback );
+   TEST_RUN( test_chained );
+   TEST_RUN( test_bench );
+   return TEST_EXIT();
+}
+
+
@@ -0,0 +1,402 @@
+
+
+#include "conf.h"
+
+/*
+ * Built once per SPI mode and pacing, see the Makefile.
+ */
+#undef SPIM_BACKEND
+#define SPIM_BACKEND       SPIM_BACKEND_SW
+#undef SPIM_SW_MODE
+#define SPIM_SW_MODE       TEST_MODE
+#undef SPIM_SW_PACED
+#define SPIM_SW_PACED      TEST_PACED
+
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/delay_basic.h>
+
+#include "event.h"
+#include "test.h"
+
+
+/*
+ * The pins of the software SPI and the slave selects go through a simulated
+ *  slave that works in the same mode.
+ */
+#define PORTB              (*test_port())
+#define PINB               (*test_pin())
+static volatile uint8_t *test_port (void);
+static volatile uint8_t *test_pin (void);
+
+
+#include "../spim.c"
+
+
+/*
+ * CPU cycles the model charges. Each pin access is an sbi, cbi or sbic, the
+ *  rest of the loop is charged when MISO is read so a bit costs the
+ *  2*SPI_OVERHEAD the backend budgets for. That figure is taken as given,
+ *  what gets checked is the delay and the edges around it.
+ */
+#define TEST_IO_CYCLES     2 /**< One pin access. */
+#define TEST_BIT_CYCLES    (2*SPI_OVERHEAD - 4*TEST_IO_CYCLES) /**< Rest of a bit. */
+#define TEST_FRAME_MAX     16 /**< Longest frame a test sends. */
+#define TEST_CPOL          ((TEST_MODE & 0x02) ? _BV(SWSPI_SCK) : 0) /**< SCK when idle. */
+#define TEST_CPHA          (TEST_MODE & 0x01) /**< Slave samples on the trailing edge. */
+
+
+/**
+ * @brief What the slave saw of a frame.
+ */
+typedef struct test_frame_s {
+   uint32_t periodMin; /**< Shortest clock period within a byte. */
+   uint32_t periodMax; /**< Longest clock period within a byte. */
+   uint32_t setup; /**< Shortest time MOSI was stable before it was sampled. */
+   uint32_t gap; /**< Shortest time from one byte to the next. */
+   uint32_t cycles; /**< From the first edge to the last. */
+} test_frame_t;
+
+
+static uint32_t test_cycles = 0; /**< CPU cycles modelled so far. */
+static uint32_t test_stamp = 0; /**< Cycle of the last pin access. */
+static uint8_t test_pins = 0; /**< PORTB as the code sees it. */
+static uint8_t test_last = 0; /**< PORTB as the slave last saw it. */
+static uint8_t test_in = 0; /**< PINB as the code sees it. */
+static uint8_t test_miso = 0; /**< Level the slave drives MISO to. */
+static uint8_t test_selected = 0; /**< Slave on port 1 is selected. */
+static int test_bits = 0; /**< Bits the slave sampled. */
+static int test_edges = 0; /**< Leading edges seen. */
+static uint8_t test_shift = 0; /**< Byte the slave is shifting in. */
+static uint8_t test_got[ TEST_FRAME_MAX ]; /**< What the slave received. */
+static uint8_t test_reply[ TEST_FRAME_MAX ]; /**< What the slave sends. */
+static uint32_t test_mosiAt = 0; /**< Cycle MOSI last changed. */
+static uint32_t test_leadAt = 0; /**< Cycle of the last leading edge. */
+static uint32_t test_edgeAt = 0; /**< Cycle of the last edge. */
+static uint32_t test_firstAt = 0; /**< Cycle of the first edge. */
+static int test_errors = 0; /**< Edges with no slave selected and selects with SCK active. */
+static test_frame_t test_seen; /**< What the slave saw so far. */
+
+
+/*
+ * Prototypes.
+ */
+#if SPIM_SW_PACED
+void TIMER2_COMPA_vect (void);
+#endif /* SPIM_SW_PACED */
+static void test_drive (void);
+static void test_sample (void);
+static void test_edge( uint8_t leading );
+static void test_commit (void);
+static void test_wait (void);
+static void test_send( uint8_t div, int len, test_frame_t *frame );
+static void test_clock (void);
+static void test_idle (void);
+static void test_queue (void);
+static void test_bench (void);
+
+
+uint32_t timer_now_us (void)
+{
+   return 0;
+}
+
+
+void wdog_start( uint8_t task, uint16_t timeout )
+{
+}
+
+
+void wdog_stop( uint8_t task )
+{
+}
+
+
+void wdog_kick( uint8_t task )
+{
+}
+
+
+/**
+ * @brief Counts the time of a busy loop.
+ */
+void _delay_loop_1( uint8_t count )
+{
+   test_commit();
+   test_cycles += 3 * ((count == 0) ? 256 : count);
+}
+
+
+/**
+ * @brief Slave puts out its next bit on MISO.
+ */
+static void test_drive (void)
+{
+   int bit;
+
+   bit       = test_bits % 8;
+   test_miso = (test_reply[ test_bits / 8 ] << bit) & 0x80;
+}
+
+
+/**
+ * @brief Slave samples MOSI.
+ */
+static void test_sample (void)
+{
+   if (test_stamp - test_mosiAt < test_seen.setup)
+      test_seen.setup = test_stamp - test_mosiAt;
+
+   test_shift = (test_shift << 1) | ((test_pins & _BV(SWSPI_MOSI)) ? 1 : 0);
+   test_bits++;
+   if (test_bits % 8 == 0)
+      test_got[ test_bits/8 - 1 ] = test_shift;
+}
+
+
+/**
+ * @brief Slave sees an edge of SCK.
+ */
+static void test_edge( uint8_t leading )
+{
+   /* Clocking for the slave on the other port is fine. */
+   if (!test_selected) {
+      if (test_pins & _BV(MOD2_SS_P))
+         test_errors++;
+      return;
+   }
+
+   if (test_edges == 0)
+      test_firstAt = test_stamp;
+   test_seen.cycles = test_stamp - test_firstAt;
+
+   if (leading) {
+      /* Period within a byte, gap between them. */
+      if (test_edges % 8 != 0) {
+         if (test_stamp - test_leadAt < test_seen.periodMin)
+            test_seen.periodMin = test_stamp - test_leadAt;
+         if (test_stamp - test_leadAt > test_seen.periodMax)
+            test_seen.periodMax = test_stamp - test_leadAt;
+      }
+      else if ((test_edges > 0) && (test_stamp - test_edgeAt < test_seen.gap))
+         test_seen.gap = test_stamp - test_edgeAt;
+      test_leadAt = test_stamp;
+      test_edges++;
+
+      if (TEST_CPHA)
+         test_drive();
+      else
+         test_sample();
+   }
+   else {
+      if (TEST_CPHA)
+         test_sample();
+      else if (test_bits < TEST_FRAME_MAX*8)
+         test_drive();
+   }
+   test_edgeAt = test_stamp;
+}
+
+
+/**
+ * @brief Shows the slave what the code did to the pins since last looked.
+ */
+static void test_commit (void)
+{
+   uint8_t changed;
+
+   changed   = test_pins ^ test_last;
+   test_last = test_pins;
+
+   if (changed & _BV(SWSPI_MOSI))
+      test_mosiAt = test_stamp;
+
+   /* Selecting with SCK active would shift a bit. */
+   if (changed & _BV(MOD1_SS_P)) {
+      if ((test_pins & _BV(SWSPI_SCK)) != TEST_CPOL)
+         test_errors++;
+      test_selected = !(test_pins & _BV(MOD1_SS_P));
+      if (test_selected && !TEST_CPHA)
+         test_drive();
+   }
+
+   if (changed & _BV(SWSPI_SCK))
+      test_edge( (test_pins & _BV(SWSPI_SCK)) != TEST_CPOL );
+}
+
+
+static volatile uint8_t *test_port (void)
+{
+   test_commit();
+   test_stamp   = test_cycles;
+   test_cycles += TEST_IO_CYCLES;
+   return &test_pins;
+}
+
+
+static volatile uint8_t *test_pin (void)
+{
+   test_commit();
+   test_stamp   = test_cycles;
+   test_cycles += TEST_IO_CYCLES + TEST_BIT_CYCLES;
+   test_in      = test_miso ? _BV(SWSPI_MISO) : 0;
+   return &test_in;
+}
+
+
+/**
+ * @brief Runs the pacing interrupts until the queue is empty.
+ */
+static void test_wait (void)
+{
+   test_commit();
+#if SPIM_SW_PACED
+   while (!spim_idle()) {
+      if (!(TIMSK2 & _BV(OCIE2A))) {
+         TEST_CHECK( !"stuck without an interrupt" );
+         return;
+      }
+
+      /* Timer runs out, 8 cycles a count. */
+      test_cycles += 8UL * (OCR2A + 1);
+      cli();
+      TIMER2_COMPA_vect();
+      sei();
+      test_commit();
+   }
+#endif /* SPIM_SW_PACED */
+}
+
+
+/**
+ * @brief Sends a frame on port 1 and checks both ends got the other's bytes.
+ */
+static void test_send( uint8_t div, int len, test_frame_t *frame )
+{
+   int i;
+   char tx[ TEST_FRAME_MAX ], rx[ TEST_FRAME_MAX ];
+   spim_trans_t trans = { .port = 1, .tx = tx, .rx = rx };
+
+   for (i=0; i<len; i++) {
+      tx[i]         = 0x5A ^ (i * 37);
+      test_reply[i] = 0xC3 ^ (i * 91);
+   }
+   memset( rx, 0, sizeof(rx) );
+   memset( test_got, 0, sizeof(test_got) );
+   trans.len = len;
+   spim_setSpeed( 1, div );
+
+   test_bits   = 0;
+   test_edges  = 0;
+   test_errors = 0;
+   test_seen.periodMin = UINT32_MAX;
+   test_seen.periodMax = 0;
+   test_seen.setup     = UINT32_MAX;
+   test_seen.gap       = UINT32_MAX;
+   test_seen.cycles    = 0;
+   TEST_CHECK( spim_submit( &trans ) == 0 );
+   test_wait();
+
+   TEST_CHECK( test_errors == 0 );
+   TEST_CHECK( test_bits == len*8 );
+   TEST_CHECK( memcmp( test_got, tx, len ) == 0 );
+   TEST_CHECK( memcmp( rx, test_reply, len ) == 0 );
+   *frame = test_seen;
+}
+
+
+/**
+ * @brief Every divider clocks at its rate or as fast as the loop goes, never
+ *  faster, and MOSI is set before the slave samples it.
+ */
+static void test_clock (void)
+{
+   uint8_t div;
+   uint32_t period, fastest;
+   test_frame_t f;
+
+   fastest = 2*SPI_OVERHEAD;
+   for (div=SPIM_DIV_2; div<=SPIM_DIV_128; div++) {
+      test_send( div, 4, &f );
+      period = 2UL << div;
+      TEST_CHECK( f.periodMin == f.periodMax );
+      TEST_CHECK( f.periodMin >= period );
+      TEST_CHECK( f.periodMax <= ((period > fastest) ? period : fastest) + 2*2 );
+      TEST_CHECK( f.setup >= TEST_IO_CYCLES );
+   }
+}
+
+
+/**
+ * @brief SCK idles between frames and both slaves end unselected.
+ */
+static void test_idle (void)
+{
+   test_frame_t f;
+
+   test_send( SPIM_DIV_16, 3, &f );
+   TEST_CHECK( (test_pins & _BV(SWSPI_SCK)) == TEST_CPOL );
+   TEST_CHECK( test_pins & _BV(MOD1_SS_P) );
+   TEST_CHECK( test_pins & _BV(MOD2_SS_P) );
+   TEST_CHECK( !test_selected );
+#if SPIM_SW_PACED
+   TEST_CHECK( !(TIMSK2 & _BV(OCIE2A)) );
+#endif /* SPIM_SW_PACED */
+}
+
+
+/**
+ * @brief Long frames keep the bytes apart when paced, queued frames follow.
+ */
+static void test_queue (void)
+{
+   test_frame_t f;
+   const char tx[2] = { 0x11, 0x22 };
+   spim_trans_t a = { .port = 2, .len = 2, .tx = tx };
+
+   test_send( SPIM_DIV_8, TEST_FRAME_MAX, &f );
+#if SPIM_SW_PACED
+   TEST_CHECK( 8UL * (OCR2A + 1) == SPIM_SW_GAP_US * (F_CPU/1000000UL) );
+   TEST_CHECK( f.gap >= SPIM_SW_GAP_US * (F_CPU/1000000UL) );
+#endif /* SPIM_SW_PACED */
+
+   /* Another port first, ours goes once it's done. */
+   spim_setSpeed( 2, SPIM_DIV_4 );
+   TEST_CHECK( spim_submit( &a ) == 0 );
+   test_send( SPIM_DIV_8, 2, &f );
+   TEST_CHECK( spim_idle() );
+}
+
+
+/**
+ * @brief Bit period and byte time at each divider.
+ */
+static void test_bench (void)
+{
+   uint8_t div;
+   test_frame_t f;
+
+   for (div=SPIM_DIV_2; div<=SPIM_DIV_128; div++) {
+      test_send( div, TEST_FRAME_MAX, &f );
+      TEST_BENCH( "spim_sw", "mode %d %s fck/%d, bit %lu cycles, %d bytes in "
+            "%lu cycles", SPIM_SW_MODE, SPIM_SW_PACED ? "paced" : "blocking",
+            2 << div, (unsigned long)f.periodMin, TEST_FRAME_MAX,
+            (unsigned long)f.cycles );
+   }
+}
+
+
+int main (void)
+{
+   event_init();
+   spim_init();
+   test_commit();
+   TEST_RUN( test_clock );
+   TEST_RUN( test_idle );
+   TEST_RUN( test_queue );
+   TEST_RUN( test_bench );
+   return TEST_EXIT();
+}
+
+
@@ -0,0 +1,341 @@
+
+
+#include "conf.h"
+
+#undef SPIM_BACKEND
+#define SPIM_BACKEND       SPIM_BACKEND_USART
+
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "event.h"
+#include "test.h"
+
+
+/*
+ * The data and status registers go through a fake USART in master SPI mode.
+ *  Bytes sent must have the top bit clear and bytes received have it set,
+ *  that's how a write to UDR1 is told apart from a read.
+ */
+#define UDR1               (*test_udr())
+#define UCSR1A             (*test_ucsra())
+static volatile uint8_t *test_udr (void);
+static volatile uint8_t *test_ucsra (void);
+
+
+#include "../spim.c"
+
+
+/*
+ * CPU cycles the model charges, rough counts and not measured.
+ */
+#define TEST_POLL_CYCLES   4 /**< One pass of polling UDRE1. */
+#define TEST_ISR_CYCLES    60 /**< Vector, prologue, body and epilogue of USART1_RX_vect. */
+#define TEST_FRAME_MAX     32 /**< Longest frame a test sends. */
+#define TEST_RX_FIFO       2 /**< Bytes the receiver holds before overrunning. */
+
+
+/**
+ * @brief What a frame cost.
+ */
+typedef struct test_frame_s {
+   uint32_t cycles; /**< From the first byte started to the last one handled. */
+   uint32_t idle; /**< Cycles the bus sat idle between bytes. */
+   int irqs; /**< Interrupts taken. */
+} test_frame_t;
+
+
+static uint32_t test_cycles = 0; /**< CPU cycles modelled so far. */
+static uint32_t test_first = 0; /**< Cycle the first byte was started. */
+static uint32_t test_end = 0; /**< Cycle the byte in the shift register is done. */
+static uint32_t test_idle = 0; /**< Cycles the bus sat idle between bytes. */
+static uint8_t test_busy = 0; /**< The shift register is clocking a byte. */
+static uint8_t test_queued = 0; /**< The transmit buffer holds a byte. */
+static uint8_t test_rx = 0; /**< Bytes waiting in the receiver. */
+static uint8_t test_offered = 0; /**< Last access to UDR1 may have been a read. */
+static uint8_t test_data = 0x80; /**< UDR1 as the code sees it. */
+static uint8_t test_status = 0; /**< UCSR1A as the code sees it. */
+static int test_sent = 0; /**< Bytes started so far. */
+static int test_recv = 0; /**< Bytes received so far. */
+static int test_read = 0; /**< Bytes read out of the receiver so far. */
+static int test_errors = 0; /**< Overruns, lost writes and reads of nothing. */
+static int test_irqs = 0; /**< Interrupts taken so far. */
+
+
+/*
+ * Prototypes.
+ */
+void USART1_RX_vect (void);
+static void test_start (void);
+static void test_update (void);
+static void test_commit (void);
+static void test_wait (void);
+static void test_send( uint8_t div, int len, test_frame_t *frame );
+static void test_clock (void);
+static void test_stream (void);
+static void test_starve (void);
+static void test_bench (void);
+
+
+uint32_t timer_now_us (void)
+{
+   return 0;
+}
+
+
+void wdog_start( uint8_t task, uint16_t timeout )
+{
+}
+
+
+void wdog_stop( uint8_t task )
+{
+}
+
+
+void wdog_kick( uint8_t task )
+{
+}
+
+
+/**
+ * @brief Starts shifting a byte out at test_cycles.
+ */
+static void test_start (void)
+{
+   if (test_sent == 0)
+      test_first = test_cycles;
+   test_busy = 1;
+   test_end  = test_cycles + 16UL * (UBRR1 + 1); /* 8 bits of fck/(2*(UBRR1+1)). */
+   test_sent++;
+}
+
+
+/**
+ * @brief Clocks the bytes done by now into the receiver, the transmit buffer
+ *  goes straight on if it holds one.
+ */
+static void test_update (void)
+{
+   while (test_busy && (test_cycles >= test_end)) {
+      if (test_rx < TEST_RX_FIFO)
+         test_rx++;
+      else
+         test_errors++;
+      test_recv++;
+
+      if (test_queued) {
+         test_queued = 0;
+         test_busy   = 1;
+         test_end   += 16UL * (UBRR1 + 1);
+         test_sent++;
+      }
+      else
+         test_busy = 0;
+   }
+}
+
+
+/**
+ * @brief Takes in what the code did with UDR1 since last looked.
+ */
+static void test_commit (void)
+{
+   test_update();
+   if (!test_offered)
+      return;
+   test_offered = 0;
+
+   /* Read, what was offered is gone. */
+   if (test_data & 0x80) {
+      if (test_rx > 0) {
+         test_rx--;
+         test_read++;
+      }
+      else
+         test_errors++;
+      return;
+   }
+
+   /* Write, shift it out or buffer it. */
+   test_data = 0x80;
+   if (!test_busy) {
+      if (test_sent > 0)
+         test_idle += test_cycles - test_end;
+      test_start();
+   }
+   else if (!test_queued)
+      test_queued = 1;
+   else
+      test_errors++;
+}
+
+
+static volatile uint8_t *test_udr (void)
+{
+   test_commit();
+
+   /* Oldest byte in the receiver, in case this is a read. */
+   test_offered = 1;
+   test_data    = 0x80 | (test_read + 1);
+   return &test_data;
+}
+
+
+static volatile uint8_t *test_ucsra (void)
+{
+   test_commit();
+   test_cycles += TEST_POLL_CYCLES;
+   test_update();
+
+   test_status = test_queued ? 0 : _BV(UDRE1);
+   return &test_status;
+}
+
+
+/**
+ * @brief Sleeps through the bytes and runs the receive interrupts until the
+ *  queue is empty.
+ */
+static void test_wait (void)
+{
+   test_commit();
+   while (!spim_idle()) {
+      if (test_rx == 0) {
+         if (!test_busy) {
+            TEST_CHECK( !"stuck without an interrupt" );
+            return;
+         }
+         test_cycles = test_end;
+         test_update();
+      }
+
+      /* Bytes keep shifting while the vector runs. */
+      test_irqs++;
+      test_cycles += TEST_ISR_CYCLES;
+      test_update();
+      cli();
+      USART1_RX_vect();
+      sei();
+      test_commit();
+   }
+}
+
+
+/**
+ * @brief Sends a frame on port 1 and checks what came back.
+ */
+static void test_send( uint8_t div, int len, test_frame_t *frame )
+{
+   int i;
+   char tx[ TEST_FRAME_MAX ], rx[ TEST_FRAME_MAX ];
+   spim_trans_t trans = { .port = 1, .tx = tx, .rx = rx };
+
+   for (i=0; i<len; i++)
+      tx[i] = i;
+   memset( rx, 0, sizeof(rx) );
+   trans.len = len;
+   spim_setSpeed( 1, div );
+
+   test_cycles = 0;
+   test_idle   = 0;
+   test_sent   = 0;
+   test_recv   = 0;
+   test_read   = 0;
+   test_errors = 0;
+   test_irqs   = 0;
+   TEST_CHECK( spim_submit( &trans ) == 0 );
+   test_wait();
+
+   TEST_CHECK( (test_sent == len) && (test_recv == len) && (test_read == len) );
+   TEST_CHECK( test_errors == 0 );
+   TEST_CHECK( test_irqs == len );
+   for (i=0; i<len; i++)
+      TEST_CHECK( (uint8_t)rx[i] == (0x80 | (i+1)) );
+   frame->cycles = test_cycles - test_first;
+   frame->idle   = test_idle;
+   frame->irqs   = test_irqs;
+}
+
+
+/**
+ * @brief Every divider clocks a byte in 16 << div cycles.
+ */
+static void test_clock (void)
+{
+   uint8_t div;
+   test_frame_t f;
+
+   for (div=SPIM_DIV_2; div<=SPIM_DIV_128; div++) {
+      test_send( div, 1, &f );
+      TEST_CHECK( f.cycles == (16UL << div) + TEST_ISR_CYCLES );
+   }
+}
+
+
+/**
+ * @brief With a byte time longer than the interrupt the transmit buffer is
+ *  refilled before it runs dry, bytes go out back to back.
+ */
+static void test_stream (void)
+{
+   uint8_t div;
+   int len;
+   test_frame_t f;
+
+   for (div=SPIM_DIV_8; div<=SPIM_DIV_128; div++) {
+      for (len=2; len<=TEST_FRAME_MAX; len+=10) {
+         test_send( div, len, &f );
+         TEST_CHECK( f.idle == 0 );
+         TEST_CHECK( f.cycles == len*(16UL << div) + TEST_ISR_CYCLES );
+      }
+   }
+}
+
+
+/**
+ * @brief Faster than the interrupt the bus idles but nothing is lost.
+ */
+static void test_starve (void)
+{
+   test_frame_t f;
+
+   test_send( SPIM_DIV_2, TEST_FRAME_MAX, &f );
+   TEST_CHECK( f.idle > 0 );
+   test_send( SPIM_DIV_4, TEST_FRAME_MAX, &f );
+   TEST_CHECK( f.idle > 0 );
+}
+
+
+/**
+ * @brief Throughput of a long frame at each divider.
+ */
+static void test_bench (void)
+{
+   uint8_t div;
+   test_frame_t f;
+
+   for (div=SPIM_DIV_2; div<=SPIM_DIV_128; div++) {
+      test_send( div, TEST_FRAME_MAX, &f );
+      TEST_BENCH( "spim_usart", "fck/%d %d bytes, %lu cycles, %lu kB/s, "
+            "bus idle %lu cycles", 2 << div, TEST_FRAME_MAX,
+            (unsigned long)f.cycles,
+            (unsigned long)(TEST_FRAME_MAX * (F_CPU/1000UL) / f.cycles),
+            (unsigned long)f.idle );
+   }
+}
+
+
+int main (void)
+{
+   event_init();
+   spim_init();
+   TEST_RUN( test_clock );
+   TEST_RUN( test_stream );
+   TEST_RUN( test_starve );
+   TEST_RUN( test_bench );
+   return TEST_EXIT();
+}
+
+
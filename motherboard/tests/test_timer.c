@@ -0,0 +1,570 @@
+
+
+#include "conf.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "event.h"
+#include "timer.h"
+#include "wdog.h"
+#include "test.h"
+
+
+#define TEST_FIRED_MAX  32 /**< Most expiries a test keeps track of. */
+
+
+/**
+ * @brief A timer that went off.
+ */
+typedef struct test_fired_s {
+   uint8_t id; /**< Identifier of the timer. */
+   uint16_t tick; /**< Tick it went off on. */
+} test_fired_t;
+
+
+static test_fired_t test_fired[ TEST_FIRED_MAX ]; /**< Expiries seen so far. */
+static int test_nfired = 0; /**< Amount of expiries seen. */
+static int test_calls = 0; /**< Times the callback was run. */
+static int test_visits = 0; /**< List nodes visited by the tick so far. */
+static uint16_t test_fed = 0; /**< Tick the watchdog was last checked on. */
+static uint16_t test_starved = 0; /**< Most ticks between watchdog checks. */
+
+
+/*
+ * Prototypes.
+ */
+void TIMER0_COMPA_vect (void);
+void test_visit (void);
+static void test_reset (void);
+static void test_fire (void);
+static void test_run( uint16_t ticks );
+static int test_wake( uint16_t ticks );
+static void test_func( int id );
+static void test_order (void);
+static void test_periodic (void);
+static void test_stop (void);
+static void test_alloc (void);
+static void test_callback (void);
+static void test_invalid (void);
+static void test_cost (void);
+static void test_clock (void);
+#if TIMER_TICKLESS
+static void test_span (void);
+static void test_ahead (void);
+static void test_epoch (void);
+static void test_wakeups (void);
+#endif /* TIMER_TICKLESS */
+
+
+void wdog_check( uint16_t now )
+{
+   if ((uint16_t)(now - test_fed) > test_starved)
+      test_starved = now - test_fed;
+   test_fed = now;
+}
+
+
+/**
+ * @brief Counts a list node visited by the tick, see TIMER_VISIT.
+ */
+void test_visit (void)
+{
+   test_visits++;
+}
+
+
+/**
+ * @brief Starts over with a fresh timer and event queue.
+ */
+static void test_reset (void)
+{
+   event_init();
+   timer_init();
+   /* Flags clear by writing ones, here that would leave them set. */
+   TIFR0      = 0;
+   TCNT0      = 0;
+   timer_tick = 0;
+   test_nfired  = 0;
+   test_calls   = 0;
+   test_fed     = 0;
+   test_starved = 0;
+}
+
+
+/**
+ * @brief Fakes the compare going off, the counter clears and the flag gets
+ *  cleared as the vector runs.
+ */
+static void test_fire (void)
+{
+   event_t evt;
+
+   TCNT0 = 0;
+   TIFR0 = 0;
+   cli();
+   TIMER0_COMPA_vect();
+   sei();
+
+   while (event_poll( &evt )) {
+      if ((evt.type != EVENT_TYPE_TIMER) || (test_nfired >= TEST_FIRED_MAX))
+         continue;
+      test_fired[ test_nfired ].id   = evt.timer.timer;
+      test_fired[ test_nfired ].tick = timer_ticks();
+      test_nfired++;
+   }
+}
+
+
+/**
+ * @brief Runs compares until at least some ticks have gone by.
+ */
+static void test_run( uint16_t ticks )
+{
+   uint16_t end;
+
+   end = timer_ticks() + ticks;
+   while ((int16_t)(end - timer_ticks()) > 0)
+      test_fire();
+}
+
+
+/**
+ * @brief Runs compares like test_run and counts them.
+ */
+static int test_wake( uint16_t ticks )
+{
+   int fires;
+   uint16_t end;
+
+   fires = 0;
+   end   = timer_ticks() + ticks;
+   while ((int16_t)(end - timer_ticks()) > 0) {
+      test_fire();
+      fires++;
+   }
+   return fires;
+}
+
+
+static void test_func( int id )
+{
+   test_calls++;
+}
+
+
+/**
+ * @brief Timers go off on their tick, in order, ties in the order started.
+ */
+static void test_order (void)
+{
+   int a, b, c, d;
+   uint16_t base;
+
+   test_reset();
+   a = timer_alloc( 10, NULL );
+   b = timer_alloc( 11, NULL );
+   c = timer_alloc( 12, NULL );
+   d = timer_alloc( 13, NULL );
+   timer_start( c, 5 );
+   timer_start( a, 2 );
+   timer_start( b, 5 );
+   timer_start( d, 9 );
+
+   test_run( 20 );
+   TEST_CHECK( test_nfired == 4 );
+   TEST_CHECK( (test_fired[0].id == 10) && (test_fired[0].tick == 2) );
+   TEST_CHECK( (test_fired[1].id == 12) && (test_fired[1].tick == 5) );
+   TEST_CHECK( (test_fired[2].id == 11) && (test_fired[2].tick == 5) );
+   TEST_CHECK( (test_fired[3].id == 13) && (test_fired[3].tick == 9) );
+
+   /* Restarting moves it in the list. */
+   test_nfired = 0;
+   base        = timer_ticks();
+   timer_start( a, 4 );
+   timer_start( b, 2 );
+   timer_start( a, 1 );
+   test_run( 10 );
+   TEST_CHECK( test_nfired == 2 );
+   TEST_CHECK( (test_fired[0].id == 10) && (test_fired[0].tick == base+1) );
+   TEST_CHECK( (test_fired[1].id == 11) && (test_fired[1].tick == base+2) );
+}
+
+
+/**
+ * @brief Periodic timers rearm from their expiry and don't drift.
+ */
+static void test_periodic (void)
+{
+   int i, a, b;
+
+   test_reset();
+   a = timer_alloc( 1, NULL );
+   b = timer_alloc( 2, NULL );
+   timer_periodic( a, 4 );
+   test_run( 3 );
+   timer_periodic( b, 6 );
+
+   test_run( 24 );
+   TEST_CHECK( test_nfired == 10 );
+   for (i=0; i<test_nfired; i++) {
+      if (test_fired[i].id == 1)
+         TEST_CHECK( test_fired[i].tick % 4 == 0 );
+      else
+         TEST_CHECK( (test_fired[i].tick - 3) % 6 == 0 );
+   }
+   TEST_CHECK( (test_fired[0].id == 1) && (test_fired[0].tick == 4) );
+   TEST_CHECK( (test_fired[2].id == 2) && (test_fired[2].tick == 9) );
+}
+
+
+/**
+ * @brief Stopped and freed timers leave the list and don't go off.
+ */
+static void test_stop (void)
+{
+   int a, b, c;
+
+   test_reset();
+   a = timer_alloc( 1, NULL );
+   b = timer_alloc( 2, NULL );
+   c = timer_alloc( 3, NULL );
+   timer_start( a, 3 );
+   timer_start( b, 6 );
+   timer_periodic( c, 8 );
+
+   /* Whoever follows keeps its deadline. */
+   timer_stop( a );
+   timer_free( c );
+   test_run( 20 );
+   TEST_CHECK( test_nfired == 1 );
+   TEST_CHECK( (test_fired[0].id == 2) && (test_fired[0].tick == 6) );
+
+   /* Starting with 0 stops too. */
+   test_nfired = 0;
+   timer_start( b, 3 );
+   timer_start( b, 0 );
+   test_run( 10 );
+   TEST_CHECK( test_nfired == 0 );
+}
+
+
+/**
+ * @brief Identifiers are unique and slots get reused.
+ */
+static void test_alloc (void)
+{
+   int i, t;
+
+   test_reset();
+   TEST_CHECK( timer_alloc( 1, NULL ) != TIMER_INVALID );
+   TEST_CHECK( timer_alloc( 1, NULL ) == TIMER_INVALID );
+   for (i=2; i<=TIMER_MAX; i++)
+      TEST_CHECK( timer_alloc( i, NULL ) != TIMER_INVALID );
+   TEST_CHECK( timer_alloc( 100, NULL ) == TIMER_INVALID );
+
+   timer_free( 3 );
+   t = timer_alloc( 100, NULL );
+   TEST_CHECK( t == 3 );
+   timer_exit();
+}
+
+
+/**
+ * @brief Callbacks get run when the event is dispatched.
+ */
+static void test_callback (void)
+{
+   int a;
+
+   test_reset();
+   a = timer_alloc( 5, test_func );
+   timer_periodic( a, 2 );
+   test_run( 6 );
+   TEST_CHECK( test_calls == 3 );
+   TEST_CHECK( test_nfired == 3 );
+
+   /* Freeing drops the subscription. */
+   timer_free( a );
+   a = timer_alloc( 5, NULL );
+   timer_start( a, 1 );
+   test_run( 2 );
+   TEST_CHECK( test_calls == 3 );
+   TEST_CHECK( test_nfired == 4 );
+}
+
+
+/**
+ * @brief Handles that were never allocated are ignored.
+ */
+static void test_invalid (void)
+{
+   int a;
+
+   test_reset();
+   a = timer_alloc( 1, NULL );
+   timer_start( a, 2 );
+   timer_free( TIMER_INVALID );
+   timer_free( TIMER_MAX );
+   timer_start( TIMER_INVALID, 1 );
+   timer_periodic( TIMER_MAX, 1 );
+   timer_stop( TIMER_INVALID );
+   test_run( 4 );
+   TEST_CHECK( test_nfired == 1 );
+}
+
+
+/**
+ * @brief The tick visits the same amount of nodes however many are armed.
+ */
+static void test_cost (void)
+{
+   int i, n, most, fires;
+   int t[ TIMER_MAX ];
+   uint16_t end;
+
+   for (n=1; n<=TIMER_MAX; n++) {
+      test_reset();
+      for (i=0; i<n; i++) {
+         t[i] = timer_alloc( i, NULL );
+         timer_start( t[i], 2*n - 2*i + 1 );
+      }
+
+      /* Worst tick until they all went off. */
+      most  = 0;
+      fires = 0;
+      end   = 2*n + 2;
+      while ((int16_t)(end - timer_ticks()) > 0) {
+         test_visits = 0;
+         test_fire();
+         if (test_visits > most)
+            most = test_visits;
+         fires++;
+      }
+      TEST_CHECK( test_nfired == n );
+
+      /* The one going off and the one counting down next. */
+      TEST_CHECK( most == ((n == 1) ? 1 : 2) );
+      if ((n == 1) || (n == TIMER_MAX))
+         TEST_BENCH( "timer", "%d armed, %d compares, at most %d nodes per tick",
+               n, fires, most );
+   }
+}
+
+
+/**
+ * @brief Ticks and microseconds follow the compares and the counter.
+ */
+static void test_clock (void)
+{
+   int a;
+
+   test_reset();
+   a = timer_alloc( 1, NULL );
+   timer_periodic( a, 10 );
+   test_run( 10 );
+   TEST_CHECK( timer_ticks() == 10 );
+   TEST_CHECK( timer_now_us() == 9856 );
+
+   /* Counter adds 12.8 us a count, whole ticks to the tick count. */
+   TCNT0 = 154;
+   TEST_CHECK( timer_ticks() == 12 );
+   TEST_CHECK( timer_now_us() == 9856 + 1971 );
+
+   /* Compare went off but the interrupt didn't run yet. */
+   TCNT0 = 5;
+   TIFR0 = _BV(OCF0A);
+   TEST_CHECK( timer_ticks() == 10 + TIMER_SPAN_MAX );
+   TEST_CHECK( timer_now_us() == 9856 + (TIMER_SPAN_MAX*TIMER_TICK_COUNTS + 5) * 64 / 5 );
+   TIFR0 = 0;
+   TCNT0 = 0;
+}
+
+
+#if TIMER_TICKLESS
+/**
+ * @brief The compare spans up to the next deadline, a whole epoch if far.
+ */
+static void test_span (void)
+{
+   int a, b;
+
+   test_reset();
+   a = timer_alloc( 1, NULL );
+   b = timer_alloc( 2, NULL );
+
+   /* Nothing due sleeps as long as it can. */
+   test_fire();
+   TEST_CHECK( timer_epoch && (TCCR0B == (_BV(CS02) | _BV(CS00))) );
+   TEST_CHECK( OCR0A == TIMER_SPAN_MAX*TIMER_TICK_COUNTS - 1 );
+   TEST_CHECK( timer_ticks() == 1 );
+   test_fire();
+   TEST_CHECK( timer_ticks() == 1 + TIMER_EPOCH_SPAN );
+
+   /* Deadlines bring it in. */
+   timer_start( a, 2 );
+   TEST_CHECK( !timer_epoch && (TCCR0B == _BV(CS02)) );
+   TEST_CHECK( OCR0A == 2*TIMER_TICK_COUNTS - 1 );
+   timer_start( b, 1 );
+   TEST_CHECK( OCR0A == TIMER_TICK_COUNTS - 1 );
+
+   /* Not as far as an epoch, every TIMER_SPAN_MAX. */
+   timer_stop( a );
+   timer_stop( b );
+   timer_start( a, TIMER_EPOCH_SPAN + 1 );
+   test_fire();
+   TEST_CHECK( !timer_epoch );
+   TEST_CHECK( OCR0A == TIMER_SPAN_MAX*TIMER_TICK_COUNTS - 1 );
+
+   /* Far away deadlines sleep in epochs. */
+   timer_start( a, 1000 );
+   test_fire();
+   TEST_CHECK( timer_epoch );
+
+   /* A pending compare gets to program the next one itself. */
+   TIFR0 = _BV(OCF0A);
+   timer_start( b, 1 );
+   TEST_CHECK( timer_epoch );
+   TEST_CHECK( OCR0A == TIMER_SPAN_MAX*TIMER_TICK_COUNTS - 1 );
+   TIFR0 = 0;
+}
+
+
+/**
+ * @brief The compare never goes behind the counter.
+ */
+static void test_ahead (void)
+{
+   int a, b;
+
+   test_reset();
+   a = timer_alloc( 1, NULL );
+   b = timer_alloc( 2, NULL );
+   timer_start( b, 10 );
+   test_fire();
+
+   /* Counts from the last compare, not from now. */
+   TCNT0 = 100;
+   timer_start( a, 1 );
+   TEST_CHECK( OCR0A == 2*TIMER_TICK_COUNTS - 1 );
+
+   /* Too close to the end of its tick, go to the one after. */
+   timer_stop( a );
+   TCNT0 = 2*TIMER_TICK_COUNTS - 2;
+   timer_start( a, 1 );
+   TEST_CHECK( OCR0A == 3*TIMER_TICK_COUNTS - 1 );
+
+   /* Late but not lost. */
+   test_fire();
+   TEST_CHECK( test_nfired == 1 );
+}
+
+
+/**
+ * @brief Epochs count four times slower, deadlines cut them short.
+ */
+static void test_epoch (void)
+{
+   int a;
+   uint16_t base;
+   uint32_t us;
+
+   test_reset();
+   a = timer_alloc( 1, NULL );
+   test_fire();
+   base = timer_ticks();
+   us   = timer_now_us();
+   TEST_CHECK( timer_epoch );
+
+   /* 100 counts of 51.2 us are 5 ticks and 15 counts of 12.8 us. */
+   TCNT0 = 100;
+   TEST_CHECK( timer_ticks() == base + 5 );
+   TEST_CHECK( timer_now_us() == us + 5120 );
+   TEST_CHECK( TIMER_STAMP() == (uint16_t)(((base + 5) << 8) | 15) );
+
+   /* Deadline past the end of the epoch leaves it be. */
+   timer_start( a, 100 );
+   TEST_CHECK( timer_epoch && (TCNT0 == 100) );
+
+   /* Deadline within it takes the ticks gone by and goes back to 256. */
+   timer_start( a, 2 );
+   TEST_CHECK( !timer_epoch && (TCCR0B == _BV(CS02)) );
+   TEST_CHECK( TCNT0 == 15 );
+   TEST_CHECK( timer_ticks() == base + 5 );
+   TEST_CHECK( timer_now_us() == us + 5120 );
+   TEST_CHECK( OCR0A == 2*TIMER_TICK_COUNTS - 1 );
+   test_fire();
+   TEST_CHECK( (test_nfired == 1) && (test_fired[0].tick == base + 7) );
+
+   /* Back in an epoch after it, ticks stay whole. */
+   TEST_CHECK( timer_epoch );
+   test_run( 1000 );
+   TEST_CHECK( timer_now_us() == (uint32_t)timer_ticks() * 9856 / 10 );
+   TEST_CHECK( test_starved == TIMER_EPOCH_SPAN );
+}
+
+
+/**
+ * @brief Idle and the behaviour timers wake far less than every tick.
+ *
+ * Models a second of avoid (two 500 ms periodic timers) and testdhb (250 ms
+ *  setup and a 100 ms poll rearmed on expiry, like a periodic one).
+ */
+static void test_wakeups (void)
+{
+   int a, b, idle, avoid, dhb;
+
+   test_reset();
+   test_fire();
+   idle = test_wake( 1000 );
+   TEST_CHECK( idle <= 1000/TIMER_EPOCH_SPAN + 1 );
+   TEST_CHECK( test_starved <= TIMER_EPOCH_SPAN );
+
+   test_reset();
+   a = timer_alloc( 1, NULL );
+   b = timer_alloc( 2, NULL );
+   timer_periodic( a, 500 );
+   timer_periodic( b, 500 );
+   test_fire();
+   avoid = test_wake( 1000 );
+   TEST_CHECK( test_nfired == 4 );
+   TEST_CHECK( avoid <= idle + 2*2 );
+   TEST_CHECK( test_starved <= TIMER_EPOCH_SPAN );
+
+   test_reset();
+   a = timer_alloc( 1, NULL );
+   b = timer_alloc( 2, NULL );
+   timer_start( a, 250 );
+   timer_periodic( b, 100 );
+   test_fire();
+   dhb = test_wake( 1000 );
+   TEST_CHECK( test_nfired == 11 );
+   TEST_CHECK( dhb <= idle + 11*2 );
+   TEST_CHECK( test_starved <= TIMER_EPOCH_SPAN );
+
+   TEST_BENCH( "timer", "wakeups a second, idle %d, avoid %d, testdhb %d, "
+         "tick %d, span %d", idle, avoid, dhb, 1000, 1000/TIMER_SPAN_MAX );
+}
+#endif /* TIMER_TICKLESS */
+
+
+int main (void)
+{
+   TEST_RUN( test_order );
+   TEST_RUN( test_periodic );
+   TEST_RUN( test_stop );
+   TEST_RUN( test_alloc );
+   TEST_RUN( test_callback );
+   TEST_RUN( test_invalid );
+   TEST_RUN( test_cost );
+   TEST_RUN( test_clock );
+#if TIMER_TICKLESS
+   TEST_RUN( test_span );
+   TEST_RUN( test_ahead );
+   TEST_RUN( test_epoch );
+   TEST_RUN( test_wakeups );
+#endif /* TIMER_TICKLESS */
+   return TEST_EXIT();
+}
+
+
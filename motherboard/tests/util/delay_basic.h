@@ -0,0 +1,19 @@
+
+
+#ifndef _HOST_UTIL_DELAY_BASIC_H
+#  define _HOST_UTIL_DELAY_BASIC_H
+
+
+#include <stdint.h>
+
+
+/*
+ * Busy loops take 3 cycles an iteration, the tests that use them define it to
+ *  count the time instead of spending it.
+ */
+void _delay_loop_1( uint8_t count );
+
+
+#endif /* _HOST_UTIL_DELAY_BASIC_H */
+
+
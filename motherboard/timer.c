@@ -1,24 +1,70 @@
 
 
+#include "conf.h"
+
 #include "timer.h"
 
 #include <string.h>
 #include <stdint.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
-#include <avr/wdt.h>
 
 #include "uart.h"
 #include "event.h"
+#include "wdog.h"
+
+
+#define TIMER_NONE         0xFF /**< End of the timer list. */
+#define TIMER_FLAG_USED    (1<<0) /**< Timer is allocated. */
+#define TIMER_FLAG_ARMED   (1<<1) /**< Timer is in the list. */
+
+
+/*
+ * The host tests count the list nodes the tick visits.
+ */
+#ifdef TIMER_VISIT
+void TIMER_VISIT (void);
+#else /* TIMER_VISIT */
+#define TIMER_VISIT()
+#endif /* TIMER_VISIT */
 
 
 typedef volatile struct timer_s {
-   uint16_t left;
-   void (*func)(int);
+   uint16_t delta; /**< Ticks left after the previous timer in the list expires. */
+   uint16_t period; /**< Period for periodic timers, 0 for one shot. */
+   uint8_t prev; /**< Previous timer in the list. */
+   uint8_t next; /**< Next timer in the list. */
+   uint8_t id; /**< Identifier reported in the events. */
+   uint8_t flags; /**< Timer flags. */
+   void (*func)(int); /**< Callback. */
 } timer_t;
 
 
-static timer_t timers[ MAX_TIMERS ];
+static timer_t timers[ TIMER_MAX ];
+static volatile uint8_t timer_head = TIMER_NONE; /**< Timer expiring first. */
+volatile uint16_t timer_tick = 0; /**< Ticks elapsed at the last compare, wraps around. */
+volatile uint8_t timer_epoch = 0; /**< TIMER0 runs at the 1024 prescaler. */
+static volatile uint8_t timer_span = 1; /**< Ticks spanned by the programmed compare. */
+static volatile uint32_t timer_us = 0; /**< Microseconds elapsed at the last compare. */
+static volatile uint8_t timer_usFrac = 0; /**< Fifths of microsecond left over in timer_us. */
+static event_sub_t timer_subs[ TIMER_MAX ]; /**< Runs the timer callbacks. */
+
+
+/*
+ * Prototypes.
+ */
+static int timer_callback( event_t *evt );
+static void timer_insert( uint8_t t, uint16_t ticks );
+static void timer_unlink( uint8_t t );
+static void timer_arm( int timer, uint16_t ms, uint16_t period );
+static void timer_advance( uint8_t ticks );
+static uint16_t timer_counts (void);
+static uint8_t timer_pending (void);
+#if TIMER_TICKLESS
+static void timer_setEpoch( uint8_t on );
+static void timer_cut (void);
+static void timer_program (void);
+#endif /* TIMER_TICKLESS */
 
 
 /**
@@ -26,31 +72,268 @@ static timer_t timers[ MAX_TIMERS ];
  */
 ISR( TIMER0_COMPA_vect )
 {
-   int i;
+   uint8_t t, left;
    event_t evt;
 
-   /* Reset watchdog. */
-   wdt_reset();
-
-   for (i=0; i<MAX_TIMERS; i++) {
-      /* Only interested in active timers. */
-      if (timers[i].left == 0)
-         continue;
-
-      /* Decrement timer. */
-      timers[i].left--;
-      if (timers[i].left > 0)
-         continue;
-  
-      /* Run callback if exists. */
-      if (timers[i].func != NULL)
-         timers[i].func( i );
-   
-      /* Push event. */
+   /* Advance by the ticks the compare spanned. */
+   left = timer_span;
+   timer_advance( left );
+
+   /* Feed the watchdog if all the tasks are live. */
+   wdog_check( timer_tick );
+
+   /* Fire all the timers expiring in the span, only the head counts down. */
+   while ((t = timer_head) != TIMER_NONE) {
+      TIMER_VISIT();
+      if (timers[t].delta > left) {
+         timers[t].delta -= left;
+         break;
+      }
+      left -= timers[t].delta;
+      timers[t].delta = 0;
+      timer_unlink( t );
+
+      /* Rearm from the tick it expired so periodic timers don't drift. */
+      if (timers[t].period > 0)
+         timer_insert( t, timers[t].period );
+
+      /* Push event, callback gets run when it's dispatched. */
       evt.type          = EVENT_TYPE_TIMER;
-      evt.timer.timer   = i;
+      evt.timer.timer   = timers[t].id;
+      evt.timer.count   = 1;
+      evt.timer.handle  = t;
       event_push( &evt );
    }
+
+#if TIMER_TICKLESS
+   /* Sleep until the next deadline, a whole epoch if none is near. */
+   if ((timer_head == TIMER_NONE) ||
+         (timers[ timer_head ].delta >= TIMER_EPOCH_SPAN)) {
+      timer_setEpoch( 1 );
+      timer_span = TIMER_EPOCH_SPAN;
+      OCR0A      = TIMER_SPAN_MAX * TIMER_TICK_COUNTS - 1;
+   }
+   else {
+      timer_setEpoch( 0 );
+      timer_program();
+   }
+#endif /* TIMER_TICKLESS */
+}
+
+
+/**
+ * @brief Advances the tick count and the microsecond clock.
+ *
+ * Must be called with interrupts disabled.
+ *
+ *    @param ticks Ticks to advance by.
+ */
+static void timer_advance( uint8_t ticks )
+{
+   timer_tick   += ticks;
+   timer_us     += (uint16_t)ticks * TIMER_TICK_US;
+   timer_usFrac += ticks * TIMER_TICK_US_FRAC;
+   while (timer_usFrac >= 5) {
+      timer_usFrac -= 5;
+      timer_us++;
+   }
+}
+
+
+/**
+ * @brief Gets the 12.8 us counts elapsed since timer_tick was last updated.
+ *
+ * Must be called with interrupts disabled.
+ *
+ *    @return Counts elapsed since the last compare was handled.
+ */
+static uint16_t timer_counts (void)
+{
+   uint16_t counts, cnt;
+
+   counts = 0;
+   cnt    = TCNT0;
+
+   /* Compare hit but interrupt not run yet, counter has been cleared. */
+   if (TIFR0 & _BV(OCF0A)) {
+      counts = timer_span * TIMER_TICK_COUNTS;
+      cnt    = TCNT0;
+   }
+
+   /* Epochs count four times slower. */
+   if (timer_epoch)
+      cnt *= TIMER_EPOCH_SCALE;
+
+   return counts + cnt;
+}
+
+
+/**
+ * @brief Gets the ticks elapsed since timer_tick was last updated.
+ *
+ * Must be called with interrupts disabled.
+ *
+ *    @return Ticks elapsed since the last compare was handled.
+ */
+static uint8_t timer_pending (void)
+{
+   return timer_counts() / TIMER_TICK_COUNTS;
+}
+
+
+#if TIMER_TICKLESS
+/**
+ * @brief Switches TIMER0 in or out of an epoch.
+ *
+ * Must be called with interrupts disabled, right after a compare so the count
+ *  carried over is small. The prescaler keeps running so up to one count of
+ *  the new rate is lost or gained.
+ *
+ *    @param on Whether to run at the 1024 prescaler.
+ */
+static void timer_setEpoch( uint8_t on )
+{
+   if (on == timer_epoch)
+      return;
+
+   timer_epoch = on;
+   if (on) {
+      TCCR0B = _BV(CS02) | _BV(CS00); /* 1024 prescaler. */
+      TCNT0  = TCNT0 / TIMER_EPOCH_SCALE;
+   }
+   else {
+      TCCR0B = _BV(CS02); /* 256 prescaler. */
+      TCNT0  = TCNT0 * TIMER_EPOCH_SCALE;
+   }
+}
+
+
+/**
+ * @brief Ends the running epoch early when a deadline comes in.
+ *
+ * Must be called with interrupts disabled and no compare pending. The whole
+ *  ticks the epoch ran are accounted for as if a compare had hit, the rest
+ *  stays in TCNT0 at the 256 prescaler.
+ */
+static void timer_cut (void)
+{
+   uint16_t counts;
+   uint8_t ticks;
+
+   counts = TCNT0 * TIMER_EPOCH_SCALE;
+   ticks  = counts / TIMER_TICK_COUNTS;
+
+   /* Nothing is due within the epoch so the head can't expire here. */
+   timer_advance( ticks );
+   timers[ timer_head ].delta -= ticks;
+
+   timer_epoch = 0;
+   TCCR0B      = _BV(CS02); /* 256 prescaler. */
+   TCNT0       = counts - ticks * TIMER_TICK_COUNTS;
+}
+
+
+/**
+ * @brief Programs the compare for the next deadline.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void timer_program (void)
+{
+   uint8_t span, min;
+
+   /* Interrupt is pending and will program the next compare. */
+   if (TIFR0 & _BV(OCF0A))
+      return;
+
+   /* Epoch runs to its end unless something is due before. */
+   if (timer_epoch) {
+      if ((timer_head == TIMER_NONE) ||
+            (timers[ timer_head ].delta >= timer_span))
+         return;
+      timer_cut();
+   }
+
+   span = TIMER_SPAN_MAX;
+   if ((timer_head != TIMER_NONE) && (timers[ timer_head ].delta < span))
+      span = timers[ timer_head ].delta;
+
+   /* Compare must stay ahead of the counter or it would wrap around. */
+   min = (TCNT0 + 2 + TIMER_TICK_COUNTS) / TIMER_TICK_COUNTS;
+   if (span < min)
+      span = min;
+   if (span > TIMER_SPAN_MAX)
+      return; /* Current compare is about to hit. */
+
+   timer_span = span;
+   OCR0A      = span * TIMER_TICK_COUNTS - 1;
+}
+#endif /* TIMER_TICKLESS */
+
+
+/**
+ * @brief Inserts a timer into the list.
+ *
+ * Must be called with interrupts disabled.
+ *
+ *    @param t Timer to insert.
+ *    @param ticks Ticks until it expires.
+ */
+static void timer_insert( uint8_t t, uint16_t ticks )
+{
+   uint8_t prev, cur;
+
+   /* Find the spot, timers expiring together keep insertion order. */
+   prev = TIMER_NONE;
+   cur  = timer_head;
+   while ((cur != TIMER_NONE) && (timers[cur].delta <= ticks)) {
+      ticks -= timers[cur].delta;
+      prev   = cur;
+      cur    = timers[cur].next;
+   }
+
+   /* Link in. */
+   timers[t].delta = ticks;
+   timers[t].prev  = prev;
+   timers[t].next  = cur;
+   if (cur != TIMER_NONE) {
+      timers[cur].delta -= ticks;
+      timers[cur].prev   = t;
+   }
+   if (prev == TIMER_NONE)
+      timer_head = t;
+   else
+      timers[prev].next = t;
+   timers[t].flags |= TIMER_FLAG_ARMED;
+}
+
+
+/**
+ * @brief Removes a timer from the list.
+ *
+ * Must be called with interrupts disabled.
+ *
+ *    @param t Timer to remove.
+ */
+static void timer_unlink( uint8_t t )
+{
+   uint8_t prev, next;
+
+   if (!(timers[t].flags & TIMER_FLAG_ARMED))
+      return;
+
+   /* Next timer inherits our ticks. */
+   prev = timers[t].prev;
+   next = timers[t].next;
+   if (next != TIMER_NONE) {
+      timers[next].delta += timers[t].delta;
+      timers[next].prev   = prev;
+   }
+   if (prev == TIMER_NONE)
+      timer_head = next;
+   else
+      timers[prev].next = next;
+   timers[t].flags &= ~TIMER_FLAG_ARMED;
 }
 
 
@@ -64,8 +347,13 @@ void timer_init (void)
    PRR   &= ~_BV(PRTIM0);
 
    /* Clear timers. */
-   for (i=0; i<MAX_TIMERS; i++)
-      timers[i].left = 0;
+   timer_head   = TIMER_NONE;
+   timer_epoch  = 0;
+   timer_span   = 1;
+   timer_us     = 0;
+   timer_usFrac = 0;
+   for (i=0; i<TIMER_MAX; i++)
+      timers[i].flags = 0;
 
    /* Set up timer. */
    /* CTC Mode
@@ -86,41 +374,197 @@ void timer_init (void)
     *  Since we generate 2 interrupts each cycle, we'll need it to be at twice.
     *
     *  TOP*2 = 76
+    *
+    *  In tickless mode OCR0A gets reprogrammed to a multiple of this.
     */
    TCCR0A = _BV(WGM01); /* CTC mode. */
    TCCR0B = _BV(CS02); /* 256 prescaler. */
    TCNT0  = 0; /* Clear timer. */
-   OCR0A  = 76;
+   OCR0A  = TIMER_TICK_COUNTS - 1;
    OCR0B  = 0;
    TIMSK0 = _BV(OCIE0A); /* Enable interrupt. */
+}
 
 
-   /* Set up watchdog timer. */
-   wdt_reset(); /* Just in case. */
-   wdt_enable( WDTO_250MS );
+/**
+ * @brief Runs the callback of an expired timer.
+ */
+static int timer_callback( event_t *evt )
+{
+   void (*func)(int);
+
+   func = timers[ evt->timer.handle ].func;
+   if (func != NULL)
+      func( evt->timer.timer );
+
+   return 0; /* Still deliver the event. */
 }
 
 
 void timer_exit (void)
 {
+   int i;
+
    PRR |= _BV(PRTIM0); /* Disable timer. */
 
-   /* Disable watchdog timer. */
-   wdt_reset(); /* Important according to datasheet. */
-   wdt_disable();
+   /* Free all timers. */
+   for (i=0; i<TIMER_MAX; i++)
+      timer_free( i );
+}
+
+
+uint16_t timer_ticks (void)
+{
+   uint8_t sreg;
+   uint16_t ticks;
+
+   sreg  = SREG;
+   cli();
+   ticks = timer_tick + timer_pending();
+   SREG  = sreg;
+
+   return ticks;
+}
+
+
+uint32_t timer_now_us (void)
+{
+   uint8_t sreg;
+   uint16_t counts;
+   uint32_t us;
+
+   sreg   = SREG;
+   cli();
+   us     = timer_us;
+   counts = timer_counts();
+   SREG   = sreg;
+
+   return us + ((uint32_t)counts * 64) / 5; /* 12.8 us per count. */
+}
+
+
+uint16_t timer_stampEpoch (void)
+{
+   uint16_t counts;
+   uint8_t ticks;
+
+   counts = TCNT0 * TIMER_EPOCH_SCALE;
+   ticks  = counts / TIMER_TICK_COUNTS;
+
+   return ((uint16_t)(timer_tick + ticks) << 8) |
+         (uint8_t)(counts - ticks * TIMER_TICK_COUNTS);
+}
+
+
+uint32_t timer_elapsed( uint32_t since )
+{
+   return timer_now_us() - since;
+}
+
+
+int timer_alloc( uint8_t id, void (*func)(int) )
+{
+   int i, t;
+   uint8_t sreg;
+
+   sreg = SREG;
+   cli();
+
+   /* Find a free slot making sure the identifier is unique. */
+   t = TIMER_INVALID;
+   for (i=0; i<TIMER_MAX; i++) {
+      if (timers[i].flags & TIMER_FLAG_USED) {
+         if (timers[i].id == id) {
+            SREG = sreg;
+            return TIMER_INVALID;
+         }
+      }
+      else if (t == TIMER_INVALID)
+         t = i;
+   }
+   if (t != TIMER_INVALID) {
+      timers[t].flags  = TIMER_FLAG_USED;
+      timers[t].id     = id;
+      timers[t].period = 0;
+      timers[t].func   = func;
+   }
+
+   SREG = sreg;
+
+   /* Callback runs when the event is dispatched. */
+   if ((t != TIMER_INVALID) && (func != NULL))
+      event_subscribe( &timer_subs[t], EVENT_TYPE_TIMER, id, timer_callback );
+
+   return t;
+}
+
+
+void timer_free( int timer )
+{
+   uint8_t sreg;
+
+   if ((timer < 0) || (timer >= TIMER_MAX) ||
+         !(timers[ timer ].flags & TIMER_FLAG_USED))
+      return;
+
+   sreg = SREG;
+   cli();
+   timer_unlink( timer );
+   timers[ timer ].flags = 0;
+   SREG = sreg;
+
+   if (timers[ timer ].func != NULL)
+      event_unsubscribe( &timer_subs[ timer ] );
+}
+
+
+/**
+ * @brief Arms a timer.
+ *
+ *    @param timer Handle of the timer to arm.
+ *    @param ms Ticks until it first expires, 0 stops it.
+ *    @param period Period to rearm with, 0 for one shot.
+ */
+static void timer_arm( int timer, uint16_t ms, uint16_t period )
+{
+   uint8_t sreg, elapsed;
+
+   if ((timer < 0) || (timer >= TIMER_MAX))
+      return;
+
+   sreg = SREG;
+   cli();
+   timer_unlink( timer );
+   timers[ timer ].period = period;
+   if (ms > 0) {
+      /* List counts from the last compare, not from now. */
+      elapsed = timer_pending();
+      if (ms > UINT16_MAX - elapsed)
+         ms = UINT16_MAX - elapsed;
+      timer_insert( timer, ms + elapsed );
+#if TIMER_TICKLESS
+      timer_program();
+#endif /* TIMER_TICKLESS */
+   }
+   SREG = sreg;
+}
+
+
+void timer_start( int timer, uint16_t ms )
+{
+   timer_arm( timer, ms, 0 );
 }
 
 
-void timer_start( int timer, uint16_t ms, void (*func)(int) )
+void timer_periodic( int timer, uint16_t ms )
 {
-   timers[ timer ].left = ms;
-   timers[ timer ].func = func;
+   timer_arm( timer, ms, ms );
 }
 
 
 void timer_stop( int timer )
 {
-   timers[ timer ].left = 0;
+   timer_arm( timer, 0, 0 );
 }
 
 
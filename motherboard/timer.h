@@ -12,11 +12,59 @@
  *
  * @brief Timer infrastructure for the LACE motherboard.
  *
+ * Timers are allocated with an identifier that is reported as the source of
+ *  their events, and are kept in a list sorted by expiry where each timer
+ *  stores the ticks left after the previous one. The tick only has to
+ *  decrement the head of the list.
+ *
+ * @code
+ * int tmr = timer_alloc( FSM_TIMER_BLINK, NULL );
+ * timer_periodic( tmr, 500 );
+ * @endcode
+ *
+ * With TIMER_TICKLESS the compare is programmed for the next deadline instead
+ *  of every tick, so the CPU only wakes when a timer is due or when the 8 bit
+ *  counter would run out (TIMER_SPAN_MAX ticks). The tick count is kept in
+ *  software and advanced by the span of each compare.
+ *
+ * When nothing is due for TIMER_EPOCH_SPAN ticks the compare switches TIMER0
+ *  to the 1024 prescaler for an epoch of that many ticks, so idle wakeups drop
+ *  from 1 kHz to about 83 Hz and the watchdog still gets checked every 12 ms.
+ *  Arming a timer that is due sooner cuts the epoch short. Counts within an
+ *  epoch are 51.2 us, timer_now_us and TIMER_STAMP scale them back to 12.8 us
+ *  ones. Each switch of prescaler can lose or gain up to one count.
+ *  TIMER1 drives PWM1 and TIMER2 paces the software SPI, so neither is free
+ *  for a longer span.
+ *
  * @note This uses TIMER0.
  */
 
 
-#define MAX_TIMERS   4 /**< Maximum number of available timers. */
+#define TIMER_INVALID      -1 /**< Invalid timer handle. */
+#define TIMER_TICK_COUNTS  77 /**< TIMER0 counts per tick, 12.8 us each. */
+#define TIMER_SPAN_MAX     (256/TIMER_TICK_COUNTS) /**< Most ticks one compare can span. */
+#define TIMER_EPOCH_SCALE  4 /**< 12.8 us counts per TIMER0 count in an epoch. */
+#define TIMER_EPOCH_SPAN   (TIMER_SPAN_MAX*TIMER_EPOCH_SCALE) /**< Ticks one epoch spans. */
+#define TIMER_TICK_US      985 /**< Whole microseconds per tick. */
+#define TIMER_TICK_US_FRAC 3 /**< Extra fifths of microsecond per tick (985.6 us). */
+
+
+extern volatile uint16_t timer_tick; /**< Ticks elapsed at the last compare, wraps around. */
+extern volatile uint8_t timer_epoch; /**< TIMER0 runs at the 1024 prescaler. */
+
+
+/**
+ * @brief Cheap 16 bit timestamp.
+ *
+ * The high byte is the low byte of the tick count at the last compare, the low
+ *  byte is TCNT0 which counts at 12.8 us since that compare. In tickless mode
+ *  TCNT0 can go past a tick so decode it as tick*TIMER_TICK_COUNTS + TCNT0.
+ *  Within an epoch timer_stampEpoch gives the same encoding.
+ *
+ * @note Not atomic, call with interrupts disabled.
+ */
+#define TIMER_STAMP()   (timer_epoch ? timer_stampEpoch() : \
+      ((uint16_t)(timer_tick << 8) | TCNT0))
 
 
 /**
@@ -32,19 +80,91 @@ void timer_exit (void);
 
 
 /**
- * @brief Starts a timer.
+ * @brief Gets the amount of ticks (roughly milliseconds) elapsed.
+ *
+ *    @return Ticks elapsed since timer_init, wraps around.
+ */
+uint16_t timer_ticks (void);
+
+
+/**
+ * @brief Gets the time with microsecond resolution.
+ *
+ * Built from the tick count and TCNT0 so the resolution is 12.8 us. Safe to
+ *  call from interrupts.
+ *
+ *    @return Microseconds elapsed since timer_init, wraps around after about
+ *            71 minutes.
+ */
+uint32_t timer_now_us (void);
+
+
+/**
+ * @brief Gets the time elapsed since a timestamp.
+ *
+ *    @param since Timestamp gotten from timer_now_us.
+ *    @return Microseconds elapsed since the timestamp.
+ */
+uint32_t timer_elapsed( uint32_t since );
+
+
+/**
+ * @brief Gets TIMER_STAMP while in an epoch.
+ *
+ * @note Not atomic, call with interrupts disabled.
+ *
+ *    @return Timestamp with the counts scaled to 12.8 us.
+ */
+uint16_t timer_stampEpoch (void);
+
+
+/**
+ * @brief Allocates a timer.
+ *
+ *    @param id Identifier of the timer, timer events report it as their source.
+ *              Must not be in use by another allocated timer.
+ *    @param func Function callback when timer is up or NULL to not use. It is
+ *                passed the timer identifier and run when the timer event is
+ *                dispatched, before the event reaches the FSM.
+ *    @return Handle to the timer or TIMER_INVALID on failure.
+ */
+int timer_alloc( uint8_t id, void (*func)(int) );
+
+
+/**
+ * @brief Frees a timer, stopping it if running.
+ *
+ *    @param timer Handle of the timer to free, invalid handles are ignored.
+ */
+void timer_free( int timer );
+
+
+/**
+ * @brief Starts a one shot timer.
+ *
+ * Restarts the timer if it was already running.
+ *
+ *    @param timer Handle of the timer to start, invalid handles are ignored.
+ *    @param ms Milliseconds for the timer to wait, 0 stops the timer.
+ */
+void timer_start( int timer, uint16_t ms );
+
+
+/**
+ * @brief Starts a periodic timer.
+ *
+ * The timer gets rearmed from the tick it expires on so it doesn't drift.
  *
- *    @param timer Timer to start.
- *    @param ms Milliseconds for the timer to wait.
- *    @param func Function callback when timer is up or NULL to not use.
+ *    @param timer Handle of the timer to start, invalid handles are ignored.
+ *    @param ms Period in milliseconds, 0 stops the timer.
  */
-void timer_start( int timer, uint16_t ms, void (*func)(int) );
+void timer_periodic( int timer, uint16_t ms );
 
 
 /**
  * @brief Stops a timer.
  *
- *    @param timer timer to stop.
+ *    @param timer Handle of the timer to stop, invalid handles are ignored.
  */
 void timer_stop( int timer );
 
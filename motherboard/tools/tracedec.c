@@ -0,0 +1,253 @@
+
+
+/**
+ * @file tracedec.c
+ *
+ * @brief Host side decoder for the motherboard event trace.
+ *
+ * Reads the binary frames sent by comm_traceDump() and prints per event type
+ *  latency histograms and the queue depth timeline.
+ *
+ * Build and use on the host:
+ *
+ * @code
+ * gcc -std=c99 -O2 -o tracedec tracedec.c
+ * ./tracedec < capture.bin
+ * @endcode
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+
+
+#define TRACE_SYNC0        0xA5 /**< Must match COMM_TRACE_SYNC0. */
+#define TRACE_SYNC1        0x5A /**< Must match COMM_TRACE_SYNC1. */
+#define TRACE_REC_LEN      4 /**< Size of event_trace_t. */
+#define TRACE_MAX_REC      255 /**< Maximum records in a frame. */
+
+#define TRACE_PUSH         0x1
+#define TRACE_MERGE        0x2
+#define TRACE_DROP         0x3
+#define TRACE_POLL         0x4
+#define TRACE_DISPATCH     0x5
+#define TRACE_RETURN       0x6
+
+#define TYPE_MAX           16 /**< Event type fits in a nibble. */
+#define PENDING_MAX        64 /**< Maximum pushes in flight per type. */
+#define HIST_BUCKETS       16 /**< Power of two microsecond buckets. */
+
+#define US_PER_COUNT       12.8 /**< TIMER0 count at 20 MHz / 256. */
+#define COUNTS_PER_TICK    77 /**< OCR0A + 1. */
+
+
+static const char *type_names[] = {
+   "NONE", "SPI", "I2C", "MODULE", "ADC", "TIMER", "CUSTOM"
+};
+
+
+/**
+ * @brief Per event type statistics.
+ */
+typedef struct type_stats_s {
+   double pending[ PENDING_MAX ]; /**< Push times waiting for their poll. */
+   int head; /**< Oldest pending push. */
+   int len; /**< Amount of pending pushes. */
+   double dispatch; /**< Time of last dispatch. */
+   unsigned long queue[ HIST_BUCKETS ]; /**< Push to poll latency. */
+   unsigned long cb[ HIST_BUCKETS ]; /**< Dispatch to return latency. */
+   unsigned long merged; /**< Coalesced pushes. */
+   unsigned long dropped; /**< Dropped pushes. */
+} type_stats_t;
+
+
+static type_stats_t stats[ TYPE_MAX ];
+static double time_base = 0.; /**< Time of tick counter wrap in us. */
+static int last_tick = -1; /**< Last tick counter seen. */
+
+
+/**
+ * @brief Dallas CRC-8, same as _crc_ibutton_update.
+ */
+static uint8_t crc_update( uint8_t crc, uint8_t data )
+{
+   int i;
+   crc ^= data;
+   for (i=0; i<8; i++)
+      crc = (crc & 0x01) ? (crc >> 1) ^ 0x8C : (crc >> 1);
+   return crc;
+}
+
+
+/**
+ * @brief Converts a stamp to microseconds, unwrapping the tick counter.
+ */
+static double stamp_us( uint16_t stamp )
+{
+   int tick = stamp >> 8;
+   if ((last_tick >= 0) && (tick < last_tick))
+      time_base += 256. * COUNTS_PER_TICK * US_PER_COUNT;
+   last_tick = tick;
+   return time_base + (tick * COUNTS_PER_TICK + (stamp & 0xFF)) * US_PER_COUNT;
+}
+
+
+/**
+ * @brief Adds a latency to a histogram.
+ */
+static void hist_add( unsigned long *hist, double us )
+{
+   int b = 0;
+   while ((b < HIST_BUCKETS-1) && (us >= (double)(1 << b)))
+      b++;
+   hist[b]++;
+}
+
+
+/**
+ * @brief Gets the amount of samples in a histogram.
+ */
+static unsigned long hist_total( const unsigned long *hist )
+{
+   int b;
+   unsigned long total = 0;
+   for (b=0; b<HIST_BUCKETS; b++)
+      total += hist[b];
+   return total;
+}
+
+
+/**
+ * @brief Prints a histogram.
+ */
+static void hist_print( const char *name, const unsigned long *hist )
+{
+   int b;
+   unsigned long total;
+
+   total = hist_total( hist );
+   if (total == 0)
+      return;
+
+   printf( "   %s (%lu samples)\n", name, total );
+   for (b=0; b<HIST_BUCKETS; b++) {
+      if (hist[b] == 0)
+         continue;
+      printf( "      < %6d us: %lu\n", 1 << b, hist[b] );
+   }
+}
+
+
+/**
+ * @brief Processes a single trace record.
+ */
+static void trace_record( const uint8_t *rec )
+{
+   int what, type;
+   uint8_t arg;
+   double t;
+   type_stats_t *s;
+
+   what = rec[0] >> 4;
+   type = rec[0] & 0x0F;
+   arg  = rec[1];
+   t    = stamp_us( rec[2] | (rec[3] << 8) );
+   s    = &stats[ type ];
+
+   switch (what) {
+      case TRACE_PUSH:
+         if (s->len < PENDING_MAX) {
+            s->pending[ (s->head + s->len) % PENDING_MAX ] = t;
+            s->len++;
+         }
+         printf( "depth %.1f %s %u\n", t, type_names[ type % 7 ], arg );
+         break;
+
+      case TRACE_MERGE:
+         s->merged++;
+         break;
+
+      case TRACE_DROP:
+         s->dropped++;
+         break;
+
+      case TRACE_POLL:
+         if (s->len > 0) {
+            hist_add( s->queue, t - s->pending[ s->head ] );
+            s->head = (s->head + 1) % PENDING_MAX;
+            s->len--;
+         }
+         printf( "depth %.1f %s %u\n", t, type_names[ type % 7 ], arg );
+         break;
+
+      case TRACE_DISPATCH:
+         s->dispatch = t;
+         break;
+
+      case TRACE_RETURN:
+         hist_add( s->cb, t - s->dispatch );
+         break;
+
+      default:
+         break;
+   }
+}
+
+
+int main( int argc, char *argv[] )
+{
+   FILE *f;
+   int c, i, n, bad;
+   uint8_t crc, buf[ TRACE_MAX_REC * TRACE_REC_LEN + 1 ];
+
+   f = stdin;
+   if (argc > 1) {
+      f = fopen( argv[1], "rb" );
+      if (f == NULL) {
+         perror( argv[1] );
+         return 1;
+      }
+   }
+
+   /* Parse frames. */
+   bad = 0;
+   while ((c = fgetc( f )) != EOF) {
+      if ((c != TRACE_SYNC0) || (fgetc( f ) != TRACE_SYNC1))
+         continue;
+      if ((n = fgetc( f )) == EOF)
+         break;
+      if (fread( buf, 1, n * TRACE_REC_LEN + 1, f ) != (size_t)(n * TRACE_REC_LEN + 1))
+         break;
+
+      /* Check CRC. */
+      crc = crc_update( 0, n );
+      for (i=0; i<n*TRACE_REC_LEN; i++)
+         crc = crc_update( crc, buf[i] );
+      if (crc != buf[ n*TRACE_REC_LEN ]) {
+         bad++;
+         continue;
+      }
+
+      for (i=0; i<n; i++)
+         trace_record( &buf[ i*TRACE_REC_LEN ] );
+   }
+   if (f != stdin)
+      fclose( f );
+
+   /* Print histograms. */
+   for (i=0; i<TYPE_MAX; i++) {
+      if ((stats[i].merged == 0) && (stats[i].dropped == 0) &&
+            (hist_total( stats[i].queue ) == 0) && (hist_total( stats[i].cb ) == 0))
+         continue;
+      printf( "%s: %lu merged, %lu dropped\n", type_names[ i % 7 ],
+            stats[i].merged, stats[i].dropped );
+      hist_print( "queue latency", stats[i].queue );
+      hist_print( "callback time", stats[i].cb );
+   }
+   if (bad > 0)
+      fprintf( stderr, "%d frames with bad CRC\n", bad );
+
+   return 0;
+}
+
+
@@ -0,0 +1,134 @@
+
+
+#include "conf.h"
+
+#include "wdog.h"
+
+#include <stdio.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/wdt.h>
+
+#include "timer.h"
+
+
+#define WDOG_MAGIC      0x5A /**< Marks the stalled task as valid. */
+
+
+/**
+ * @brief A monitored task.
+ */
+typedef struct wdog_s {
+   uint16_t last; /**< Tick of the last check in. */
+   uint16_t timeout; /**< Ticks allowed between check ins. */
+} wdog_t;
+
+
+static wdog_t wdog_tasks[ WDOG_TASK_MAX ]; /**< Monitored tasks. */
+static volatile uint8_t wdog_active = 0; /**< Mask of started tasks. */
+static uint8_t wdog_mcusr = 0; /**< Reset cause. */
+static uint8_t wdog_stalled __attribute__((section(".noinit"))); /**< Task that stalled, survives reset. */
+static uint8_t wdog_magic __attribute__((section(".noinit"))); /**< WDOG_MAGIC if wdog_stalled is set. */
+static const char *wdog_names[ WDOG_TASK_MAX ] = {
+   [WDOG_TASK_MAIN]  = "main",
+   [WDOG_TASK_SPI]   = "spi",
+   [WDOG_TASK_I2C]   = "i2c",
+   [WDOG_TASK_DHB]   = "dhb"
+};
+
+
+void wdog_boot (void)
+{
+   /* WDRF must be cleared before the watchdog can be disabled. */
+   wdog_mcusr = MCUSR;
+   MCUSR      = 0;
+   wdt_disable();
+}
+
+
+void wdog_init (void)
+{
+   /* Report stall. */
+   if (wdog_mcusr & _BV(WDRF)) {
+      if ((wdog_magic == WDOG_MAGIC) && (wdog_stalled < WDOG_TASK_MAX))
+         printf( "Watchdog reset: task %s stalled\n", wdog_names[ wdog_stalled ] );
+      else
+         printf( "Watchdog reset\n" );
+   }
+   wdog_magic  = 0;
+   wdog_active = 0;
+
+   /* Set up watchdog timer. */
+   wdt_reset(); /* Just in case. */
+   wdt_enable( WDTO_250MS );
+}
+
+
+void wdog_exit (void)
+{
+   wdog_active = 0;
+
+   /* Disable watchdog timer. */
+   wdt_reset(); /* Important according to datasheet. */
+   wdt_disable();
+}
+
+
+void wdog_start( wdog_task_t task, uint16_t ms )
+{
+   uint8_t sreg;
+
+   sreg = SREG;
+   cli();
+   wdog_tasks[ task ].last    = timer_tick;
+   wdog_tasks[ task ].timeout = ms;
+   wdog_active |= _BV(task);
+   SREG = sreg;
+}
+
+
+void wdog_stop( wdog_task_t task )
+{
+   uint8_t sreg;
+
+   sreg = SREG;
+   cli();
+   wdog_active &= ~_BV(task);
+   SREG = sreg;
+}
+
+
+void wdog_kick( wdog_task_t task )
+{
+   uint8_t sreg;
+
+   sreg = SREG;
+   cli();
+   wdog_tasks[ task ].last = timer_tick;
+   SREG = sreg;
+}
+
+
+void wdog_check( uint16_t now )
+{
+   uint8_t i;
+
+   for (i=0; i<WDOG_TASK_MAX; i++) {
+      if (!(wdog_active & _BV(i)))
+         continue;
+      if ((uint16_t)(now - wdog_tasks[i].last) > wdog_tasks[i].timeout) {
+         /* Remember the first task to stall. */
+         if (wdog_magic != WDOG_MAGIC) {
+            wdog_stalled = i;
+            wdog_magic   = WDOG_MAGIC;
+         }
+         return; /* Starve the hardware watchdog. */
+      }
+   }
+
+   /* Everything checked in again, a stall that recovered isn't reported. */
+   wdog_magic = 0;
+   wdt_reset();
+}
+
+
@@ -0,0 +1,98 @@
+
+
+#ifndef _WDOG_H
+#  define _WDOG_H
+
+
+#include <stdint.h>
+
+
+/**
+ * @file
+ *
+ * @brief Software watchdog monitoring task liveness.
+ *
+ * Each task is started with a timeout and has to check in before it runs out.
+ *  The timer tick only feeds the hardware watchdog while every started task is
+ *  live, so a stalled task ends up resetting the MCU. The stalled task is kept
+ *  in RAM that survives the reset and reported at boot.
+ *
+ * Transaction style tasks (SPI, I2C, DHB) are started when the transaction
+ *  begins and stopped when it completes, the main loop checks in each pass.
+ */
+
+
+/**
+ * @brief Monitored tasks.
+ */
+typedef enum wdog_task_e {
+   WDOG_TASK_MAIN, /**< Main loop. */
+   WDOG_TASK_SPI, /**< SPI transaction. */
+   WDOG_TASK_I2C, /**< I2C transaction. */
+   WDOG_TASK_DHB, /**< DHB command waiting for reply. */
+   WDOG_TASK_MAX /**< Amount of tasks, must be 8 or less. */
+} wdog_task_t;
+
+
+/**
+ * @brief Saves the reset cause and disables the hardware watchdog.
+ *
+ * Must be the first thing run on boot, the watchdog stays enabled through a
+ *  watchdog reset.
+ */
+void wdog_boot (void);
+
+
+/**
+ * @brief Reports the task that stalled if the last reset was caused by the
+ *        watchdog and enables the hardware watchdog.
+ *
+ * Must be called after the timer infrastructure and stdio are up.
+ */
+void wdog_init (void);
+
+
+/**
+ * @brief Disables the watchdog.
+ */
+void wdog_exit (void);
+
+
+/**
+ * @brief Starts monitoring a task.
+ *
+ *    @param task Task to monitor.
+ *    @param ms Milliseconds the task may go without checking in.
+ */
+void wdog_start( wdog_task_t task, uint16_t ms );
+
+
+/**
+ * @brief Stops monitoring a task.
+ *
+ *    @param task Task to stop monitoring.
+ */
+void wdog_stop( wdog_task_t task );
+
+
+/**
+ * @brief Checks a task in.
+ *
+ *    @param task Task that is alive.
+ */
+void wdog_kick( wdog_task_t task );
+
+
+/**
+ * @brief Checks all the tasks and feeds the hardware watchdog if they're live.
+ *
+ * Run from the timer interrupt.
+ *
+ *    @param now Current tick count.
+ */
+void wdog_check( uint16_t now );
+
+
+#endif /* _WDOG_H */
+
+
@@ -1,4 +1,5 @@
 
+
 #include "wmp.h"
 
 #include <string.h>
@@ -13,17 +14,35 @@
  * Overview:
  *
  * wmp_start --> wmp_read --> wmp_done --> send event
+ *
+ * The handlers stay subscribed to the WM+ addresses, wmp_state tracks which
+ *  step of the conversation the next I2C event belongs to.
  */
 
 
+#define WMP_ADDR_INIT   0x53 /**< Address of the WM+ before being activated. */
+#define WMP_ADDR        0x52 /**< Address of the WM+ once activated. */
+
+
+#define WMP_STATE_IDLE  0 /**< Nothing going on. */
+#define WMP_STATE_ON    1 /**< Waiting for the activation write. */
+#define WMP_STATE_READ  2 /**< Waiting for the read request write. */
+#define WMP_STATE_DONE  3 /**< Waiting for the data read. */
+#define WMP_STATE_OFF   4 /**< Waiting for the deactivation write. */
+
+
 /*
  * Prototypes.
  */
 static void wmp_err (void);
+static int wmp_handler( event_t *evt );
 static int wmp_on( event_t *evt );
 static int wmp_read( event_t *evt );
 static int wmp_done( event_t *evt );
 static uint16_t wmp_buf[3];
+static volatile uint8_t wmp_state = WMP_STATE_IDLE; /**< Current WM+ state. */
+static event_sub_t wmp_sub_init; /**< Subscription to the activation address. */
+static event_sub_t wmp_sub; /**< Subscription to the normal address. */
 
 
 void wmp_init (void)
@@ -31,20 +50,23 @@ void wmp_init (void)
    /* Initialize I2C at 400 kHz. */
    i2cm_init( I2C_FREQ_400K );
 
+   /* Listen on both addresses. */
+   event_subscribe( &wmp_sub_init, EVENT_TYPE_I2C, WMP_ADDR_INIT, wmp_handler );
+   event_subscribe( &wmp_sub, EVENT_TYPE_I2C, WMP_ADDR, wmp_handler );
+
    /* Initializes the WM+ */
-   i2cm_start( 0x53, I2C_WRITE );
+   wmp_state = WMP_STATE_ON;
+   i2cm_start( WMP_ADDR_INIT, I2C_WRITE );
    i2cm_transmitChar( 0xFE );
    i2cm_transmitChar( 0x04 );
    i2cm_end();
-
-   /* Set event for when it's on. */
-   event_setCallback( EVENT_TYPE_I2C, wmp_on );
 }
 
 
 void wmp_exit (void)
 {
-   i2cm_start( 0x52, I2C_WRITE );
+   wmp_state = WMP_STATE_OFF;
+   i2cm_start( WMP_ADDR, I2C_WRITE );
    i2cm_transmitChar( 0xF0 );
    i2cm_transmitChar( 0x55 );
    i2cm_end();
@@ -53,10 +75,10 @@ void wmp_exit (void)
 
 void wmp_start (void)
 {
-   i2cm_start( 0x52, I2C_WRITE );
+   wmp_state = WMP_STATE_READ;
+   i2cm_start( WMP_ADDR, I2C_WRITE );
    i2cm_transmitChar( 0x00 );
    i2cm_end();
-   event_setCallback( EVENT_TYPE_I2C, wmp_read ); /* Start transmission. */
 }
 
 
@@ -73,6 +95,31 @@ static void wmp_err (void)
 }
 
 
+/**
+ * @brief Routes I2C events from the WM+ to the current step.
+ */
+static int wmp_handler( event_t *evt )
+{
+   uint8_t state;
+
+   state     = wmp_state;
+   wmp_state = WMP_STATE_IDLE;
+
+   switch (state) {
+      case WMP_STATE_ON:
+         return wmp_on( evt );
+      case WMP_STATE_READ:
+         return wmp_read( evt );
+      case WMP_STATE_DONE:
+         return wmp_done( evt );
+      case WMP_STATE_OFF:
+         return 1;
+      default:
+         return 0; /* Not ours, let it through. */
+   }
+}
+
+
 static int wmp_on( event_t *evt )
 {
    event_t wmp_evt;
@@ -80,7 +127,6 @@ static int wmp_on( event_t *evt )
    /* Failure. */
    if (!evt->i2c.ok) {
       wmp_err();
-      event_setCallback( EVENT_TYPE_I2C, NULL );
       return 1;
    }
 
@@ -99,15 +145,14 @@ static int wmp_read( event_t *evt )
    /* Failure. */
    if (!evt->i2c.ok) {
       wmp_err();
-      event_setCallback( EVENT_TYPE_I2C, NULL );
       return 1;
    }
 
-   /* Ask for 6 bytes of data. */
-   i2cm_recieve( 0x52, 6 );
-
    /* Next step is to process the data when we get it. */
-   event_setCallback( EVENT_TYPE_I2C, wmp_done );
+   wmp_state = WMP_STATE_DONE;
+
+   /* Ask for 6 bytes of data. */
+   i2cm_recieve( WMP_ADDR, 6 );
 
    /* Destroy the event. */
    return 1;
@@ -122,7 +167,6 @@ static int wmp_done( event_t *evt )
    /* Failure. */
    if (!evt->i2c.ok) {
       wmp_err();
-      event_setCallback( EVENT_TYPE_I2C, NULL );
       return 1;
    }
 
@@ -134,9 +178,6 @@ static int wmp_done( event_t *evt )
    wmp_buf[ WMP_PITCH ]   = ((uint16_t)buf[4] << 6) + buf[1];
    wmp_buf[ WMP_ROLL ]    = ((uint16_t)buf[5] << 6) + buf[2];
 
-   /* Disable callback. */
-   event_setCallback( EVENT_TYPE_I2C, NULL );
-
    /* Generate event. */
    wmp_evt.type         = EVENT_TYPE_CUSTOM;
    wmp_evt.custom.id    = WMP_EVENT_DATA;